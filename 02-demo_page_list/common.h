@@ -3,7 +3,18 @@
 
 #define DEV_NAME									"demo_find_pagelist"
 
+/*
+ * How the device (or the kernel) is going to touch the pinned buffer.
+ * Read-only buffers are pinned without FOLL_WRITE so that COW is not broken.
+ */
+enum access_dir {
+	ACCESS_BIDIRECTIONAL		= 0,
+	ACCESS_READ_ONLY,
+	ACCESS_WRITE_ONLY,
+};
+
 #ifdef __COMPILE_KERNEL_CODE
+#include <linux/ktime.h>
 
 #define dbg_info(fmt, args...)											\
 	printk(KERN_NOTICE "In %s(%d): " fmt, __FILE__, __LINE__, ##args)
@@ -14,7 +25,7 @@
 #define kprintf(fmt, args...)			printk(KERN_NOTICE fmt, ##args)
 
 extern int get_pagelist_and_pin(unsigned long virt_addr, size_t length,
-		struct page ***p_page_list, unsigned long *p_npages);
+		int access, struct page ***p_page_list, unsigned long *p_npages);
 
 extern void free_page_list(struct page **pagelist, unsigned long npages);
 
@@ -22,6 +33,20 @@ extern int get_page_idx(unsigned long virtaddr, size_t off);
 
 extern unsigned long get_page_off(unsigned long virtaddr, size_t off);
 
+extern struct demo_stats *demo_stats;
+
+#define stats_add(field, n)												\
+	atomic64_add((n), (atomic64_t*)&demo_stats->field)
+
+extern int init_stats(void);
+
+extern void destroy_stats(void);
+
+extern void stats_hist_since(int hist, ktime_t start);
+
+extern unsigned long count_page_runs(struct page **page_list,
+		unsigned long npages);
+
 #else
 #include <error.h>
 
@@ -54,6 +79,49 @@ extern unsigned long get_page_off(unsigned long virtaddr, size_t off);
 struct write_param {
 	unsigned long				addr;
 	size_t						length;
+	int							access;
+};
+
+/*
+ * io_uring passthrough (IORING_OP_URING_CMD): sqe->cmd_op selects the
+ * command, and the command area of the SQE holds a struct uring_cmd_param
+ * pointing to a struct write_param in user memory. Each command completes
+ * with 0 or a negative errno in cqe->res.
+ */
+#define URING_CMD_PIN							1
+#define URING_CMD_UNPIN							2
+
+#include <linux/types.h>
+struct uring_cmd_param {
+	__u64						param;
+};
+
+/*
+ * Statistics of the module, exported through debugfs as text in
+ * demo_find_pagelist/stats and as this struct in the read-only page
+ * demo_find_pagelist/stats_page, which can be mmapped. The counters only
+ * grow. A run is a range of physically consecutive pages, what an sg list
+ * of the region would need one entry for.
+ *
+ * Bucket i of a latency histogram counts the samples of at least
+ * 2^(i-1) ns and less than 2^i ns (bucket 0 counts 0 ns); the last
+ * bucket also counts everything longer.
+ */
+#define STATS_HIST_BUCKETS						40
+
+enum stats_hist {
+	STATS_HIST_PIN				= 0,
+	STATS_HIST_TEARDOWN,
+	NR_STATS_HISTS,
+};
+
+struct demo_stats {
+	__u64						regions;
+	__u64						pin_errors;
+	__u64						pages_pinned;
+	__u64						pages_unpinned;
+	__u64						page_runs;
+	__u64						hist[NR_STATS_HISTS][STATS_HIST_BUCKETS];
 };
 
 #endif
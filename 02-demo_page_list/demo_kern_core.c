@@ -3,6 +3,8 @@
 #include <linux/sched/mm.h>
 #include <linux/sched/signal.h>
 #include <linux/atomic.h>
+#include <linux/slab.h>
+#include "../common/demo_compat.h"
 #include "common.h"
 
 static inline bool addr_int_overflow(unsigned long virt_addr, size_t length) {
@@ -16,15 +18,20 @@ static inline size_t get_npages(unsigned long addr, size_t size) {
 			: 0;
 }
 
+static inline unsigned int access_to_gup_flags(int access) {
+	return (access == ACCESS_READ_ONLY)? 0: (FOLL_WRITE | FOLL_FORCE);
+}
+
 int get_pagelist_and_pin(unsigned long virt_addr, size_t length,
-		struct page ***p_page_list, unsigned long *p_npages) {
+		int access, struct page ***p_page_list, unsigned long *p_npages) {
 	struct mm_struct *mm;
 	struct page **page_list;
 	unsigned long lock_limit;
 	unsigned long new_pinned;
 	unsigned long cur_base;
 	unsigned long npages;
-	unsigned int gup_flags = FOLL_WRITE;
+	unsigned long pinned;
+	unsigned int gup_flags;
 	int err = 0;
 
 	if(!p_page_list || !p_npages) {
@@ -36,6 +43,13 @@ int get_pagelist_and_pin(unsigned long virt_addr, size_t length,
 	*p_page_list = NULL;
 	*p_npages = 0;
 
+	if(access < ACCESS_BIDIRECTIONAL || access > ACCESS_WRITE_ONLY) {
+		err = -EINVAL;
+		err_info("invalid access direction: %d\n", access);
+		return err;
+	}
+	gup_flags = access_to_gup_flags(access);
+
 	if(addr_int_overflow(virt_addr, length)) {
 		err = -EINVAL;
 		err_info("address integer overflow\n");
@@ -48,21 +62,21 @@ int get_pagelist_and_pin(unsigned long virt_addr, size_t length,
 		return err;
 	}
 
+	npages = get_npages(virt_addr, length);
+	if(npages == 0 || npages > UINT_MAX) {
+		err = -EINVAL;
+		err_info("Page range overflow\n");
+		return err;
+	}
+
 	mm = current->mm;
 	mmgrab(mm);
 
-	page_list = (struct page **)__get_free_page(GFP_KERNEL);
+	page_list = kvmalloc_array(npages, sizeof(*page_list), GFP_KERNEL);
 	if(!page_list) {
 		err = -ENOMEM;
-		err_info("Failed to get free page\n");
-		goto err_get_free_page;
-	}
-
-	npages = get_npages(virt_addr, length);
-	if(npages == 0 || npages > UINT_MAX) {
-		err = -EINVAL;
-		err_info("Page range overflow\n");
-		goto err_npages;
+		err_info("Failed to alloc page list\n");
+		goto err_alloc_page_list;
 	}
 
 	lock_limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
@@ -74,20 +88,19 @@ int get_pagelist_and_pin(unsigned long virt_addr, size_t length,
 	}
 
 	cur_base = virt_addr & PAGE_MASK;
-	*p_npages = npages;
-	while(npages) {
-		down_read(&mm->mmap_sem);
-		err = get_user_pages(cur_base, npages,
-						gup_flags | FOLL_FORCE, page_list, NULL);
+	pinned = 0;
+	while(pinned < npages) {
+		mmap_read_lock(mm);
+		err = pin_pages(cur_base, npages - pinned,
+						gup_flags, page_list + pinned);
+		mmap_read_unlock(mm);
 		if(err < 0) {
 			err_info("Failed to get user pages\n");
-			up_read(&mm->mmap_sem);
 			goto err_get_upages;
 		}
 
 		cur_base += err * PAGE_SIZE;
-		npages -= err;
-		up_read(&mm->mmap_sem);
+		pinned += err;
 	}
 
 	err = 0;
@@ -96,11 +109,12 @@ int get_pagelist_and_pin(unsigned long virt_addr, size_t length,
 	return err;
 
 err_get_upages:
+	while(pinned)
+		unpin_page(page_list[--pinned]);
 err_npages_pinned:
 	atomic64_sub(npages, (atomic64_t*)&mm->pinned_vm);
-err_npages:
-	free_page((unsigned long)page_list);
-err_get_free_page:
+	kvfree(page_list);
+err_alloc_page_list:
 	mmdrop(mm);
 	return err;
 }
@@ -112,10 +126,10 @@ void free_page_list(struct page **pagelist, unsigned long npages) {
 		return;
 
 	for(i = 0; i < npages; i++) {
-		put_page(pagelist[i]);
+		unpin_page(pagelist[i]);
 	}
 	atomic64_sub(npages, (atomic64_t*)&current->mm->pinned_vm);
-	free_page((unsigned long)pagelist);
+	kvfree(pagelist);
 	mmdrop(current->mm);
 }
 
@@ -0,0 +1,132 @@
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include "../common/demo_compat.h"
+#include "common.h"
+
+struct demo_stats *demo_stats;
+
+static struct dentry *stats_dir;
+
+static const char * const stats_hist_names[NR_STATS_HISTS] = {
+	[STATS_HIST_PIN]			= "pin",
+	[STATS_HIST_TEARDOWN]		= "teardown",
+};
+
+void stats_hist_since(int hist, ktime_t start) {
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	int bucket = min_t(int, fls64(ns), STATS_HIST_BUCKETS - 1);
+
+	atomic64_inc((atomic64_t*)&demo_stats->hist[hist][bucket]);
+}
+
+unsigned long count_page_runs(struct page **page_list, unsigned long npages) {
+	unsigned long runs = npages? 1: 0;
+	unsigned long i;
+
+	for(i = 1; i < npages; i++) {
+		if(page_to_pfn(page_list[i]) != page_to_pfn(page_list[i-1]) + 1)
+			runs++;
+	}
+	return runs;
+}
+
+static int stats_show(struct seq_file *m, void *v) {
+	const struct demo_stats *stats = m->private;
+	u64 pages = READ_ONCE(stats->pages_pinned);
+	u64 runs = READ_ONCE(stats->page_runs);
+	int i, j;
+
+	seq_printf(m, "regions: %llu\n", READ_ONCE(stats->regions));
+	seq_printf(m, "pin_errors: %llu\n", READ_ONCE(stats->pin_errors));
+	seq_printf(m, "pages_pinned: %llu\n", pages);
+	seq_printf(m, "pages_unpinned: %llu\n", READ_ONCE(stats->pages_unpinned));
+	seq_printf(m, "page_runs: %llu\n", runs);
+	if(runs) {
+		u64 r = div64_u64(pages * 100, runs);
+		seq_printf(m, "pages_per_run: %llu.%02llu\n", r / 100, r % 100);
+	}
+
+	for(i = 0; i < NR_STATS_HISTS; i++) {
+		bool header = false;
+
+		for(j = 0; j < STATS_HIST_BUCKETS; j++) {
+			u64 n = READ_ONCE(stats->hist[i][j]);
+
+			if(!n)
+				continue;
+			if(!header) {
+				seq_printf(m, "%s_ns:\n", stats_hist_names[i]);
+				header = true;
+			}
+
+			if(j == 0)
+				seq_printf(m, "\t0: %llu\n", n);
+			else if(j == STATS_HIST_BUCKETS - 1)
+				seq_printf(m, "\t>= %llu: %llu\n", 1ULL << (j - 1), n);
+			else
+				seq_printf(m, "\t%llu - %llu: %llu\n",
+							1ULL << (j - 1), (1ULL << j) - 1, n);
+		}
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+/* A mapping holds a reference on the page, which outlives the module */
+static int stats_page_mmap(struct file *filep, struct vm_area_struct *vma) {
+	if(vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE ||
+				(vma->vm_flags & VM_WRITE))
+		return -EINVAL;
+
+	vm_flags_clear(vma, VM_MAYWRITE);
+	return vm_insert_page(vma, vma->vm_start,
+				virt_to_page(filep->private_data));
+}
+
+static ssize_t stats_page_read(struct file *filep, char __user *buf,
+			size_t count, loff_t *ppos) {
+	return simple_read_from_buffer(buf, count, ppos, filep->private_data,
+				sizeof(struct demo_stats));
+}
+
+/*
+ * The debugfs proxy has no mmap, so the file is created unsafe; the page
+ * lives as long as the module, which an open file pins.
+ */
+static const struct file_operations stats_page_fops = {
+	.owner			= THIS_MODULE,
+	.open			= simple_open,
+	.read			= stats_page_read,
+	.mmap			= stats_page_mmap,
+	.llseek			= default_llseek,
+};
+
+int init_stats(void) {
+	BUILD_BUG_ON(sizeof(struct demo_stats) > PAGE_SIZE);
+
+	demo_stats = (struct demo_stats*)get_zeroed_page(GFP_KERNEL);
+	if(!demo_stats) {
+		err_info("Failed to alloc stats page\n");
+		return -ENOMEM;
+	}
+
+	stats_dir = debugfs_create_dir(DEV_NAME, NULL);
+	debugfs_create_file("stats", 0444, stats_dir, demo_stats, &stats_fops);
+	debugfs_create_file_unsafe("stats_page", 0444, stats_dir, demo_stats,
+				&stats_page_fops);
+	return 0;
+}
+
+void destroy_stats(void) {
+	debugfs_remove_recursive(stats_dir);
+	free_page((unsigned long)demo_stats);
+}
@@ -4,40 +4,115 @@
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
 #include <linux/highmem.h>
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+#include "../common/demo_compat.h"
 #include "common.h"
 
-static struct page **page_list;
-static size_t npages;
+struct pinned_region {
+	struct list_head			ent;
+	unsigned long				addr;
+	size_t						length;
+	struct page					**page_list;
+	unsigned long				npages;
+};
 
-static ssize_t find_pgl_write(struct file *filep, const char __user *buf,
-					size_t size, loff_t *loff) {
-	struct write_param addr_param;
-	int *kvaddr = NULL;
-	unsigned long virtaddr;
-	size_t length;
-	int i;
-	unsigned long page_idx;
+struct find_pgl_ctx {
+	struct list_head			regions;
+	struct mutex				lock;
+};
+
+static int pin_region(struct find_pgl_ctx *ctx,
+				const struct write_param *param,
+				struct pinned_region **p_region) {
+	struct pinned_region *region;
+	ktime_t start = ktime_get();
 	int err = 0;
 
-	if(size != sizeof(struct write_param)) {
-		err = -EINVAL;
-		err_info("write size invalid\n");
+	region = kzalloc(sizeof(*region), GFP_KERNEL);
+	if(!region) {
+		err = -ENOMEM;
+		err_info("Failed to alloc region\n");
 		return err;
 	}
 
-	err = copy_from_user(&addr_param, buf, size);
+	region->addr = param->addr;
+	region->length = param->length;
+	err = get_pagelist_and_pin(region->addr, region->length, param->access,
+						&region->page_list, &region->npages);
 	if(err) {
-		err_info("error occurs when copying from user\n");
+		err_info("Failed to get pagelist\n");
+		stats_add(pin_errors, 1);
+		kfree(region);
 		return err;
 	}
 
-	virtaddr = addr_param.addr;
-	length = addr_param.length;
-	err = get_pagelist_and_pin(virtaddr, length, &page_list, &npages);
-	if(err) {
-		err_info("Failed to get pagelist\n");
-		return err;
+	stats_add(regions, 1);
+	stats_add(pages_pinned, region->npages);
+	stats_add(page_runs, count_page_runs(region->page_list, region->npages));
+	stats_hist_since(STATS_HIST_PIN, start);
+
+	mutex_lock(&ctx->lock);
+	list_add_tail(&region->ent, &ctx->regions);
+	mutex_unlock(&ctx->lock);
+
+	if(p_region)
+		*p_region = region;
+	return err;
+}
+
+static void free_region(struct pinned_region *region) {
+	ktime_t start = ktime_get();
+
+	free_page_list(region->page_list, region->npages);
+	stats_add(pages_unpinned, region->npages);
+	stats_hist_since(STATS_HIST_TEARDOWN, start);
+	kfree(region);
+}
+
+static int unpin_region(struct find_pgl_ctx *ctx,
+				const struct write_param *param) {
+	struct pinned_region *region, *found = NULL;
+
+	mutex_lock(&ctx->lock);
+	list_for_each_entry(region, &ctx->regions, ent) {
+		if(region->addr == param->addr &&
+					region->length == param->length) {
+			list_del(&region->ent);
+			found = region;
+			break;
+		}
+	}
+	mutex_unlock(&ctx->lock);
+
+	if(!found) {
+		err_info("No pinned region at 0x%lx\n", param->addr);
+		return -ENOENT;
+	}
+
+	free_region(found);
+	return 0;
+}
+
+static void unpin_all(struct find_pgl_ctx *ctx) {
+	struct pinned_region *region, *tmp;
+
+	list_for_each_entry_safe(region, tmp, &ctx->regions, ent) {
+		list_del(&region->ent);
+		free_region(region);
 	}
+}
+
+static int print_region(const struct pinned_region *region) {
+	struct page **page_list = region->page_list;
+	unsigned long virtaddr = region->addr;
+	size_t length = region->length;
+	int *kvaddr = NULL;
+	unsigned long page_idx = 0;
+	int i;
+	int err = 0;
 
 	kprintf("i""\t""\t""virtaddr""\t""off""\t""\t""pg_idx""\t""pg_off""\t""virtaddr[i]\n");
 	for(i = 0; i < length/sizeof(typeof(*kvaddr)); i++) {
@@ -64,17 +139,106 @@ static ssize_t find_pgl_write(struct file *filep, const char __user *buf,
 	}
 	kunmap(page_list[page_idx]);
 
+	return err;
+}
+
+static ssize_t find_pgl_write(struct file *filep, const char __user *buf,
+					size_t size, loff_t *loff) {
+	struct find_pgl_ctx *ctx = filep->private_data;
+	struct write_param addr_param;
+	struct pinned_region *region;
+	int err = 0;
+
+	if(size != sizeof(struct write_param)) {
+		err = -EINVAL;
+		err_info("write size invalid\n");
+		return err;
+	}
+
+	err = copy_from_user(&addr_param, buf, size);
+	if(err) {
+		err_info("error occurs when copying from user\n");
+		return err;
+	}
+
+	err = pin_region(ctx, &addr_param, &region);
+	if(err) {
+		return err;
+	}
+
+	err = print_region(region);
 	return (!err)? size: err;
 }
 
+#ifdef HAVE_URING_CMD
+/*
+ * Pin and unpin requests can sleep, so they are never served inline:
+ * returning -EAGAIN on a non-blocking issue makes io_uring punt the
+ * command to an io-wq worker, which shares the mm of the submitter.
+ */
+static int find_pgl_uring_cmd(struct io_uring_cmd *ioucmd,
+				unsigned int issue_flags) {
+	struct find_pgl_ctx *ctx = ioucmd->file->private_data;
+	const struct uring_cmd_param *cmd = uring_cmd_payload(ioucmd);
+	struct write_param param;
+	int err = 0;
+
+	if(issue_flags & IO_URING_F_NONBLOCK)
+		return -EAGAIN;
+
+	if(copy_from_user(&param, u64_to_user_ptr(READ_ONCE(cmd->param)),
+					sizeof(param))) {
+		err = -EFAULT;
+		err_info("error occurs when copying from user\n");
+		return err;
+	}
+
+	switch(ioucmd->cmd_op) {
+	case URING_CMD_PIN:
+		err = pin_region(ctx, &param, NULL);
+		break;
+	case URING_CMD_UNPIN:
+		err = unpin_region(ctx, &param);
+		break;
+	default:
+		err = -ENOTTY;
+		break;
+	}
+
+	return err;
+}
+#endif
+
+static int find_pgl_open(struct inode *inode, struct file *filep) {
+	struct find_pgl_ctx *ctx;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if(!ctx) {
+		err_info("Failed to alloc file context\n");
+		return -ENOMEM;
+	}
+
+	INIT_LIST_HEAD(&ctx->regions);
+	mutex_init(&ctx->lock);
+	filep->private_data = ctx;
+	return 0;
+}
+
 static int find_pgl_release(struct inode *inode, struct file *filep) {
-	free_page_list(page_list, npages);
+	struct find_pgl_ctx *ctx = filep->private_data;
+
+	unpin_all(ctx);
+	kfree(ctx);
 	return 0;
 }
 
 static struct file_operations dev_fops = {
 	.owner			= THIS_MODULE,
+	.open			= find_pgl_open,
 	.write			= find_pgl_write,
+#ifdef HAVE_URING_CMD
+	.uring_cmd		= find_pgl_uring_cmd,
+#endif
 	.release		= find_pgl_release,
 };
 
@@ -88,9 +252,15 @@ static struct miscdevice misc = {
 static int __init find_pgl_init(void) {
 	int err = 0;
 
+	err = init_stats();
+	if(err) {
+		return err;
+	}
+
 	err = misc_register(&misc);
 	if(err) {
 		err_info("misc_register error\n");
+		destroy_stats();
 		return err;
 	}
 
@@ -99,6 +269,7 @@ static int __init find_pgl_init(void) {
 
 static void __exit find_pgl_exit(void) {
 	misc_deregister(&misc);
+	destroy_stats();
 }
 
 module_init(find_pgl_init);
@@ -2,8 +2,10 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
+#include "../common/user_numa.h"
 #include "common.h"
 
 #define ARR_SIZE(arr)			(sizeof(arr)/sizeof(*(arr)))
@@ -26,8 +28,25 @@ int main(int argc, char *argv[]) {
 		return err;
 	}
 
+	/* A negative node stands for the node of the calling CPU */
+	if(argc > 1) {
+		unsigned long nr_moved;
+		int node = atoi(argv[1]);
+
+		if(node < 0)
+			node = current_numa_node();
+		err = (node < 0)? node: move_to_node(arr, sizeof(arr), node, &nr_moved);
+		if(err) {
+			err_info(err, "move to node %d failed\n", node);
+			close(fd);
+			return err;
+		}
+		dbg_info("%lu pages on node %d\n", nr_moved, node);
+	}
+
 	addr_param.addr = (unsigned long)arr;
 	addr_param.length = ARR_SIZE(arr)*sizeof(*arr);
+	addr_param.access = ACCESS_READ_ONLY;
 	err = write(fd, &addr_param, sizeof(addr_param));
 	if(err < 0) {
 		err_info(-errno, "write failed\n");
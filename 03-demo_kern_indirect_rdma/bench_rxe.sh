@@ -0,0 +1,94 @@
+#!/bin/bash
+#
+# Runs user_app between two network namespaces joined by a veth pair, over
+# soft-RoCE (rxe) or soft-iWARP (siw), so that the RDMA path can be
+# benchmarked without RDMA hardware. The module must be loaded and user_app
+# built.
+#
+#   ./bench_rxe.sh setup              create the namespaces and RDMA links
+#   ./bench_rxe.sh run [options]      run a server and a client, passing the
+#                                     options to both (e.g. -b 1000 -s 16)
+#   ./bench_rxe.sh teardown           remove everything again
+#
+# PROVIDER=siw selects soft-iWARP; iWARP connections can only be set up
+# through rdma_cm, so run it with -r.
+
+set -e
+
+PROVIDER=${PROVIDER:-rxe}
+PORT=${PORT:-18515}
+NS_SRV=demo_rdma_srv
+NS_CLI=demo_rdma_cli
+IF_SRV=veth_rdma_srv
+IF_CLI=veth_rdma_cli
+DEV_SRV=${PROVIDER}_srv
+DEV_CLI=${PROVIDER}_cli
+IP_SRV=10.99.0.1
+IP_CLI=10.99.0.2
+APP=$(dirname "$0")/user_app
+
+setup() {
+	modprobe rdma_$PROVIDER 2>/dev/null || modprobe $PROVIDER
+
+	ip netns add $NS_SRV
+	ip netns add $NS_CLI
+	ip link add $IF_SRV netns $NS_SRV type veth peer name $IF_CLI netns $NS_CLI
+	ip -n $NS_SRV addr add $IP_SRV/24 dev $IF_SRV
+	ip -n $NS_CLI addr add $IP_CLI/24 dev $IF_CLI
+	ip -n $NS_SRV link set lo up
+	ip -n $NS_CLI link set lo up
+	ip -n $NS_SRV link set $IF_SRV up
+	ip -n $NS_CLI link set $IF_CLI up
+
+	ip netns exec $NS_SRV rdma link add $DEV_SRV type $PROVIDER netdev $IF_SRV
+	ip netns exec $NS_CLI rdma link add $DEV_CLI type $PROVIDER netdev $IF_CLI
+	rdma link show
+}
+
+teardown() {
+	ip netns exec $NS_SRV rdma link delete $DEV_SRV 2>/dev/null || true
+	ip netns exec $NS_CLI rdma link delete $DEV_CLI 2>/dev/null || true
+	ip netns del $NS_SRV 2>/dev/null || true
+	ip netns del $NS_CLI 2>/dev/null || true
+}
+
+# Index of the RoCE v2 GID that carries the IPv4 address $2 on device $1
+gid_index() {
+	local want
+	want=$(printf "0000:0000:0000:0000:0000:ffff:%02x%02x:%02x%02x" \
+			$(echo $2 | tr . ' '))
+	for gid in /sys/class/infiniband/$1/ports/1/gids/*; do
+		if [ "$(cat $gid)" = "$want" ]; then
+			basename $gid
+			return
+		fi
+	done
+	echo 0
+}
+
+run() {
+	local gid_srv gid_cli pid
+
+	gid_srv=$(gid_index $DEV_SRV $IP_SRV)
+	gid_cli=$(gid_index $DEV_CLI $IP_CLI)
+
+	ip netns exec $NS_SRV $APP -d $DEV_SRV -p $PORT -i 1 -x $gid_srv "$@" &
+	pid=$!
+	sleep 1
+	ip netns exec $NS_CLI $APP -d $DEV_CLI -p $PORT -i 1 -x $gid_cli "$@" $IP_SRV
+	wait $pid
+}
+
+case "$1" in
+setup|teardown)
+	$1
+	;;
+run)
+	shift
+	run "$@"
+	;;
+*)
+	sed -n '3,16p' "$0"
+	exit 1
+	;;
+esac
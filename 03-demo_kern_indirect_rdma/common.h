@@ -44,7 +44,64 @@
 
 #define DEV_NAME_SIZE						50
 
+/*
+ * How the RDMA device is going to touch the registered buffer. Read-only
+ * buffers (e.g. the source of a send) are pinned without FOLL_WRITE and
+ * mapped DMA_TO_DEVICE; write-only buffers are mapped DMA_FROM_DEVICE.
+ */
+enum access_dir {
+	ACCESS_BIDIRECTIONAL		= 0,
+	ACCESS_READ_ONLY,
+	ACCESS_WRITE_ONLY,
+};
+
+/*
+ * Flags in struct write_param.
+ * CONN_F_RDMA_CM: establish the connection through rdma_cm instead of the
+ * kernel TCP side channel. The port of s_addr is then the rdma_cm port.
+ * XFER_F_STREAM: pin, map and post the buffer of a write() or
+ * URING_CMD_TRANSFER one segment at a time, so that the device moves the
+ * first segments while the next ones are pinned, and unpin each segment
+ * once it has been transferred. Nothing stays pinned after the transfer.
+ * A buffer that has to be exposed as a whole (MAP_MODE_IOVA,
+ * MAP_MODE_FRMR, the target of a one-sided operation, or a TCP fallback)
+ * is pinned as a whole, and unpinned after the transfer too.
+ */
+#define CONN_F_RDMA_CM						(1U << 1)
+#define XFER_F_STREAM						(1U << 2)
+
+/*
+ * How the DMA-mapped buffer is presented to the RDMA device.
+ * MAP_MODE_DMA: the DMA address of the first sg entry is used as is.
+ * MAP_MODE_IOVA: the IOMMU is expected to map the whole buffer into one
+ * contiguous IOVA range, which is posted as a single segment. A buffer
+ * that does not come out contiguous (e.g. without an IOMMU) is handled
+ * as in MAP_MODE_FRMR, and counted in iova_fallbacks.
+ * MAP_MODE_FRMR: the DMA segments are registered through a fast-registration
+ * MR, so the buffer is posted as one virtually contiguous range. Devices
+ * without fast registration fall back to one SGE per DMA segment.
+ */
+enum map_mode {
+	MAP_MODE_DMA				= 0,
+	MAP_MODE_IOVA,
+	MAP_MODE_FRMR,
+};
+
+/*
+ * Operation carried out by a transfer. With XFER_OP_SEND the client sends
+ * its buffer into receives pre-posted by the server. With XFER_OP_WRITE
+ * and XFER_OP_READ the client writes its buffer into, or reads its buffer
+ * from, the server buffer, which the server exposes through an rkey and
+ * never touches on the data path.
+ */
+enum xfer_op {
+	XFER_OP_SEND				= 0,
+	XFER_OP_WRITE,
+	XFER_OP_READ,
+};
+
 #include <linux/in.h>
+#include <linux/ioctl.h>
 struct write_param {
 	char					dev_name[DEV_NAME_SIZE];
 	struct sockaddr_in		s_addr;
@@ -52,6 +109,222 @@ struct write_param {
 	int						sgid_index;
 	unsigned long			virtaddr;
 	unsigned long			length;
+	int						access;
+	unsigned int			flags;
+	int						map_mode;
+	int						opcode;
+	int						nr_qps;
+};
+
+/*
+ * Returns in `node` the NUMA node of the dma_device behind `dev_name`, or
+ * -1 if the device has no NUMA affinity. Moving a buffer to that node
+ * before it is pinned is left to user space (move_pages(2)), since the
+ * page migration core is not exported to modules.
+ */
+struct dev_node_param {
+	char					dev_name[DEV_NAME_SIZE];
+	int						node;
+};
+
+#define DEMO_IOC_MAGIC						'r'
+#define IOCTL_DEV_NODE						_IOWR(DEMO_IOC_MAGIC, 1, struct dev_node_param)
+
+/*
+ * io_uring passthrough (IORING_OP_URING_CMD): sqe->cmd_op selects the
+ * command, and the command area of the SQE holds a struct uring_cmd_param
+ * pointing to a struct write_param in user memory. A transfer behaves like
+ * write(); an unpin releases the registration a transfer left behind for
+ * [virtaddr, virtaddr + length), and fails with EBUSY while a transfer
+ * still uses it. cqe->res is 0 or a negative errno.
+ */
+#define URING_CMD_TRANSFER					1
+#define URING_CMD_UNPIN						2
+
+#include <linux/types.h>
+struct uring_cmd_param {
+	__u64					param;
+};
+
+/*
+ * Registers [virtaddr, virtaddr + length) for transfers queued on the
+ * shared rings: the pages are pinned once and `handle` is returned. IOCTL_DEREG_REGION takes the
+ * handle and unpins the pages. A registration carries one transfer at a
+ * time.
+ */
+struct reg_param {
+	char					dev_name[DEV_NAME_SIZE];
+	unsigned long			virtaddr;
+	unsigned long			length;
+	int						access;
+	unsigned int			flags;
+	__u64					handle;
+};
+
+#define IOCTL_REG_REGION					_IOWR(DEMO_IOC_MAGIC, 2, struct reg_param)
+#define IOCTL_DEREG_REGION					_IOW(DEMO_IOC_MAGIC, 3, __u64)
+
+/*
+ * Shared submission and completion rings. IOCTL_RING_SETUP allocates them
+ * and returns their layout; mmap() of the device at offset 0 maps the
+ * header, the SQEs and the CQEs. User space fills SQEs and publishes them
+ * by advancing sq_tail; a kernel worker consumes them, runs up to
+ * cq_entries transfers at a time and publishes one CQE per SQE by
+ * advancing cq_tail. cqe->res is 0 or a negative errno.
+ *
+ * The worker polls for a while when it runs out of SQEs, then sets
+ * RING_F_NEED_WAKEUP in flags and sleeps. Only then does a submission
+ * need IOCTL_RING_ENTER with RING_ENTER_F_WAKEUP. RING_ENTER_F_GETEVENTS
+ * blocks until at least min_complete CQEs are available.
+ */
+#define RING_F_NEED_WAKEUP					(1U << 0)
+
+#define RING_ENTER_F_WAKEUP					(1U << 0)
+#define RING_ENTER_F_GETEVENTS				(1U << 1)
+
+struct ring_hdr {
+	__u32					sq_head;
+	__u32					sq_tail;
+	__u32					sq_entries;
+	__u32					flags;
+	__u32					cq_head;
+	__u32					cq_tail;
+	__u32					cq_entries;
+	__u32					resv;
+};
+
+/* virtaddr, length, access and flags of param are taken from the handle */
+struct ring_sqe {
+	__u64					user_data;
+	__u64					handle;
+	struct write_param		param;
+};
+
+struct ring_cqe {
+	__u64					user_data;
+	__s32					res;
+	__u32					resv;
+};
+
+struct ring_setup_param {
+	__u32					sq_entries;
+	__u32					cq_entries;
+	__u64					sqes_off;
+	__u64					cqes_off;
+	__u64					ring_size;
+};
+
+struct ring_enter_param {
+	__u32					flags;
+	__u32					min_complete;
+};
+
+#define IOCTL_RING_SETUP					_IOWR(DEMO_IOC_MAGIC, 4, struct ring_setup_param)
+#define IOCTL_RING_ENTER					_IOW(DEMO_IOC_MAGIC, 5, struct ring_enter_param)
+
+/*
+ * Starts a sink server on the TCP port of s_addr, in the network namespace
+ * of the caller. It runs in the kernel until IOCTL_SRV_STOP names the same
+ * port, accepts any number of clients, and receives their XFER_OP_SEND
+ * transfers into buffers of one shared receive queue, which it grows with
+ * the load. Clients use one QP.
+ */
+struct srv_param {
+	char					dev_name[DEV_NAME_SIZE];
+	struct sockaddr_in		s_addr;
+	int						rdma_port;
+	int						sgid_index;
+};
+
+#define IOCTL_SRV_START						_IOW(DEMO_IOC_MAGIC, 6, struct srv_param)
+#define IOCTL_SRV_STOP						_IOW(DEMO_IOC_MAGIC, 7, struct srv_param)
+
+/*
+ * Allocates a buffer of length bytes from the buffer pool of dev_name,
+ * made of physically contiguous chunks of POOL_CHUNK_SIZE bytes that are
+ * DMA-mapped once, when the pool is set up. The buffer is a registration
+ * like those of IOCTL_REG_REGION: `handle` names it in SQEs and
+ * IOCTL_DEREG_REGION gives it back. mmap() of the device at mmap_offset
+ * maps it, up to the end of its last chunk. Transfers on it neither pin
+ * nor map anything, but only run on dev_name (or over TCP, once the device
+ * is gone). The buffer is zeroed when it is allocated.
+ */
+#define POOL_CHUNK_SHIFT					21
+#define POOL_CHUNK_SIZE						(1UL << POOL_CHUNK_SHIFT)
+#define POOL_MMAP_SHIFT						32
+
+struct pool_param {
+	char					dev_name[DEV_NAME_SIZE];
+	__u64					length;
+	__u64					handle;
+	__u64					mmap_offset;
+};
+
+#define IOCTL_POOL_ALLOC					_IOWR(DEMO_IOC_MAGIC, 8, struct pool_param)
+
+/*
+ * Counts in `nents` the sg entries [virtaddr, virtaddr + length) would be
+ * pinned into for dev_name, without leaving anything pinned. The pages
+ * are faulted in for write unless access is ACCESS_READ_ONLY, as for a
+ * transfer. The count is added to the contig_ents_before or
+ * contig_ents_after statistics, as `stage` says, so that the effect of
+ * making the buffer contiguous in between shows there.
+ */
+enum sg_count_stage {
+	SG_COUNT_BEFORE				= 0,
+	SG_COUNT_AFTER,
+};
+
+struct sg_count_param {
+	char					dev_name[DEV_NAME_SIZE];
+	unsigned long			virtaddr;
+	unsigned long			length;
+	int						access;
+	int						stage;
+	unsigned int			nents;
+};
+
+#define IOCTL_COUNT_SG						_IOWR(DEMO_IOC_MAGIC, 9, struct sg_count_param)
+
+/*
+ * Statistics, kept for the module, for every RDMA device and for every
+ * connection, and exported through debugfs (see the README). Each block
+ * of the module and of the devices is also a read-only page that can be
+ * mmapped from its stats_page file; the counters only grow, so a reader
+ * takes the difference of two snapshots.
+ *
+ * Bucket i of a latency histogram counts the samples of at least
+ * 2^(i-1) ns and less than 2^i ns (bucket 0 counts 0 ns); the last
+ * bucket also counts everything longer.
+ */
+#define STATS_HIST_BUCKETS					40
+
+enum stats_hist {
+	STATS_HIST_PIN				= 0,
+	STATS_HIST_MAP,
+	STATS_HIST_POST,
+	STATS_HIST_TEARDOWN,
+	NR_STATS_HISTS,
+};
+
+struct demo_stats {
+	__u64					xfers;
+	__u64					xfer_errors;
+	__u64					bytes;
+	__u64					wrs_posted;
+	__u64					completions;
+	__u64					cq_polls;
+	__u64					cq_empty_polls;
+	__u64					pages_pinned;
+	__u64					pages_unpinned;
+	__u64					sg_ents;
+	__u64					dma_segs;
+	__u64					eager_xfers;
+	__u64					rndv_xfers;
+	__u64					iova_fallbacks;
+	__u64					contig_ents_before;
+	__u64					contig_ents_after;
+	__u64					hist[NR_STATS_HISTS][STATS_HIST_BUCKETS];
 };
 
 #endif
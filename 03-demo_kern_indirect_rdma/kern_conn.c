@@ -0,0 +1,1270 @@
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/spinlock.h>
+#include <linux/sched/signal.h>
+#include <linux/module.h>
+#include <linux/net.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include <linux/version.h>
+#include <net/sock.h>
+#include <net/net_namespace.h>
+#include <rdma/ib_verbs.h>
+#include <rdma/ib_cache.h>
+#include <rdma/ib_cm.h>
+#include <rdma/mr_pool.h>
+#include <rdma/rdma_cm.h>
+#include "kern_conn.h"
+#include "kern_stats.h"
+#include "common.h"
+
+static unsigned int conn_idle_timeout = 30;
+module_param(conn_idle_timeout, uint, 0644);
+MODULE_PARM_DESC(conn_idle_timeout, "Seconds an idle pooled connection is kept, 0 disables pooling");
+
+static unsigned int mr_pool_size = 8;
+module_param(mr_pool_size, uint, 0444);
+MODULE_PARM_DESC(mr_pool_size, "Number of fast-registration MRs pooled per QP");
+
+static unsigned int frmr_max_pages = 512;
+module_param(frmr_max_pages, uint, 0444);
+MODULE_PARM_DESC(frmr_max_pages, "Maximum number of pages covered by one fast-registration MR");
+
+static unsigned int inline_threshold = 256;
+module_param(inline_threshold, uint, 0444);
+MODULE_PARM_DESC(inline_threshold, "Largest send posted inline, 0 disables inline sends");
+
+/* kernel_setsockopt() is gone, and rdma_reject() takes a reason, from 5.8 on */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#define HAVE_SOCK_SET_HELPERS
+#define reject_cm_req(cm_id)			rdma_reject(cm_id, NULL, 0, IB_CM_REJ_CONSUMER_DEFINED)
+#else
+#define reject_cm_req(cm_id)			rdma_reject(cm_id, NULL, 0)
+#endif
+
+#define CM_TIMEOUT_MS					5000
+#define CM_BACKLOG						16
+#define CTRL_MSG_SIZE					64
+/* CQ entries reserved for the send and receive queues of a QP */
+#define LANE_CQE						(2 * QP_MAX_WR)
+
+/*
+ * One rdma_cm listener per server address. Connection requests are turned
+ * into half-built connections on the pending list, which server transfers
+ * pick up and accept.
+ */
+struct cm_listener {
+	struct list_head				ent;
+	struct net						*net;
+	struct sockaddr_in				addr;
+	struct rdma_cm_id				*cm_id;
+	struct list_head				pending;
+	spinlock_t						lock;
+	wait_queue_head_t				wq;
+};
+
+static struct list_head conn_list;
+static struct mutex conn_mutex;
+static wait_queue_head_t conn_wq;
+static struct delayed_work reap_work;
+
+static atomic_t next_conn_id;
+
+static struct list_head listener_list;
+static struct mutex listener_mutex;
+static spinlock_t listener_lock;
+
+static int sock_reuse_port(struct socket *sock) {
+#ifdef HAVE_SOCK_SET_HELPERS
+	sock_set_reuseport(sock->sk);
+	return 0;
+#else
+	int flag = 1;
+
+	return kernel_setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+				(char*)&flag, sizeof(int));
+#endif
+}
+
+int setup_connection(struct net *net, bool is_server,
+			const struct sockaddr_in *s_addr,
+			struct socket **sock, struct socket **client_sock) {
+	struct socket **create_sock;
+	int err = 0;
+
+	*sock = (struct socket*)kzalloc(sizeof(struct socket), GFP_KERNEL);
+	*client_sock = (struct socket*)kzalloc(sizeof(struct socket), GFP_KERNEL);
+	if(!(*sock) || !(*client_sock)) {
+		err = -ENOMEM;
+		goto err_kzalloc;
+	}
+
+	create_sock = (is_server)? sock: client_sock;
+
+	err = sock_create_kern(net, AF_INET, SOCK_STREAM, 0, create_sock);
+	if(err) {
+		err_info("socket create error\n");
+		goto err_socket;
+	}
+
+	err = sock_reuse_port(*create_sock);
+	if(err) {
+		err_info("setsockopt error\n");
+		goto err_socket;
+	}
+
+	if(is_server) {
+		err = kernel_bind(*sock, (struct sockaddr*)s_addr, sizeof(*s_addr));
+		if(err < 0) {
+			err_info("bind error\n");
+			goto out_sock_release;
+		}
+
+		err = kernel_listen(*sock, 10);
+		if(err < 0) {
+			err_info("listen error\n");
+			goto out_sock_release;
+		}
+
+		err = kernel_accept(*sock, client_sock, 0);
+		if(err < 0) {
+			err_info("accept error\n");
+			goto out_sock_release;
+		}
+	}
+	else {
+		err = kernel_connect(*client_sock, (struct sockaddr*)s_addr,
+						sizeof(*s_addr), 0);
+		if(err) {
+			err_info("kernel_connect error\n");
+			goto out_sock_release;
+		}
+	}
+
+	return 0;
+
+out_sock_release:
+	sock_release(*create_sock);
+	return err;
+err_socket:
+	kfree(*sock);
+	kfree(*client_sock);
+err_kzalloc:
+	return err;
+}
+
+int exchange_info(bool is_server, const void *local, void *remote,
+			size_t size, struct socket *client_sock) {
+	struct kvec vec;
+	struct msghdr msg;
+	int err = 0, i;
+
+	for(i = 0; i < 2; i++) {
+		memset(&vec, 0, sizeof(vec));
+		memset(&msg, 0, sizeof(msg));
+		if((i % 2) ^ is_server) {
+			vec.iov_base = remote;
+			vec.iov_len = size;
+			err = kernel_recvmsg(client_sock, &msg, &vec, 1, size, MSG_WAITALL);
+		}
+		else {
+			vec.iov_base = (void*)local;
+			vec.iov_len = size;
+			err = kernel_sendmsg(client_sock, &msg, &vec, 1, size);
+		}
+
+		if(err < (int)size) {
+			err_info("msg error\n");
+			err = -EPIPE;
+			goto err_msg;
+		}
+		else {
+			err = 0;
+		}
+	}
+
+err_msg:
+	return err;
+}
+
+void close_connection(bool is_server,
+			struct socket *sock, struct socket *client_sock) {
+	sock_release(client_sock);
+	if(is_server)
+		sock_release(sock);
+//	kfree(client_sock);
+//	kfree(sock);
+}
+
+/*
+ * The target of a one-sided operation keeps two MRs of the pool
+ * registered at a time, and each must cover at least one full page
+ * wherever it starts, so pools are at least two MRs of two pages.
+ */
+static int init_mr_pool(struct rdma_conn *conn, struct ib_qp *qp) {
+	struct ib_device *ib_dev = qp->device;
+	u32 max_pages;
+	int err = 0;
+
+	if(!(ib_dev->attrs.device_cap_flags & IB_DEVICE_MEM_MGT_EXTENSIONS))
+		return -EOPNOTSUPP;
+
+	max_pages = min_t(u32, frmr_max_pages,
+				ib_dev->attrs.max_fast_reg_page_list_len);
+	if(max_pages < 2)
+		return -EOPNOTSUPP;
+
+	err = ib_mr_pool_init(qp, &qp->rdma_mrs, max(mr_pool_size, 2U),
+				IB_MR_TYPE_MEM_REG, max_pages, 0);
+	if(err) {
+		return err;
+	}
+
+	conn->frmr_pages = max_pages;
+	return err;
+}
+
+int bring_up_qp(struct rdma_conn *conn, struct ib_qp *qp,
+			const struct qp_conn_param *local_info,
+			const struct qp_conn_param *remote_info) {
+	struct ib_qp_attr qp_attr;
+	struct ib_ah *ah;
+	int attr_flag;
+	int err = 0;
+
+	memset(&qp_attr, 0, sizeof(qp_attr));
+	qp_attr.qp_state = IB_QPS_INIT;
+	qp_attr.pkey_index = 0;
+	qp_attr.port_num = conn->rdma_port;
+	qp_attr.qp_access_flags = IB_ACCESS_LOCAL_WRITE;
+	if(conn->is_server)
+		qp_attr.qp_access_flags |= (IB_ACCESS_REMOTE_WRITE |
+					IB_ACCESS_REMOTE_READ);
+	attr_flag = (IB_QP_STATE | IB_QP_PKEY_INDEX |
+				IB_QP_PORT | IB_QP_ACCESS_FLAGS);
+	err = ib_modify_qp(qp, &qp_attr, attr_flag);
+	if(err) {
+		return err;
+	}
+
+	memset(&qp_attr, 0, sizeof(qp_attr));
+	qp_attr.qp_state = IB_QPS_RTR;
+	qp_attr.path_mtu = min(local_info->mtu, remote_info->mtu);
+	qp_attr.dest_qp_num = remote_info->qpn;
+	qp_attr.rq_psn = remote_info->psn;
+	qp_attr.max_dest_rd_atomic = 1;
+	qp_attr.min_rnr_timer = 12;
+	qp_attr.ah_attr.ib.dlid = remote_info->lid;
+	qp_attr.ah_attr.sl = 0;
+	qp_attr.ah_attr.ib.src_path_bits = 0;
+	qp_attr.ah_attr.port_num = conn->rdma_port;
+	qp_attr.ah_attr.ah_flags = IB_AH_GRH;
+	qp_attr.ah_attr.grh.hop_limit = 255;
+	memcpy(&qp_attr.ah_attr.grh.dgid, &remote_info->gid,
+							sizeof(remote_info->gid));
+	qp_attr.ah_attr.grh.sgid_index = conn->sgid_index;
+	qp_attr.ah_attr.grh.traffic_class = 0;
+	qp_attr.ah_attr.type = RDMA_AH_ATTR_TYPE_ROCE;
+
+	attr_flag = (IB_QP_STATE | IB_QP_AV | IB_QP_PATH_MTU |
+				IB_QP_DEST_QPN | IB_QP_RQ_PSN |
+			IB_QP_MAX_DEST_RD_ATOMIC | IB_QP_MIN_RNR_TIMER);
+
+	ah = rdma_create_user_ah(qp->pd, &qp_attr.ah_attr, NULL);
+	if(IS_ERR(ah)) {
+		return (int)PTR_ERR(ah);
+	}
+
+	err = rdma_destroy_ah(ah, 0);
+	if(err) {
+		return err;
+	}
+
+	err = ib_modify_qp(qp, &qp_attr, attr_flag);
+	if(err) {
+		return err;
+	}
+
+	memset(&qp_attr, 0, sizeof(qp_attr));
+	qp_attr.qp_state = IB_QPS_RTS;
+	qp_attr.timeout = 14;
+	qp_attr.retry_cnt = 7;
+	qp_attr.rnr_retry = 7;
+	qp_attr.sq_psn = local_info->psn;
+	qp_attr.max_rd_atomic = 1;
+
+	attr_flag = (IB_QP_STATE | IB_QP_TIMEOUT | IB_QP_RETRY_CNT |
+			IB_QP_RNR_RETRY | IB_QP_SQ_PSN | IB_QP_MAX_QP_RD_ATOMIC);
+
+	return ib_modify_qp(qp, &qp_attr, attr_flag);
+}
+
+static void destroy_lane(struct rdma_conn *conn, int i) {
+	struct conn_lane *lane = &conn->lanes[i];
+
+	if(i == 0 && conn->mr_pool)
+		ib_mr_pool_destroy(lane->qp, &lane->qp->rdma_mrs);
+	if(i == 0 && conn->use_cm)
+		rdma_destroy_qp(conn->cm_id);
+	else
+		ib_destroy_qp(lane->qp);
+	cq_pool_put(&conn->dev->cq_pool, lane->dcq, LANE_CQE);
+}
+
+static struct ib_qp *create_lane_qp(struct rdma_conn *conn, int i,
+			struct ib_qp_init_attr *qp_init_attr) {
+	int err;
+
+	if(i != 0 || !conn->use_cm)
+		return ib_create_qp(conn->pd, qp_init_attr);
+
+	err = rdma_create_qp(conn->cm_id, conn->pd, qp_init_attr);
+	return err? ERR_PTR(err): conn->cm_id->qp;
+}
+
+/*
+ * Creates the QP of lane i on a CQ of the device pool, on a completion
+ * vector of its own as far as the device has them. The QP of lane 0
+ * carries the FRMR pool.
+ * Send WRs are only signaled on request, and small sends may go inline;
+ * a device that cannot inline that much gets a QP without inline data.
+ */
+static int create_lane(struct rdma_conn *conn, int i) {
+	struct ib_device *ib_dev = conn->ib_dev;
+	struct conn_lane *lane = &conn->lanes[i];
+	struct ib_qp_init_attr qp_init_attr;
+	int err = 0;
+
+	lane->dcq = cq_pool_get(&conn->dev->cq_pool, LANE_CQE,
+				i % ib_dev->num_comp_vectors);
+	if(IS_ERR(lane->dcq)) {
+		err = -ENODEV;
+		goto err_create_cq;
+	}
+
+	memset(&qp_init_attr, 0, sizeof(qp_init_attr));
+	qp_init_attr.send_cq = lane->dcq->cq;
+	qp_init_attr.recv_cq = lane->dcq->cq;
+	qp_init_attr.cap.max_send_wr = QP_MAX_WR;
+	qp_init_attr.cap.max_recv_wr = QP_MAX_WR;
+	qp_init_attr.cap.max_send_sge = min(QP_MAX_SGE, ib_dev->attrs.max_send_sge);
+	qp_init_attr.cap.max_recv_sge = min(QP_MAX_SGE, ib_dev->attrs.max_recv_sge);
+	qp_init_attr.cap.max_inline_data = inline_threshold;
+	qp_init_attr.qp_type = IB_QPT_RC;
+	qp_init_attr.sq_sig_type = IB_SIGNAL_REQ_WR;
+	lane->qp = create_lane_qp(conn, i, &qp_init_attr);
+	if(IS_ERR(lane->qp) && qp_init_attr.cap.max_inline_data) {
+		dbg_info("QP creation with %u bytes of inline data failed\n",
+					inline_threshold);
+		qp_init_attr.cap.max_inline_data = 0;
+		lane->qp = create_lane_qp(conn, i, &qp_init_attr);
+	}
+	if(IS_ERR(lane->qp)) {
+		err = -ENODEV;
+		goto err_create_qp;
+	}
+
+	if(i == 0) {
+		conn->max_sge = min(qp_init_attr.cap.max_send_sge,
+					qp_init_attr.cap.max_recv_sge);
+		conn->mr_pool = !init_mr_pool(conn, lane->qp);
+		conn->max_inline = min(inline_threshold,
+					qp_init_attr.cap.max_inline_data);
+	}
+
+	return err;
+
+err_create_qp:
+	cq_pool_put(&conn->dev->cq_pool, lane->dcq, LANE_CQE);
+err_create_cq:
+	return err;
+}
+
+static int conn_stats_show(struct seq_file *m, void *v) {
+	struct rdma_conn *conn = m->private;
+
+	seq_printf(m, "addr: %pI4:%u\n", &conn->s_addr.sin_addr,
+				ntohs(conn->s_addr.sin_port));
+	seq_printf(m, "role: %s\n", conn->is_server? "server": "client");
+	seq_printf(m, "setup: %s\n", conn->use_cm? "rdma_cm": "tcp");
+	seq_printf(m, "lanes: %d\n", conn->nr_lanes);
+	stats_seq_show(m, conn->stats);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(conn_stats);
+
+/*
+ * Allocates the verbs objects of a connection; the PD, DMA MR and CQs are
+ * those of the device. With rdma_cm the QP is created on the cm_id, which
+ * then drives its state transitions, and a small buffer is mapped for the
+ * control messages. The caller holds a reference on the device, which
+ * outlives the connection: the device is only freed after its
+ * connections have been flushed.
+ */
+static int alloc_conn_resources(struct rdma_conn *conn) {
+	struct ib_device *ib_dev = conn->ib_dev;
+	char name[16];
+	int err = 0;
+	int i;
+
+	conn->dev = demo_dev_of(ib_dev);
+	if(!conn->dev) {
+		return -ENODEV;
+	}
+
+	conn->pd = conn->dev->pd;
+	conn->dma_mr = conn->dev->dma_mr;
+
+	conn->stats = kzalloc(sizeof(*conn->stats), GFP_KERNEL);
+	if(!conn->stats) {
+		return -ENOMEM;
+	}
+
+	for(i = 0; i < conn->nr_lanes; i++) {
+		err = create_lane(conn, i);
+		if(err) {
+			goto err_create_lane;
+		}
+	}
+
+	if(conn->use_cm) {
+		conn->ctrl_buf = kzalloc(2 * CTRL_MSG_SIZE, GFP_KERNEL);
+		if(!conn->ctrl_buf) {
+			err = -ENOMEM;
+			goto err_ctrl_buf;
+		}
+
+		conn->ctrl_dma = ib_dma_map_single(ib_dev, conn->ctrl_buf,
+					2 * CTRL_MSG_SIZE, DMA_BIDIRECTIONAL);
+		if(ib_dma_mapping_error(ib_dev, conn->ctrl_dma)) {
+			err = -EFAULT;
+			err_info("Failed to map control buffer\n");
+			goto err_map_ctrl;
+		}
+	}
+
+	conn->bounce_buf = kmalloc(CONN_BOUNCE_SIZE, GFP_KERNEL);
+	if(!conn->bounce_buf) {
+		err = -ENOMEM;
+		goto err_bounce_buf;
+	}
+
+	conn->bounce_dma = ib_dma_map_single(ib_dev, conn->bounce_buf,
+				CONN_BOUNCE_SIZE, DMA_BIDIRECTIONAL);
+	if(ib_dma_mapping_error(ib_dev, conn->bounce_dma)) {
+		err = -EFAULT;
+		err_info("Failed to map bounce buffer\n");
+		goto err_map_bounce;
+	}
+
+	sg_init_one(&conn->bounce_sg, conn->bounce_buf, CONN_BOUNCE_SIZE);
+	sg_dma_address(&conn->bounce_sg) = conn->bounce_dma;
+	sg_dma_len(&conn->bounce_sg) = CONN_BOUNCE_SIZE;
+	conn->bounce_sgt.sgl = &conn->bounce_sg;
+	conn->bounce_sgt.nents = 1;
+	conn->bounce_sgt.orig_nents = 1;
+
+	conn->id = atomic_inc_return(&next_conn_id);
+	snprintf(name, sizeof(name), "conn%u", conn->id);
+	conn->dbg_file = debugfs_create_file(name, 0444, conn->dev->dbg_dir,
+				conn, &conn_stats_fops);
+	return err;
+
+err_map_bounce:
+	kfree(conn->bounce_buf);
+	conn->bounce_buf = NULL;
+err_bounce_buf:
+	if(conn->ctrl_buf) {
+		ib_dma_unmap_single(ib_dev, conn->ctrl_dma,
+					2 * CTRL_MSG_SIZE, DMA_BIDIRECTIONAL);
+	}
+err_map_ctrl:
+	kfree(conn->ctrl_buf);
+	conn->ctrl_buf = NULL;
+err_ctrl_buf:
+err_create_lane:
+	while(i--)
+		destroy_lane(conn, i);
+	kfree(conn->stats);
+	conn->stats = NULL;
+	return err;
+}
+
+/* Waits for readers of the stats file to leave before freeing the stats */
+static void free_conn_resources(struct rdma_conn *conn) {
+	int i;
+
+	debugfs_remove(conn->dbg_file);
+	kfree(conn->stats);
+	if(conn->bounce_buf) {
+		ib_dma_unmap_single(conn->ib_dev, conn->bounce_dma,
+					CONN_BOUNCE_SIZE, DMA_BIDIRECTIONAL);
+		kfree(conn->bounce_buf);
+	}
+	if(conn->ctrl_buf) {
+		ib_dma_unmap_single(conn->ib_dev, conn->ctrl_dma,
+					2 * CTRL_MSG_SIZE, DMA_BIDIRECTIONAL);
+		kfree(conn->ctrl_buf);
+	}
+	for(i = conn->nr_lanes - 1; i >= 0; i--)
+		destroy_lane(conn, i);
+}
+
+static void destroy_conn(struct rdma_conn *conn) {
+	if(conn->use_cm) {
+		rdma_disconnect(conn->cm_id);
+		free_conn_resources(conn);
+		rdma_destroy_id(conn->cm_id);
+	}
+	else {
+		close_connection(conn->is_server, conn->sock, conn->client_sock);
+		free_conn_resources(conn);
+	}
+	put_net(conn->net);
+	kfree(conn);
+}
+
+/*
+ * rdma_cm establishes a single QP per cm_id, so connections set up through
+ * it have one lane.
+ */
+static int conn_nr_lanes(const struct write_param *param) {
+	if(param->flags & CONN_F_RDMA_CM)
+		return 1;
+	return clamp(param->nr_qps, 1, CONN_MAX_LANES);
+}
+
+static void init_conn(struct rdma_conn *conn, struct ib_device *ib_dev,
+			bool is_server, const struct write_param *param) {
+	conn->ib_dev = ib_dev;
+	conn->rdma_port = param->rdma_port;
+	conn->sgid_index = param->sgid_index;
+	conn->s_addr = param->s_addr;
+	conn->is_server = is_server;
+	conn->use_cm = !!(param->flags & CONN_F_RDMA_CM);
+	conn->nr_lanes = conn_nr_lanes(param);
+	init_completion(&conn->cm_done);
+}
+
+static struct rdma_conn *create_conn_tcp(struct ib_device *ib_dev,
+			struct net *net, bool is_server, const struct write_param *param) {
+	struct rdma_conn *conn;
+	struct ib_port_attr port_attr;
+	union ib_gid local_gid;
+	struct conn_setup_info *local_info, *remote_info;
+	int err = 0;
+	int i;
+
+	conn = kzalloc(sizeof(*conn), GFP_KERNEL);
+	if(!conn) {
+		err = -ENOMEM;
+		err_info("Failed to alloc connection\n");
+		goto err_alloc_conn;
+	}
+
+	init_conn(conn, ib_dev, is_server, param);
+	err = alloc_conn_resources(conn);
+	if(err) {
+		goto err_alloc_resources;
+	}
+
+	err = ib_query_port(ib_dev, conn->rdma_port, &port_attr);
+	if(err) {
+		goto err_conn;
+	}
+
+	err = rdma_query_gid(ib_dev, conn->rdma_port, conn->sgid_index, &local_gid);
+	if(err) {
+		goto err_conn;
+	}
+	dbg_info("server: %d, local gid: %pI4\n", is_server, local_gid.raw+12);
+
+	local_info = kzalloc(2 * sizeof(*local_info), GFP_KERNEL);
+	if(!local_info) {
+		err = -ENOMEM;
+		goto err_conn;
+	}
+	remote_info = local_info + 1;
+
+	local_info->nr_lanes = conn->nr_lanes;
+	for(i = 0; i < conn->nr_lanes; i++) {
+		struct qp_conn_param *qp_info = &local_info->lanes[i];
+
+		qp_info->qpn = conn->lanes[i].qp->qp_num;
+		qp_info->psn = 0;
+		qp_info->lid = port_attr.lid;
+		qp_info->mtu = port_attr.active_mtu;
+		memcpy(&qp_info->gid, &local_gid, sizeof(local_gid));
+	}
+
+	err = setup_connection(net, is_server, &conn->s_addr,
+				&conn->sock, &conn->client_sock);
+	if(err) {
+		err_info("setup_connection error\n");
+		goto err_setup_connection;
+	}
+
+	err = exchange_info(is_server, local_info, remote_info,
+				sizeof(*local_info), conn->client_sock);
+	if(err) {
+		err_info("exchange_info error\n");
+		goto err_modify_qp;
+	}
+
+	if(remote_info->nr_lanes != local_info->nr_lanes) {
+		err = -EPROTO;
+		err_info("Peer uses %u QPs, not %u\n",
+				remote_info->nr_lanes, local_info->nr_lanes);
+		goto err_modify_qp;
+	}
+
+	for(i = 0; i < conn->nr_lanes; i++) {
+		err = bring_up_qp(conn, conn->lanes[i].qp,
+					&local_info->lanes[i], &remote_info->lanes[i]);
+		if(err) {
+			goto err_modify_qp;
+		}
+	}
+
+	kfree(local_info);
+	return conn;
+
+err_modify_qp:
+	close_connection(is_server, conn->sock, conn->client_sock);
+err_setup_connection:
+	kfree(local_info);
+err_conn:
+	free_conn_resources(conn);
+err_alloc_resources:
+	kfree(conn);
+err_alloc_conn:
+	return ERR_PTR(err);
+}
+
+static int wait_cm_event(struct rdma_conn *conn,
+			enum rdma_cm_event_type expected) {
+	long ret;
+
+	ret = wait_for_completion_interruptible_timeout(&conn->cm_done,
+				msecs_to_jiffies(CM_TIMEOUT_MS));
+	if(ret == 0)
+		return -ETIMEDOUT;
+	if(ret < 0)
+		return (int)ret;
+
+	if(conn->cm_event != expected) {
+		err_info("Unexpected CM event: %s, status: %d\n",
+				rdma_event_msg(conn->cm_event), conn->cm_status);
+		return -ECONNREFUSED;
+	}
+
+	return 0;
+}
+
+static void init_cm_conn_param(struct rdma_conn_param *cm_param) {
+	memset(cm_param, 0, sizeof(*cm_param));
+	cm_param->responder_resources = 1;
+	cm_param->initiator_depth = 1;
+	cm_param->retry_count = 7;
+	cm_param->rnr_retry_count = 7;
+}
+
+static int cm_event_handler(struct rdma_cm_id *cm_id,
+			struct rdma_cm_event *event);
+
+/*
+ * The client side of an rdma_cm connection: address and route resolution
+ * pick the device and the path (including its MTU), and rdma_connect
+ * moves the QP through INIT, RTR and RTS.
+ */
+static struct rdma_conn *create_conn_cm(struct ib_device *ib_dev,
+			struct net *net, const struct write_param *param) {
+	struct rdma_conn *conn;
+	struct rdma_conn_param cm_param;
+	int err = 0;
+
+	conn = kzalloc(sizeof(*conn), GFP_KERNEL);
+	if(!conn) {
+		err = -ENOMEM;
+		err_info("Failed to alloc connection\n");
+		goto err_alloc_conn;
+	}
+
+	init_conn(conn, ib_dev, false, param);
+	conn->cm_id = rdma_create_id(net, cm_event_handler, conn,
+					RDMA_PS_TCP, IB_QPT_RC);
+	if(IS_ERR(conn->cm_id)) {
+		err = (int)PTR_ERR(conn->cm_id);
+		err_info("rdma_create_id error\n");
+		goto err_create_id;
+	}
+
+	reinit_completion(&conn->cm_done);
+	err = rdma_resolve_addr(conn->cm_id, NULL,
+				(struct sockaddr*)&conn->s_addr, CM_TIMEOUT_MS);
+	if(!err)
+		err = wait_cm_event(conn, RDMA_CM_EVENT_ADDR_RESOLVED);
+	if(err) {
+		err_info("Failed to resolve address\n");
+		goto err_resolve;
+	}
+
+	reinit_completion(&conn->cm_done);
+	err = rdma_resolve_route(conn->cm_id, CM_TIMEOUT_MS);
+	if(!err)
+		err = wait_cm_event(conn, RDMA_CM_EVENT_ROUTE_RESOLVED);
+	if(err) {
+		err_info("Failed to resolve route\n");
+		goto err_resolve;
+	}
+
+	if(conn->cm_id->device != ib_dev) {
+		err = -EXDEV;
+		err_info("Peer is reached through %s, not %s\n",
+				conn->cm_id->device->name, ib_dev->name);
+		goto err_resolve;
+	}
+
+	err = alloc_conn_resources(conn);
+	if(err) {
+		goto err_resolve;
+	}
+
+	init_cm_conn_param(&cm_param);
+	reinit_completion(&conn->cm_done);
+	err = rdma_connect(conn->cm_id, &cm_param);
+	if(!err)
+		err = wait_cm_event(conn, RDMA_CM_EVENT_ESTABLISHED);
+	if(err) {
+		err_info("rdma_connect error\n");
+		goto err_connect;
+	}
+
+	return conn;
+
+err_connect:
+	free_conn_resources(conn);
+err_resolve:
+	rdma_destroy_id(conn->cm_id);
+err_create_id:
+	kfree(conn);
+err_alloc_conn:
+	return ERR_PTR(err);
+}
+
+static bool cm_id_is_listener(struct rdma_cm_id *cm_id) {
+	struct cm_listener *listener;
+	bool found = false;
+
+	spin_lock(&listener_lock);
+	list_for_each_entry(listener, &listener_list, ent) {
+		if(listener->cm_id == cm_id) {
+			found = true;
+			break;
+		}
+	}
+	spin_unlock(&listener_lock);
+	return found;
+}
+
+static int queue_cm_request(struct cm_listener *listener,
+			struct rdma_cm_id *cm_id) {
+	struct rdma_conn *conn;
+
+	conn = kzalloc(sizeof(*conn), GFP_KERNEL);
+	if(!conn) {
+		err_info("Failed to alloc connection\n");
+		return -ENOMEM;
+	}
+
+	conn->cm_id = cm_id;
+	conn->ib_dev = cm_id->device;
+	conn->s_addr = listener->addr;
+	conn->is_server = true;
+	conn->use_cm = true;
+	init_completion(&conn->cm_done);
+	cm_id->context = conn;
+
+	spin_lock(&listener->lock);
+	list_add_tail(&conn->ent, &listener->pending);
+	spin_unlock(&listener->lock);
+	wake_up(&listener->wq);
+	return 0;
+}
+
+/*
+ * A non-zero return value makes rdma_cm destroy the cm_id, which is only
+ * wanted for a connection request that could not be queued.
+ */
+static int cm_event_handler(struct rdma_cm_id *cm_id,
+			struct rdma_cm_event *event) {
+	struct rdma_conn *conn;
+
+	if(event->event == RDMA_CM_EVENT_CONNECT_REQUEST)
+		return queue_cm_request(cm_id->context, cm_id);
+
+	if(cm_id_is_listener(cm_id)) {
+		dbg_info("Listener event: %s\n", rdma_event_msg(event->event));
+		return 0;
+	}
+
+	conn = cm_id->context;
+	switch(event->event) {
+	case RDMA_CM_EVENT_DISCONNECTED:
+	case RDMA_CM_EVENT_DEVICE_REMOVAL:
+		conn->cm_broken = true;
+		break;
+	default:
+		break;
+	}
+
+	conn->cm_event = event->event;
+	conn->cm_status = event->status;
+	complete(&conn->cm_done);
+	return 0;
+}
+
+static struct cm_listener *get_cm_listener(struct net *net,
+			const struct sockaddr_in *addr) {
+	struct cm_listener *listener;
+	int err = 0;
+
+	mutex_lock(&listener_mutex);
+	list_for_each_entry(listener, &listener_list, ent) {
+		if(net_eq(listener->net, net) &&
+					listener->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+					listener->addr.sin_port == addr->sin_port)
+			goto out;
+	}
+
+	listener = kzalloc(sizeof(*listener), GFP_KERNEL);
+	if(!listener) {
+		err = -ENOMEM;
+		err_info("Failed to alloc listener\n");
+		goto err_alloc;
+	}
+
+	listener->net = get_net(net);
+	listener->addr = *addr;
+	INIT_LIST_HEAD(&listener->pending);
+	spin_lock_init(&listener->lock);
+	init_waitqueue_head(&listener->wq);
+	listener->cm_id = rdma_create_id(net, cm_event_handler, listener,
+					RDMA_PS_TCP, IB_QPT_RC);
+	if(IS_ERR(listener->cm_id)) {
+		err = (int)PTR_ERR(listener->cm_id);
+		err_info("rdma_create_id error\n");
+		goto err_create_id;
+	}
+
+	spin_lock(&listener_lock);
+	list_add(&listener->ent, &listener_list);
+	spin_unlock(&listener_lock);
+
+	err = rdma_bind_addr(listener->cm_id, (struct sockaddr*)&listener->addr);
+	if(!err)
+		err = rdma_listen(listener->cm_id, CM_BACKLOG);
+	if(err) {
+		err_info("Failed to listen\n");
+		goto err_listen;
+	}
+
+out:
+	mutex_unlock(&listener_mutex);
+	return listener;
+
+err_listen:
+	spin_lock(&listener_lock);
+	list_del(&listener->ent);
+	spin_unlock(&listener_lock);
+	rdma_destroy_id(listener->cm_id);
+err_create_id:
+	put_net(listener->net);
+	kfree(listener);
+err_alloc:
+	mutex_unlock(&listener_mutex);
+	return ERR_PTR(err);
+}
+
+static struct rdma_conn *pop_cm_request(struct cm_listener *listener) {
+	struct rdma_conn *conn = NULL;
+
+	spin_lock(&listener->lock);
+	if(!list_empty(&listener->pending)) {
+		conn = list_first_entry(&listener->pending, struct rdma_conn, ent);
+		list_del(&conn->ent);
+	}
+	spin_unlock(&listener->lock);
+	return conn;
+}
+
+/*
+ * The server side of an rdma_cm connection: one listener per address
+ * accepts any number of clients. Requests that arrived on another device
+ * are rejected.
+ */
+static struct rdma_conn *accept_conn_cm(struct ib_device *ib_dev,
+			struct net *net, const struct write_param *param) {
+	struct cm_listener *listener;
+	struct rdma_conn *conn;
+	struct rdma_conn_param cm_param;
+	int err = 0;
+
+	listener = get_cm_listener(net, &param->s_addr);
+	if(IS_ERR(listener))
+		return ERR_CAST(listener);
+
+	for(;;) {
+		err = wait_event_interruptible(listener->wq,
+					(conn = pop_cm_request(listener)));
+		if(err)
+			return ERR_PTR(err);
+
+		if(!conn->cm_broken && conn->ib_dev == ib_dev)
+			break;
+
+		dbg_info("Rejecting connection request on %s\n", conn->ib_dev->name);
+		reject_cm_req(conn->cm_id);
+		rdma_destroy_id(conn->cm_id);
+		kfree(conn);
+	}
+
+	conn->rdma_port = param->rdma_port;
+	conn->sgid_index = param->sgid_index;
+	conn->nr_lanes = 1;
+	err = alloc_conn_resources(conn);
+	if(err) {
+		reject_cm_req(conn->cm_id);
+		goto err_alloc_resources;
+	}
+
+	init_cm_conn_param(&cm_param);
+	reinit_completion(&conn->cm_done);
+	err = rdma_accept(conn->cm_id, &cm_param);
+	if(!err)
+		err = wait_cm_event(conn, RDMA_CM_EVENT_ESTABLISHED);
+	if(err) {
+		err_info("rdma_accept error\n");
+		goto err_accept;
+	}
+
+	return conn;
+
+err_accept:
+	free_conn_resources(conn);
+err_alloc_resources:
+	rdma_destroy_id(conn->cm_id);
+	kfree(conn);
+	return ERR_PTR(err);
+}
+
+static struct rdma_conn *create_conn(struct ib_device *ib_dev,
+			struct net *net, bool is_server, const struct write_param *param) {
+	if(!(param->flags & CONN_F_RDMA_CM))
+		return create_conn_tcp(ib_dev, net, is_server, param);
+	return is_server? accept_conn_cm(ib_dev, net, param):
+				create_conn_cm(ib_dev, net, param);
+}
+
+static bool conn_matches(const struct rdma_conn *conn, struct ib_device *ib_dev,
+			struct net *net, bool is_server, const struct write_param *param) {
+	return (conn->ib_dev == ib_dev && net_eq(conn->net, net) &&
+			conn->is_server == is_server &&
+			conn->rdma_port == param->rdma_port &&
+			conn->sgid_index == param->sgid_index &&
+			conn->s_addr.sin_addr.s_addr == param->s_addr.sin_addr.s_addr &&
+			conn->s_addr.sin_port == param->s_addr.sin_port &&
+			conn->use_cm == !!(param->flags & CONN_F_RDMA_CM) &&
+			conn->nr_lanes == conn_nr_lanes(param));
+}
+
+/*
+ * A QP that has left RTS (e.g. after a retry timeout while it sat idle)
+ * cannot carry another transfer, and its connection is replaced by a new
+ * one.
+ */
+static bool conn_healthy(struct rdma_conn *conn) {
+	struct ib_qp_attr qp_attr;
+	struct ib_qp_init_attr qp_init_attr;
+	int i;
+
+	if(conn->cm_broken)
+		return false;
+	for(i = 0; i < conn->nr_lanes; i++) {
+		if(ib_query_qp(conn->lanes[i].qp, &qp_attr,
+					IB_QP_STATE, &qp_init_attr))
+			return false;
+		if(qp_attr.qp_state != IB_QPS_RTS)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Returns an idle pooled connection matching the request, or establishes
+ * a new one. The connection belongs to the caller until rdma_conn_put.
+ */
+struct rdma_conn *rdma_conn_get(struct ib_device *ib_dev, struct net *net,
+			bool is_server, const struct write_param *param) {
+	struct rdma_conn *conn, *tmp, *next;
+	LIST_HEAD(stale);
+
+	mutex_lock(&conn_mutex);
+	list_for_each_entry_safe(conn, tmp, &conn_list, ent) {
+		if(conn->in_use ||
+					!conn_matches(conn, ib_dev, net, is_server, param))
+			continue;
+
+		if(!conn_healthy(conn)) {
+			list_move(&conn->ent, &stale);
+			continue;
+		}
+
+		conn->in_use = true;
+		conn->reused = true;
+		mutex_unlock(&conn_mutex);
+		goto out;
+	}
+	mutex_unlock(&conn_mutex);
+
+	conn = create_conn(ib_dev, net, is_server, param);
+	if(IS_ERR(conn))
+		goto out;
+
+	conn->net = get_net(net);
+	conn->in_use = true;
+	mutex_lock(&conn_mutex);
+	list_add(&conn->ent, &conn_list);
+	mutex_unlock(&conn_mutex);
+
+out:
+	list_for_each_entry_safe(tmp, next, &stale, ent) {
+		dbg_info("Dropping pooled connection in error state\n");
+		destroy_conn(tmp);
+	}
+	return conn;
+}
+
+/*
+ * Gives the connection back to the pool. A transfer that failed may have
+ * left work requests or completions behind, so such a connection is torn
+ * down instead, and the next request establishes a fresh one.
+ */
+void rdma_conn_put(struct rdma_conn *conn, bool broken) {
+	unsigned long timeout = conn_idle_timeout * HZ;
+
+	mutex_lock(&conn_mutex);
+	conn->in_use = false;
+	conn->last_used = jiffies;
+	if(broken || !timeout)
+		list_del(&conn->ent);
+	mutex_unlock(&conn_mutex);
+	wake_up_all(&conn_wq);
+
+	if(broken || !timeout) {
+		destroy_conn(conn);
+		return;
+	}
+
+	schedule_delayed_work(&reap_work, timeout);
+}
+
+static void reap_idle_conns(struct work_struct *work) {
+	unsigned long timeout = conn_idle_timeout * HZ;
+	struct rdma_conn *conn, *tmp;
+	bool idle_left = false;
+	LIST_HEAD(expired);
+
+	mutex_lock(&conn_mutex);
+	list_for_each_entry_safe(conn, tmp, &conn_list, ent) {
+		if(conn->in_use)
+			continue;
+
+		if(time_after_eq(jiffies, conn->last_used + timeout))
+			list_move(&conn->ent, &expired);
+		else
+			idle_left = true;
+	}
+	mutex_unlock(&conn_mutex);
+
+	list_for_each_entry_safe(conn, tmp, &expired, ent) {
+		destroy_conn(conn);
+	}
+
+	if(idle_left && timeout)
+		schedule_delayed_work(&reap_work, timeout);
+}
+
+static bool device_conns_busy(struct ib_device *ib_dev) {
+	struct rdma_conn *conn;
+	bool busy = false;
+
+	mutex_lock(&conn_mutex);
+	list_for_each_entry(conn, &conn_list, ent) {
+		if(conn->ib_dev == ib_dev && conn->in_use) {
+			busy = true;
+			break;
+		}
+	}
+	mutex_unlock(&conn_mutex);
+	return busy;
+}
+
+/*
+ * Called when the device goes away: waits for the transfers in flight on
+ * it, then destroys its pooled connections. A run of the reaper may be
+ * destroying some of them as well, and must be done before the shared
+ * objects of the device go.
+ */
+void rdma_conn_flush_device(struct ib_device *ib_dev) {
+	struct rdma_conn *conn, *tmp;
+	LIST_HEAD(flushed);
+
+	wait_event(conn_wq, !device_conns_busy(ib_dev));
+	flush_delayed_work(&reap_work);
+
+	mutex_lock(&conn_mutex);
+	list_for_each_entry_safe(conn, tmp, &conn_list, ent) {
+		if(conn->ib_dev == ib_dev)
+			list_move(&conn->ent, &flushed);
+	}
+	mutex_unlock(&conn_mutex);
+
+	list_for_each_entry_safe(conn, tmp, &flushed, ent) {
+		destroy_conn(conn);
+	}
+}
+
+/*
+ * Exchanges `size` bytes with the peer through the control buffer: the
+ * receive is posted before the send, and both completions are reaped, so
+ * no control WR is outstanding when the transfer posts its own.
+ */
+static int exchange_ctrl(struct rdma_conn *conn,
+			const void *local, void *remote, size_t size) {
+	struct ib_device *ib_dev = conn->ib_dev;
+	struct ib_sge send_sge, recv_sge;
+	struct ib_send_wr send_wr = {};
+	struct ib_recv_wr recv_wr = {};
+	const struct ib_send_wr *bad_send_wr;
+	const struct ib_recv_wr *bad_recv_wr;
+	struct cq_waiter waiter;
+	int err = 0;
+
+	if(size > CTRL_MSG_SIZE) {
+		err = -EINVAL;
+		err_info("Control message too large: %zu\n", size);
+		return err;
+	}
+
+	recv_sge.addr = conn->ctrl_dma + CTRL_MSG_SIZE;
+	recv_sge.length = size;
+	recv_sge.lkey = conn->pd->local_dma_lkey;
+	cq_waiter_init(&waiter, 2);
+	recv_wr.wr_cqe = &waiter.cqe;
+	recv_wr.sg_list = &recv_sge;
+	recv_wr.num_sge = 1;
+	err = ib_post_recv(conn->lanes[0].qp, &recv_wr, &bad_recv_wr);
+	if(err) {
+		err_info("Failed to post control receive\n");
+		return err;
+	}
+
+	memcpy(conn->ctrl_buf, local, size);
+	send_sge.length = size;
+	send_sge.lkey = conn->pd->local_dma_lkey;
+	send_wr.wr_cqe = &waiter.cqe;
+	send_wr.sg_list = &send_sge;
+	send_wr.num_sge = 1;
+	send_wr.opcode = IB_WR_SEND;
+	send_wr.send_flags = IB_SEND_SIGNALED;
+	if(size <= conn->max_inline) {
+		send_sge.addr = (uintptr_t)conn->ctrl_buf;
+		send_wr.send_flags |= IB_SEND_INLINE;
+	}
+	else {
+		ib_dma_sync_single_for_device(ib_dev, conn->ctrl_dma,
+					size, DMA_TO_DEVICE);
+		send_sge.addr = conn->ctrl_dma;
+	}
+	err = ib_post_send(conn->lanes[0].qp, &send_wr, &bad_send_wr);
+	if(err) {
+		/* The receive still points to the waiter */
+		err_info("Failed to post control send\n");
+		cq_waiter_abort(&waiter, conn->lanes[0].qp, 1);
+		return err;
+	}
+
+	err = cq_waiter_wait(&waiter, conn->lanes[0].qp);
+	if(err) {
+		return err;
+	}
+
+	ib_dma_sync_single_for_cpu(ib_dev, conn->ctrl_dma + CTRL_MSG_SIZE,
+				size, DMA_FROM_DEVICE);
+	memcpy(remote, conn->ctrl_buf + CTRL_MSG_SIZE, size);
+	return err;
+}
+
+int rdma_conn_exchange(struct rdma_conn *conn,
+			const void *local, void *remote, size_t size) {
+	if(conn->use_cm)
+		return exchange_ctrl(conn, local, remote, size);
+	return exchange_info(conn->is_server, local, remote,
+				size, conn->client_sock);
+}
+
+/*
+ * Blocks until the peer reaches the same point. One-sided operations
+ * leave the target without completions, so both sides meet over the
+ * handshake channel once the initiator has finished.
+ */
+int rdma_conn_sync(struct rdma_conn *conn) {
+	u32 local = 0, remote;
+
+	return rdma_conn_exchange(conn, &local, &remote, sizeof(local));
+}
+
+void init_conn_pool(void) {
+	INIT_LIST_HEAD(&conn_list);
+	mutex_init(&conn_mutex);
+	init_waitqueue_head(&conn_wq);
+	INIT_DELAYED_WORK(&reap_work, reap_idle_conns);
+	INIT_LIST_HEAD(&listener_list);
+	mutex_init(&listener_mutex);
+	spin_lock_init(&listener_lock);
+}
+
+static void destroy_cm_listeners(void) {
+	struct cm_listener *listener, *tmp;
+	struct rdma_conn *conn;
+
+	list_for_each_entry_safe(listener, tmp, &listener_list, ent) {
+		rdma_destroy_id(listener->cm_id);
+		while((conn = pop_cm_request(listener))) {
+			reject_cm_req(conn->cm_id);
+			rdma_destroy_id(conn->cm_id);
+			kfree(conn);
+		}
+
+		spin_lock(&listener_lock);
+		list_del(&listener->ent);
+		spin_unlock(&listener_lock);
+		put_net(listener->net);
+		kfree(listener);
+	}
+}
+
+/*
+ * The devices have been removed by now, which flushed every connection;
+ * only the listeners and the reaper may be left.
+ */
+void destroy_conn_pool(void) {
+	destroy_cm_listeners();
+	cancel_delayed_work_sync(&reap_work);
+	WARN_ON(!list_empty(&conn_list));
+}
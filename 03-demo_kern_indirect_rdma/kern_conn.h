@@ -0,0 +1,134 @@
+#ifndef __KERN_CONN_H__
+#define __KERN_CONN_H__
+
+#include <linux/in.h>
+#include <linux/list.h>
+#include <linux/completion.h>
+#include <linux/sizes.h>
+#include <linux/scatterlist.h>
+#include <rdma/ib_verbs.h>
+#include <rdma/rdma_cm.h>
+#include "kern_cq.h"
+#include "kern_dev.h"
+#include "common.h"
+
+#define QP_MAX_WR						128
+#define QP_MAX_SGE						30
+#define CONN_MAX_LANES					8
+
+/* Largest payload a send can carry through the bounce buffer */
+#define CONN_BOUNCE_SIZE				SZ_64K
+
+struct qp_conn_param {
+	u32					qpn;
+	u32					psn;
+	u16					lid;
+	union ib_gid		gid;
+	u8					mtu;
+};
+
+/* Exchanged over TCP when a connection is set up, one entry per lane */
+struct conn_setup_info {
+	u32							nr_lanes;
+	struct qp_conn_param		lanes[CONN_MAX_LANES];
+};
+
+/*
+ * One QP of a connection and the CQ it completes on. The CQs of the lanes
+ * sit on different completion vectors, so their completions are reaped on
+ * different CPUs.
+ */
+struct conn_lane {
+	struct demo_cq					*dcq;
+	struct ib_qp					*qp;
+};
+
+/*
+ * An established RC connection: the verbs objects, the QPs in RTS and the
+ * channel that carries the per-transfer handshake. That is either the TCP
+ * connection the QP attributes were exchanged over, or, for connections
+ * set up by rdma_cm, SEND/RECV control messages on the first QP.
+ * Connections are pooled by (device, network namespace, port, sgid index,
+ * peer address, role, number of lanes) and handed to one transfer at a time.
+ *
+ * A connection has one or more lanes, which a transfer stripes its chunks
+ * over. Lane 0 also carries the control messages and the memory
+ * registrations, which cover every lane since they share the PD. The PD
+ * and the CQs belong to the device and are shared with its other
+ * connections. frmr_pages is the page limit of a pooled fast-registration
+ * MR, 0 without a pool.
+ *
+ * The bounce buffer is DMA-mapped once, when the connection is set up,
+ * and carries the sends small enough to be copied rather than pinned.
+ * bounce_sgt describes it as a single mapped entry.
+ */
+struct rdma_conn {
+	struct list_head				ent;
+	struct ib_device				*ib_dev;
+	int								rdma_port;
+	int								sgid_index;
+	struct net						*net;
+	struct sockaddr_in				s_addr;
+	bool							is_server;
+	bool							use_cm;
+
+	struct demo_dev					*dev;
+	struct ib_pd					*pd;
+	struct ib_mr					*dma_mr;
+	struct conn_lane				lanes[CONN_MAX_LANES];
+	int								nr_lanes;
+	bool							mr_pool;
+	u32								frmr_pages;
+	int								max_sge;
+	u32								max_inline;
+
+	struct socket					*sock;
+	struct socket					*client_sock;
+
+	struct rdma_cm_id				*cm_id;
+	struct completion				cm_done;
+	enum rdma_cm_event_type			cm_event;
+	int								cm_status;
+	bool							cm_broken;
+	void							*ctrl_buf;
+	u64								ctrl_dma;
+
+	void							*bounce_buf;
+	u64								bounce_dma;
+	struct scatterlist				bounce_sg;
+	struct sg_table					bounce_sgt;
+
+	unsigned long					last_used;
+	bool							in_use;
+	bool							reused;
+
+	u32								id;
+	struct demo_stats				*stats;
+	struct dentry					*dbg_file;
+};
+
+extern void init_conn_pool(void);
+extern void destroy_conn_pool(void);
+
+extern struct rdma_conn *rdma_conn_get(struct ib_device *ib_dev,
+			struct net *net, bool is_server, const struct write_param *param);
+extern void rdma_conn_put(struct rdma_conn *conn, bool broken);
+extern void rdma_conn_flush_device(struct ib_device *ib_dev);
+
+extern int setup_connection(struct net *net, bool is_server,
+			const struct sockaddr_in *s_addr,
+			struct socket **sock, struct socket **client_sock);
+extern void close_connection(bool is_server,
+			struct socket *sock, struct socket *client_sock);
+extern int exchange_info(bool is_server, const void *local, void *remote,
+			size_t size, struct socket *client_sock);
+
+extern int bring_up_qp(struct rdma_conn *conn, struct ib_qp *qp,
+			const struct qp_conn_param *local_info,
+			const struct qp_conn_param *remote_info);
+
+extern int rdma_conn_exchange(struct rdma_conn *conn,
+			const void *local, void *remote, size_t size);
+extern int rdma_conn_sync(struct rdma_conn *conn);
+
+#endif
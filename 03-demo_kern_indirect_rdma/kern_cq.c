@@ -0,0 +1,278 @@
+#include <linux/slab.h>
+#include <linux/module.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/dim.h>
+#include <rdma/ib_verbs.h>
+#include "kern_cq.h"
+#include "kern_stats.h"
+#include "common.h"
+
+/* Completions reaped by one run of the poll work before it yields */
+#define CQ_POLL_BUDGET					256
+
+static bool cq_dim = true;
+module_param(cq_dim, bool, 0444);
+MODULE_PARM_DESC(cq_dim, "Adapt CQ interrupt moderation to the completion rate");
+
+static struct workqueue_struct *cq_wq;
+
+/*
+ * Moderation profiles stepped through by rdma_dim, from the lowest
+ * latency to the highest completion rate.
+ */
+static const struct dim_cq_moder cq_dim_prof[RDMA_DIM_PARAMS_NUM_PROFILES] = {
+	{1,  0, 1,  0},
+	{1,  0, 4,  0},
+	{2,  0, 4,  0},
+	{2,  0, 8,  0},
+	{4,  0, 8,  0},
+	{16, 0, 8,  0},
+	{16, 0, 16, 0},
+	{32, 0, 16, 0},
+	{32, 0, 32, 0},
+};
+
+static void cq_dim_work(struct work_struct *work) {
+	struct dim *dim = container_of(work, struct dim, work);
+	struct demo_cq *dcq = dim->priv;
+	const struct dim_cq_moder *prof = &cq_dim_prof[dim->profile_ix];
+
+	dim->state = DIM_START_MEASURE;
+	rdma_set_cq_moderation(dcq->cq, prof->comps, prof->usec);
+}
+
+static void cq_poll_work(struct work_struct *work) {
+	struct demo_cq *dcq = container_of(work, struct demo_cq, work);
+	int completed = 0;
+	int polls = 0, empty_polls = 0;
+	int n, i;
+
+	do {
+		n = ib_poll_cq(dcq->cq, CQ_POLL_BATCH, dcq->wcs);
+		polls++;
+		if(n <= 0)
+			empty_polls++;
+		for(i = 0; i < n; i++) {
+			struct ib_wc *wc = &dcq->wcs[i];
+			if(wc->wr_cqe)
+				wc->wr_cqe->done(dcq->cq, wc);
+		}
+
+		completed += max(n, 0);
+		if(completed >= CQ_POLL_BUDGET) {
+			queue_work(cq_wq, &dcq->work);
+			goto out;
+		}
+	} while(n == CQ_POLL_BATCH);
+
+	if(ib_req_notify_cq(dcq->cq,
+				IB_CQ_NEXT_COMP | IB_CQ_REPORT_MISSED_EVENTS) > 0)
+		queue_work(cq_wq, &dcq->work);
+
+out:
+	stats_add(dcq->stats, cq_polls, polls);
+	stats_add(dcq->stats, cq_empty_polls, empty_polls);
+	stats_add(dcq->stats, completions, completed);
+	if(dcq->use_dim)
+		rdma_dim(&dcq->dim, completed);
+}
+
+static void cq_comp_handler(struct ib_cq *cq, void *cq_context) {
+	struct demo_cq *dcq = cq_context;
+
+	queue_work(cq_wq, &dcq->work);
+}
+
+struct demo_cq *demo_cq_create(struct ib_device *ib_dev,
+			int nr_cqe, int comp_vector) {
+	struct demo_cq *dcq;
+	struct ib_cq_init_attr cq_init_attr = {};
+	int err = 0;
+
+	dcq = kzalloc(sizeof(*dcq), GFP_KERNEL);
+	if(!dcq) {
+		err = -ENOMEM;
+		err_info("Failed to alloc CQ context\n");
+		return ERR_PTR(err);
+	}
+
+	INIT_WORK(&dcq->work, cq_poll_work);
+	INIT_LIST_HEAD(&dcq->pool_ent);
+	dcq->nr_cqe = nr_cqe;
+	dcq->comp_vector = comp_vector;
+	cq_init_attr.cqe = nr_cqe;
+	cq_init_attr.comp_vector = comp_vector;
+	cq_init_attr.flags = 0;
+	dcq->cq = ib_create_cq(ib_dev, cq_comp_handler, NULL,
+					dcq, &cq_init_attr);
+	if(IS_ERR(dcq->cq)) {
+		err = (int)PTR_ERR(dcq->cq);
+		kfree(dcq);
+		return ERR_PTR(err);
+	}
+
+	dcq->use_dim = (cq_dim && ib_dev->ops.modify_cq);
+	if(dcq->use_dim) {
+		dcq->dim.state = DIM_START_MEASURE;
+		dcq->dim.tune_state = DIM_GOING_RIGHT;
+		dcq->dim.profile_ix = RDMA_DIM_START_PROFILE;
+		dcq->dim.priv = dcq;
+		INIT_WORK(&dcq->dim.work, cq_dim_work);
+	}
+
+	ib_req_notify_cq(dcq->cq, IB_CQ_NEXT_COMP);
+	return dcq;
+}
+
+/* The QPs on the CQ must be gone, so that no completion can arrive */
+void demo_cq_destroy(struct demo_cq *dcq) {
+	cancel_work_sync(&dcq->work);
+	if(dcq->use_dim)
+		cancel_work_sync(&dcq->dim.work);
+	ib_destroy_cq(dcq->cq);
+	kfree(dcq);
+}
+
+/* The CQs of the pool count their polls and completions in stats */
+int cq_pool_init(struct cq_pool *pool, struct ib_device *ib_dev,
+			int nr_cqs, int cq_size, struct demo_stats *stats) {
+	struct demo_cq *dcq;
+	int i;
+
+	pool->ib_dev = ib_dev;
+	pool->cq_size = cq_size;
+	pool->stats = stats;
+	mutex_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->cqs);
+
+	for(i = 0; i < nr_cqs; i++) {
+		dcq = demo_cq_create(ib_dev, cq_size, i % ib_dev->num_comp_vectors);
+		if(IS_ERR(dcq)) {
+			cq_pool_destroy(pool);
+			return (int)PTR_ERR(dcq);
+		}
+		dcq->stats = stats;
+		list_add_tail(&dcq->pool_ent, &pool->cqs);
+	}
+
+	return 0;
+}
+
+/* Every QP on the CQs of the pool must be gone */
+void cq_pool_destroy(struct cq_pool *pool) {
+	struct demo_cq *dcq, *tmp;
+
+	list_for_each_entry_safe(dcq, tmp, &pool->cqs, pool_ent) {
+		WARN_ON(dcq->cqe_used);
+		list_del(&dcq->pool_ent);
+		demo_cq_destroy(dcq);
+	}
+}
+
+/*
+ * Reserves nr_cqe entries on a CQ of comp_vector, which is created if
+ * none of the CQs of the vector has that much room left.
+ */
+struct demo_cq *cq_pool_get(struct cq_pool *pool,
+			int nr_cqe, int comp_vector) {
+	struct demo_cq *dcq;
+
+	mutex_lock(&pool->lock);
+	list_for_each_entry(dcq, &pool->cqs, pool_ent) {
+		if(dcq->comp_vector == comp_vector &&
+					dcq->nr_cqe - dcq->cqe_used >= nr_cqe)
+			goto out;
+	}
+
+	dcq = demo_cq_create(pool->ib_dev, max(pool->cq_size, nr_cqe),
+				comp_vector);
+	if(IS_ERR(dcq)) {
+		err_info("Failed to grow CQ pool\n");
+		goto out_unlock;
+	}
+	dcq->stats = pool->stats;
+	list_add_tail(&dcq->pool_ent, &pool->cqs);
+
+out:
+	dcq->cqe_used += nr_cqe;
+out_unlock:
+	mutex_unlock(&pool->lock);
+	return dcq;
+}
+
+void cq_pool_put(struct cq_pool *pool, struct demo_cq *dcq, int nr_cqe) {
+	mutex_lock(&pool->lock);
+	dcq->cqe_used -= nr_cqe;
+	mutex_unlock(&pool->lock);
+}
+
+static void cq_waiter_done(struct ib_cq *cq, struct ib_wc *wc) {
+	struct cq_waiter *waiter = container_of(wc->wr_cqe,
+					struct cq_waiter, cqe);
+
+	if(wc->status != IB_WC_SUCCESS) {
+		if(wc->status != IB_WC_WR_FLUSH_ERR)
+			err_info("wc not success, status: %s\n",
+					ib_wc_status_msg(wc->status));
+		cmpxchg(&waiter->status, 0, -EIO);
+	}
+
+	if(atomic_dec_and_test(&waiter->pending))
+		complete(&waiter->done);
+}
+
+void cq_waiter_init(struct cq_waiter *waiter, int nr_wr) {
+	waiter->cqe.done = cq_waiter_done;
+	atomic_set(&waiter->pending, nr_wr);
+	waiter->status = 0;
+	init_completion(&waiter->done);
+}
+
+static void cq_waiter_flush(struct cq_waiter *waiter, struct ib_qp *qp) {
+	struct ib_qp_attr qp_attr = {
+		.qp_state		= IB_QPS_ERR,
+	};
+
+	ib_modify_qp(qp, &qp_attr, IB_QP_STATE);
+	wait_for_completion(&waiter->done);
+}
+
+/*
+ * Sleeps until every work request of the group has completed. A fatal
+ * signal moves the QP to the error state, which flushes the outstanding
+ * work requests, so the waiter is never left referenced by the CQ.
+ */
+int cq_waiter_wait(struct cq_waiter *waiter, struct ib_qp *qp) {
+	if(!wait_for_completion_killable(&waiter->done))
+		return waiter->status;
+
+	cq_waiter_flush(waiter, qp);
+	return -EINTR;
+}
+
+/*
+ * Called when posting failed after part of the group had been posted:
+ * the work requests that made it to the QP are flushed and reaped.
+ */
+void cq_waiter_abort(struct cq_waiter *waiter, struct ib_qp *qp,
+			int nr_unposted) {
+	if(atomic_sub_and_test(nr_unposted, &waiter->pending))
+		return;
+
+	cq_waiter_flush(waiter, qp);
+}
+
+int init_cq_wq(void) {
+	cq_wq = alloc_workqueue("demo_rdma_cq", WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+	if(!cq_wq) {
+		err_info("Failed to alloc CQ workqueue\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void destroy_cq_wq(void) {
+	destroy_workqueue(cq_wq);
+}
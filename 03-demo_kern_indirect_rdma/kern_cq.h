@@ -0,0 +1,78 @@
+#ifndef __KERN_CQ_H__
+#define __KERN_CQ_H__
+
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/atomic.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/dim.h>
+#include <rdma/ib_verbs.h>
+#include "common.h"
+
+#define CQ_POLL_BATCH					16
+
+/*
+ * A CQ with its own interrupt-driven poll context. The completion handler
+ * queues a work that reaps completions in batches and hands each of them
+ * to the done callback of its ib_cqe. With DIM, the number of completions
+ * reaped per interrupt drives the moderation of the CQ.
+ */
+struct demo_cq {
+	struct ib_cq					*cq;
+	struct work_struct				work;
+	struct dim						dim;
+	bool							use_dim;
+	struct ib_wc					wcs[CQ_POLL_BATCH];
+	struct demo_stats				*stats;
+
+	struct list_head				pool_ent;
+	int								nr_cqe;
+	int								cqe_used;
+	int								comp_vector;
+};
+
+/*
+ * The CQs of a device, shared by the QPs of all its connections. A QP
+ * reserves room for its work requests on a CQ of the completion vector it
+ * asks for, and the pool grows when all of them are full.
+ */
+struct cq_pool {
+	struct ib_device				*ib_dev;
+	struct mutex					lock;
+	struct list_head				cqs;
+	int								cq_size;
+	struct demo_stats				*stats;
+};
+
+/*
+ * Waits for a group of work requests posted with wr_cqe = &waiter->cqe.
+ * The first failed completion is reported.
+ */
+struct cq_waiter {
+	struct ib_cqe					cqe;
+	atomic_t						pending;
+	int								status;
+	struct completion				done;
+};
+
+extern int init_cq_wq(void);
+extern void destroy_cq_wq(void);
+
+extern struct demo_cq *demo_cq_create(struct ib_device *ib_dev,
+			int nr_cqe, int comp_vector);
+extern void demo_cq_destroy(struct demo_cq *dcq);
+
+extern int cq_pool_init(struct cq_pool *pool, struct ib_device *ib_dev,
+			int nr_cqs, int cq_size, struct demo_stats *stats);
+extern void cq_pool_destroy(struct cq_pool *pool);
+extern struct demo_cq *cq_pool_get(struct cq_pool *pool,
+			int nr_cqe, int comp_vector);
+extern void cq_pool_put(struct cq_pool *pool, struct demo_cq *dcq, int nr_cqe);
+
+extern void cq_waiter_init(struct cq_waiter *waiter, int nr_wr);
+extern int cq_waiter_wait(struct cq_waiter *waiter, struct ib_qp *qp);
+extern void cq_waiter_abort(struct cq_waiter *waiter, struct ib_qp *qp,
+			int nr_unposted);
+
+#endif
@@ -0,0 +1,192 @@
+#include <linux/slab.h>
+#include <linux/hashtable.h>
+#include <linux/stringhash.h>
+#include <linux/spinlock.h>
+#include <linux/cpumask.h>
+#include <linux/version.h>
+#include <rdma/ib_verbs.h>
+#include "kern_dev.h"
+#include "kern_conn.h"
+#include "kern_srv.h"
+#include "kern_stats.h"
+#include "kern_pool.h"
+#include "common.h"
+
+/* Room for the work requests of 16 QPs on each pooled CQ */
+#define DEV_CQ_SIZE						(16 * 2 * QP_MAX_WR)
+
+/*
+ * Devices indexed by name. Lookups run under RCU and only take a reference
+ * on the device; the lock is for adding and removing devices.
+ */
+static DEFINE_HASHTABLE(dev_table, 4);
+static DEFINE_SPINLOCK(dev_lock);
+
+static struct ib_client init_ibdev_client;
+
+static u32 dev_name_hash(const char *name) {
+	return full_name_hash(NULL, name, strlen(name));
+}
+
+static int alloc_dev_resources(struct demo_dev *dev) {
+	struct ib_device *ib_dev = dev->ib_dev;
+	int nr_cqs = min_t(int, ib_dev->num_comp_vectors, num_online_cpus());
+	int err = 0;
+
+	dev->stats = stats_alloc_page();
+	if(!dev->stats) {
+		err = -ENOMEM;
+		goto err_alloc_stats;
+	}
+
+	dev->pd = ib_alloc_pd(ib_dev, 0);
+	if(IS_ERR(dev->pd)) {
+		err = (int)PTR_ERR(dev->pd);
+		goto err_alloc_pd;
+	}
+
+	dev->dma_mr = ib_get_dma_mr(dev->pd, IB_ACCESS_LOCAL_WRITE);
+	if(IS_ERR(dev->dma_mr)) {
+		err = (int)PTR_ERR(dev->dma_mr);
+		goto err_get_dma_mr;
+	}
+
+	err = cq_pool_init(&dev->cq_pool, ib_dev, nr_cqs,
+				min(DEV_CQ_SIZE, ib_dev->attrs.max_cqe), dev->stats);
+	if(err) {
+		goto err_cq_pool;
+	}
+
+	return err;
+
+err_cq_pool:
+	ib_dereg_mr(dev->dma_mr);
+err_get_dma_mr:
+	ib_dealloc_pd(dev->pd);
+err_alloc_pd:
+	stats_free_page(dev->stats);
+err_alloc_stats:
+	return err;
+}
+
+static void free_dev_resources(struct demo_dev *dev) {
+	cq_pool_destroy(&dev->cq_pool);
+	ib_dereg_mr(dev->dma_mr);
+	ib_dealloc_pd(dev->pd);
+	stats_free_page(dev->stats);
+}
+
+static int add_device_to_list(struct ib_device *ibdev) {
+	struct demo_dev *dev;
+	int err = 0;
+
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if(!dev) {
+		err = -ENOMEM;
+		err_info("Failed to alloc new entry for ib_device\n");
+		return err;
+	}
+
+	dev->ib_dev = ibdev;
+	strscpy(dev->name, ibdev->name, sizeof(dev->name));
+	atomic_set(&dev->refs, 1);
+	init_completion(&dev->done);
+	mutex_init(&dev->pool_lock);
+	err = alloc_dev_resources(dev);
+	if(err) {
+		err_info("Failed to alloc resources of %s, err: %d\n",
+					dev->name, err);
+		kfree(dev);
+		return err;
+	}
+
+	dev->dbg_dir = stats_create_dir(dev->name, dev->stats);
+	ib_set_client_data(ibdev, &init_ibdev_client, dev);
+	spin_lock(&dev_lock);
+	hash_add_rcu(dev_table, &dev->node, dev_name_hash(dev->name));
+	spin_unlock(&dev_lock);
+	return err;
+}
+
+/* The add callback of a client returns an error from 5.8 on */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#define add_device_cb					add_device_to_list
+#else
+static void add_device_cb(struct ib_device *ibdev) {
+	add_device_to_list(ibdev);
+}
+#endif
+
+/*
+ * Once the device is out of the index, no new transfer or server can find
+ * it. The servers on it are stopped, the transfers in flight are waited
+ * for, and then the connections they left in the pool are destroyed, with
+ * their stats files, before the shared objects they use. The buffer pool
+ * is unmapped from the device too; its pages stay until its buffers go.
+ */
+static void rm_device_from_list(struct ib_device *ibdev, void *data) {
+	struct demo_dev *dev = data;
+
+	if(!dev)
+		return;
+
+	spin_lock(&dev_lock);
+	hash_del_rcu(&dev->node);
+	spin_unlock(&dev_lock);
+
+	srv_flush_device(dev);
+	demo_dev_put(dev);
+	wait_for_completion(&dev->done);
+	rdma_conn_flush_device(ibdev);
+	pool_detach_device(dev);
+	debugfs_remove_recursive(dev->dbg_dir);
+	free_dev_resources(dev);
+	kfree_rcu(dev, rcu);
+}
+
+static struct ib_client init_ibdev_client = {
+	.name				= "init_ibdev_list",
+	.add				= add_device_cb,
+	.remove				= rm_device_from_list,
+};
+
+struct demo_dev *demo_dev_get(const char *dev_name) {
+	struct demo_dev *dev;
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(dev_table, dev, node, dev_name_hash(dev_name)) {
+		if(!strcmp(dev->name, dev_name) && atomic_inc_not_zero(&dev->refs))
+			goto out;
+	}
+	dev = NULL;
+
+out:
+	rcu_read_unlock();
+	return dev;
+}
+
+void demo_dev_put(struct demo_dev *dev) {
+	if(atomic_dec_and_test(&dev->refs))
+		complete(&dev->done);
+}
+
+/* Only valid while the caller holds a reference on the device */
+struct demo_dev *demo_dev_of(struct ib_device *ib_dev) {
+	return ib_get_client_data(ib_dev, &init_ibdev_client);
+}
+
+int init_ib_dev_list(void) {
+	int err = 0;
+
+	err = ib_register_client(&init_ibdev_client);
+	if(err) {
+		err_info("Failed to register ib_client\n");
+		return err;
+	}
+
+	return err;
+}
+
+void destroy_ib_dev_list(void) {
+	ib_unregister_client(&init_ibdev_client);
+}
@@ -0,0 +1,45 @@
+#ifndef __KERN_DEV_H__
+#define __KERN_DEV_H__
+
+#include <linux/list.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/rcupdate.h>
+#include <rdma/ib_verbs.h>
+#include "kern_cq.h"
+#include "common.h"
+
+struct dentry;
+struct buf_pool;
+
+/*
+ * The verbs objects shared by every connection on an RDMA device. They are
+ * created when the device shows up and live until it goes away, so a
+ * transfer never allocates them. Every transfer holds a reference for its
+ * duration; removal of the device waits for them to drop.
+ */
+struct demo_dev {
+	struct ib_device				*ib_dev;
+	char							name[IB_DEVICE_NAME_MAX];
+	struct hlist_node				node;
+	struct ib_pd					*pd;
+	struct ib_mr					*dma_mr;
+	struct cq_pool					cq_pool;
+	struct mutex					pool_lock;
+	struct buf_pool					*pool;
+	struct demo_stats				*stats;
+	struct dentry					*dbg_dir;
+	atomic_t						refs;
+	struct completion				done;
+	struct rcu_head					rcu;
+};
+
+extern int init_ib_dev_list(void);
+extern void destroy_ib_dev_list(void);
+
+extern struct demo_dev *demo_dev_get(const char *dev_name);
+extern void demo_dev_put(struct demo_dev *dev);
+extern struct demo_dev *demo_dev_of(struct ib_device *ib_dev);
+
+#endif
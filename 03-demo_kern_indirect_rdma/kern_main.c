@@ -3,10 +3,23 @@
 #include <linux/miscdevice.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/nsproxy.h>
+#include <net/net_namespace.h>
 #include "kern_rdma.h"
+#include "kern_conn.h"
+#include "kern_cq.h"
+#include "kern_dev.h"
 #include "kern_sg.h"
+#include "kern_ring.h"
+#include "kern_srv.h"
+#include "kern_stats.h"
+#include "kern_pool.h"
+#include "../common/demo_compat.h"
 #include "common.h"
 
+#define CREATE_TRACE_POINTS
+#include "kern_trace.h"
+
 static ssize_t indirect_rdma_write(struct file *filep,
 				const char __user *buf, size_t size, loff_t *loff) {
 	int err = 0;
@@ -19,16 +32,15 @@ static ssize_t indirect_rdma_write(struct file *filep,
 		return err;
 	}
 
-	err = copy_from_user(&param, buf, size);
-	if(err) {
+	if(copy_from_user(&param, buf, size)) {
+		err = -EFAULT;
 		err_info("Failed to copy from user\n");
 		return err;
 	}
+	param.dev_name[DEV_NAME_SIZE - 1] = '\0';
 
 	is_server = (param.s_addr.sin_addr.s_addr == htonl(INADDR_ANY));
-	err = kern_rdma_core(is_server, param.dev_name, &param.s_addr, 
-						param.rdma_port, param.sgid_index,
-						param.virtaddr, param.length);
+	err = kern_rdma_core(filep, is_server, &param);
 	if(err) {
 		err_info("Failed to execute indirect RDMA\n");
 	}
@@ -36,14 +48,240 @@ static ssize_t indirect_rdma_write(struct file *filep,
 	return (!err)? size: err;
 }
 
+#ifdef HAVE_URING_CMD
+/*
+ * Transfers and unpins can sleep, so they are never served inline:
+ * returning -EAGAIN on a non-blocking issue makes io_uring punt the
+ * command to an io-wq worker, which shares the mm of the submitter.
+ */
+static int indirect_rdma_uring_cmd(struct io_uring_cmd *ioucmd,
+				unsigned int issue_flags) {
+	const struct uring_cmd_param *cmd = uring_cmd_payload(ioucmd);
+	struct write_param param;
+	bool is_server;
+	int err = 0;
+
+	if(issue_flags & IO_URING_F_NONBLOCK)
+		return -EAGAIN;
+
+	if(copy_from_user(&param, u64_to_user_ptr(READ_ONCE(cmd->param)),
+					sizeof(param))) {
+		err = -EFAULT;
+		err_info("Failed to copy from user\n");
+		return err;
+	}
+	param.dev_name[DEV_NAME_SIZE - 1] = '\0';
+
+	switch(ioucmd->cmd_op) {
+	case URING_CMD_TRANSFER:
+		is_server = (param.s_addr.sin_addr.s_addr == htonl(INADDR_ANY));
+		err = kern_rdma_core(ioucmd->file, is_server, &param);
+		if(err) {
+			err_info("Failed to execute indirect RDMA\n");
+		}
+		break;
+	case URING_CMD_UNPIN:
+		err = kern_rdma_unpin(&param);
+		break;
+	default:
+		err = -ENOTTY;
+		break;
+	}
+
+	return err;
+}
+#endif
+
+static long indirect_rdma_dev_node(struct dev_node_param __user *uparam) {
+	struct dev_node_param param;
+	int node;
+	int err = 0;
+
+	if(copy_from_user(&param, uparam, sizeof(param))) {
+		err = -EFAULT;
+		err_info("Failed to copy from user\n");
+		return err;
+	}
+
+	param.dev_name[DEV_NAME_SIZE - 1] = '\0';
+	node = get_ib_dev_numa_node(param.dev_name);
+	if(node == -ENODEV) {
+		err = node;
+		err_info("No such device: %s\n", param.dev_name);
+		return err;
+	}
+
+	if(put_user(node, &uparam->node)) {
+		err = -EFAULT;
+		err_info("Failed to copy to user\n");
+	}
+
+	return err;
+}
+
+static long indirect_rdma_reg(struct file *filep,
+				struct reg_param __user *uparam) {
+	struct reg_param param;
+	int err = 0;
+
+	if(copy_from_user(&param, uparam, sizeof(param))) {
+		err = -EFAULT;
+		err_info("Failed to copy from user\n");
+		return err;
+	}
+
+	param.dev_name[DEV_NAME_SIZE - 1] = '\0';
+	err = kern_rdma_register(filep, &param, &param.handle);
+	if(err) {
+		err_info("Failed to register 0x%lx\n", param.virtaddr);
+		return err;
+	}
+
+	if(put_user(param.handle, &uparam->handle)) {
+		err = -EFAULT;
+		err_info("Failed to copy to user\n");
+		kern_rdma_deregister(param.handle);
+	}
+
+	return err;
+}
+
+static long indirect_rdma_dereg(__u64 __user *uhandle) {
+	__u64 handle;
+
+	if(get_user(handle, uhandle))
+		return -EFAULT;
+
+	return kern_rdma_deregister(handle);
+}
+
+static long indirect_rdma_pool_alloc(struct file *filep,
+				struct pool_param __user *uparam) {
+	struct pool_param param;
+	int err = 0;
+
+	if(copy_from_user(&param, uparam, sizeof(param))) {
+		err = -EFAULT;
+		err_info("Failed to copy from user\n");
+		return err;
+	}
+
+	param.dev_name[DEV_NAME_SIZE - 1] = '\0';
+	err = pool_alloc_buf(filep, &param);
+	if(err) {
+		err_info("Failed to alloc %llu bytes from the pool of %s\n",
+					param.length, param.dev_name);
+		return err;
+	}
+
+	if(copy_to_user(uparam, &param, sizeof(param))) {
+		err = -EFAULT;
+		err_info("Failed to copy to user\n");
+		kern_rdma_deregister(param.handle);
+	}
+
+	return err;
+}
+
+static long indirect_rdma_count_sg(struct sg_count_param __user *uparam) {
+	struct sg_count_param param;
+	int err = 0;
+
+	if(copy_from_user(&param, uparam, sizeof(param))) {
+		err = -EFAULT;
+		err_info("Failed to copy from user\n");
+		return err;
+	}
+
+	param.dev_name[DEV_NAME_SIZE - 1] = '\0';
+	err = kern_rdma_count_sg(&param);
+	if(err) {
+		err_info("Failed to count the sg entries of 0x%lx\n", param.virtaddr);
+		return err;
+	}
+
+	if(put_user(param.nents, &uparam->nents)) {
+		err = -EFAULT;
+		err_info("Failed to copy to user\n");
+	}
+
+	return err;
+}
+
+static long indirect_rdma_srv(unsigned int cmd,
+				struct srv_param __user *uparam) {
+	struct srv_param param;
+
+	if(copy_from_user(&param, uparam, sizeof(param))) {
+		err_info("Failed to copy from user\n");
+		return -EFAULT;
+	}
+
+	param.dev_name[DEV_NAME_SIZE - 1] = '\0';
+	if(cmd == IOCTL_SRV_STOP)
+		return srv_stop(&param, current->nsproxy->net_ns);
+	return srv_start(&param, current->nsproxy->net_ns);
+}
+
+static long indirect_rdma_ioctl(struct file *filep,
+				unsigned int cmd, unsigned long arg) {
+	switch(cmd) {
+	case IOCTL_DEV_NODE:
+		return indirect_rdma_dev_node((struct dev_node_param __user *)arg);
+	case IOCTL_REG_REGION:
+		return indirect_rdma_reg(filep, (struct reg_param __user *)arg);
+	case IOCTL_DEREG_REGION:
+		return indirect_rdma_dereg((__u64 __user *)arg);
+	case IOCTL_RING_SETUP:
+		return ring_setup(filep, (struct ring_setup_param __user *)arg);
+	case IOCTL_RING_ENTER:
+		return ring_enter(filep, (struct ring_enter_param __user *)arg);
+	case IOCTL_SRV_START:
+	case IOCTL_SRV_STOP:
+		return indirect_rdma_srv(cmd, (struct srv_param __user *)arg);
+	case IOCTL_POOL_ALLOC:
+		return indirect_rdma_pool_alloc(filep,
+					(struct pool_param __user *)arg);
+	case IOCTL_COUNT_SG:
+		return indirect_rdma_count_sg((struct sg_count_param __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* The rings are mapped at offset 0, pool buffers at their mmap_offset */
+static int indirect_rdma_mmap(struct file *filep, struct vm_area_struct *vma) {
+	if(vma->vm_pgoff)
+		return pool_mmap(filep, vma);
+	return ring_mmap(filep, vma);
+}
+
+/* misc_open leaves the miscdevice in private_data, which holds the rings */
+static int indirect_rdma_open(struct inode *inode, struct file *filep) {
+	filep->private_data = NULL;
+	return 0;
+}
+
+/* The transfers queued on the rings use the registrations, so they go first */
 static int indirect_rdma_release(struct inode *inode, struct file *filep) {
-	kern_rdma_release();
+	ring_release(filep);
+	kern_rdma_release(filep);
 	return 0;
 }
 
 static struct file_operations dev_fops = {
 	.owner				= THIS_MODULE,
+	.open				= indirect_rdma_open,
 	.write				= indirect_rdma_write,
+	.unlocked_ioctl		= indirect_rdma_ioctl,
+	.mmap				= indirect_rdma_mmap,
+#ifdef HAVE_POOL_HUGE_MAP
+	/* Pool buffers are at PMD-aligned offsets, and get PMD-aligned addresses */
+	.get_unmapped_area	= thp_get_unmapped_area,
+#endif
+#ifdef HAVE_URING_CMD
+	.uring_cmd			= indirect_rdma_uring_cmd,
+#endif
 	.release			= indirect_rdma_release,
 };
 
@@ -54,33 +292,69 @@ static struct miscdevice misc = {
 	.mode			= 00666,
 };
 
+/* The device node goes live last, once everything it reaches is set up */
 static int __init indirect_rdma_init(void) {
 	int err = 0;
 
-	err = misc_register(&misc);
+	init_sg_tbl_list();
+
+	err = init_cq_wq();
 	if(err) {
-		err_info("misc_register error\n");
 		return err;
 	}
 
+	err = init_ring_wq();
+	if(err) {
+		goto err_ring_wq;
+	}
+
+	err = init_srv_list();
+	if(err) {
+		goto err_srv_list;
+	}
+
+	err = init_stats();
+	if(err) {
+		goto err_stats;
+	}
+
+	init_conn_pool();
 	err = init_ib_dev_list();
 	if(err) {
 		err_info("Failed to init ibdev list\n");
 		goto err_init_list;
 	}
 
-	init_sg_tbl_list();
-	
+	err = misc_register(&misc);
+	if(err) {
+		err_info("misc_register error\n");
+		goto err_misc;
+	}
+
 	return err;
 
+err_misc:
+	destroy_ib_dev_list();
+	destroy_conn_pool();
 err_init_list:
-	misc_deregister(&misc);
+	destroy_stats();
+err_stats:
+	destroy_srv_list();
+err_srv_list:
+	destroy_ring_wq();
+err_ring_wq:
+	destroy_cq_wq();
 	return err;
 }
 
 static void __exit indirect_rdma_exit(void) {
-	destroy_ib_dev_list();
 	misc_deregister(&misc);
+	destroy_srv_list();
+	destroy_ib_dev_list();
+	destroy_conn_pool();
+	destroy_stats();
+	destroy_ring_wq();
+	destroy_cq_wq();
 }
 
 module_init(indirect_rdma_init);
@@ -0,0 +1,471 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/bitmap.h>
+#include <linux/module.h>
+#include <linux/overflow.h>
+#include <rdma/ib_verbs.h>
+#include "kern_pool.h"
+#include "kern_dev.h"
+#include "kern_sg.h"
+#include "common.h"
+
+#ifdef HAVE_POOL_HUGE_MAP
+#include <linux/huge_mm.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 17, 0)
+#include <linux/pfn_t.h>
+#endif
+#endif
+
+#define POOL_CHUNK_ORDER				(POOL_CHUNK_SHIFT - PAGE_SHIFT)
+
+static unsigned int pool_chunks = 32;
+module_param(pool_chunks, uint, 0444);
+MODULE_PARM_DESC(pool_chunks, "2 MiB chunks in the buffer pool of a device, allocated on first use");
+
+struct pool_chunk {
+	struct page						*page;
+	u64								dma_addr;
+};
+
+/*
+ * The buffer pool of a device: compound pages of POOL_CHUNK_SIZE bytes,
+ * allocated on the NUMA node of the device and DMA-mapped for it once.
+ * The device and every buffer hold a reference. When the device goes
+ * away, the chunks are unmapped and ib_dev is cleared, but the pages stay
+ * until the last buffer is gone.
+ */
+struct buf_pool {
+	struct kref						ref;
+	struct ib_device				*ib_dev;
+	spinlock_t						lock;
+	unsigned long					*used;
+	unsigned int					nr_chunks;
+	struct pool_chunk				chunks[];
+};
+
+/*
+ * Whole chunks of the pool, mapped back to back into user space. The
+ * registration and every VMA mapping the buffer hold a reference, so the
+ * chunks only go back to the pool, to be handed to another process, once
+ * nothing can reach them anymore.
+ */
+struct pool_buf {
+	struct kref						ref;
+	struct buf_pool					*pool;
+	unsigned int					nr_chunks;
+	unsigned int					idx[];
+};
+
+static void unmap_pool(struct buf_pool *pool) {
+	int i;
+
+	for(i = 0; i < pool->nr_chunks; i++) {
+		ib_dma_unmap_page(pool->ib_dev, pool->chunks[i].dma_addr,
+					POOL_CHUNK_SIZE, DMA_BIDIRECTIONAL);
+	}
+	pool->ib_dev = NULL;
+}
+
+static void free_pool(struct kref *ref) {
+	struct buf_pool *pool = container_of(ref, struct buf_pool, ref);
+	int i;
+
+	if(pool->ib_dev)
+		unmap_pool(pool);
+	for(i = 0; i < pool->nr_chunks; i++)
+		__free_pages(pool->chunks[i].page, POOL_CHUNK_ORDER);
+	bitmap_free(pool->used);
+	kvfree(pool);
+}
+
+static struct buf_pool *create_pool(struct ib_device *ib_dev,
+				unsigned int nr_chunks) {
+	struct buf_pool *pool;
+	int node = dev_to_node(ib_dev->dma_device);
+	int err = 0;
+
+	pool = kvzalloc(struct_size(pool, chunks, nr_chunks), GFP_KERNEL);
+	if(!pool) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	kref_init(&pool->ref);
+	spin_lock_init(&pool->lock);
+	pool->ib_dev = ib_dev;
+	pool->used = bitmap_zalloc(nr_chunks, GFP_KERNEL);
+	if(!pool->used) {
+		err = -ENOMEM;
+		goto err_alloc;
+	}
+
+	while(pool->nr_chunks < nr_chunks) {
+		struct pool_chunk *chunk = &pool->chunks[pool->nr_chunks];
+
+		chunk->page = alloc_pages_node(node, GFP_KERNEL | __GFP_COMP |
+					__GFP_NOWARN, POOL_CHUNK_ORDER);
+		if(!chunk->page) {
+			err = -ENOMEM;
+			err_info("Failed to alloc pool chunk %u\n", pool->nr_chunks);
+			goto err_alloc;
+		}
+
+		chunk->dma_addr = ib_dma_map_page(ib_dev, chunk->page, 0,
+					POOL_CHUNK_SIZE, DMA_BIDIRECTIONAL);
+		if(ib_dma_mapping_error(ib_dev, chunk->dma_addr)) {
+			err = -EFAULT;
+			err_info("Failed to map pool chunk %u\n", pool->nr_chunks);
+			__free_pages(chunk->page, POOL_CHUNK_ORDER);
+			goto err_alloc;
+		}
+		pool->nr_chunks++;
+	}
+
+	return pool;
+
+err_alloc:
+	kref_put(&pool->ref, free_pool);
+	return ERR_PTR(err);
+}
+
+/* The pool of the device, set up on first use, with a reference taken */
+static struct buf_pool *get_dev_pool(struct demo_dev *dev) {
+	struct buf_pool *pool;
+
+	mutex_lock(&dev->pool_lock);
+	if(!dev->pool) {
+		pool = create_pool(dev->ib_dev, pool_chunks);
+		if(IS_ERR(pool))
+			goto out;
+		dev->pool = pool;
+	}
+
+	pool = dev->pool;
+	kref_get(&pool->ref);
+
+out:
+	mutex_unlock(&dev->pool_lock);
+	return pool;
+}
+
+/*
+ * Runs once the transfers on the device are done, so no chunk is in use
+ * by the device anymore.
+ */
+void pool_detach_device(struct demo_dev *dev) {
+	struct buf_pool *pool = dev->pool;
+
+	if(!pool)
+		return;
+
+	unmap_pool(pool);
+	dev->pool = NULL;
+	kref_put(&pool->ref, free_pool);
+}
+
+static void free_pool_buf(struct kref *ref) {
+	struct pool_buf *buf = container_of(ref, struct pool_buf, ref);
+	struct buf_pool *pool = buf->pool;
+	int i;
+
+	spin_lock(&pool->lock);
+	for(i = 0; i < buf->nr_chunks; i++)
+		__clear_bit(buf->idx[i], pool->used);
+	spin_unlock(&pool->lock);
+
+	kref_put(&pool->ref, free_pool);
+	kfree(buf);
+}
+
+static void pool_buf_put(void *priv) {
+	struct pool_buf *buf = priv;
+
+	kref_put(&buf->ref, free_pool_buf);
+}
+
+static struct pool_buf *alloc_pool_buf(struct buf_pool *pool,
+				unsigned int nr_chunks) {
+	struct pool_buf *buf;
+	unsigned int bit = 0;
+	int i;
+
+	buf = kzalloc(struct_size(buf, idx, nr_chunks), GFP_KERNEL);
+	if(!buf)
+		return ERR_PTR(-ENOMEM);
+
+	spin_lock(&pool->lock);
+	for(i = 0; i < nr_chunks; i++) {
+		bit = find_next_zero_bit(pool->used, pool->nr_chunks, bit);
+		if(bit >= pool->nr_chunks)
+			break;
+		__set_bit(bit, pool->used);
+		buf->idx[i] = bit;
+	}
+
+	if(i < nr_chunks) {
+		while(i--)
+			__clear_bit(buf->idx[i], pool->used);
+		spin_unlock(&pool->lock);
+		kfree(buf);
+		return ERR_PTR(-ENOSPC);
+	}
+	spin_unlock(&pool->lock);
+
+	/* The chunks may have belonged to another process */
+	for(i = 0; i < nr_chunks; i++)
+		memset(page_address(pool->chunks[buf->idx[i]].page), 0,
+					POOL_CHUNK_SIZE);
+
+	kref_init(&buf->ref);
+	buf->pool = pool;
+	buf->nr_chunks = nr_chunks;
+	return buf;
+}
+
+/*
+ * Hands out whole chunks and registers them for filep as a premapped sg
+ * list of one entry per chunk; the last entry stops at the end of the
+ * buffer.
+ */
+int pool_alloc_buf(struct file *filep, struct pool_param *param) {
+	struct demo_dev *dev;
+	struct buf_pool *pool;
+	struct pool_buf *buf;
+	struct sg_table *sgtbl;
+	struct scatterlist *sg;
+	unsigned long nr_chunks = DIV_ROUND_UP(param->length, POOL_CHUNK_SIZE);
+	unsigned long remaining = param->length;
+	int err = 0;
+	int i;
+
+	if(!nr_chunks || nr_chunks > pool_chunks) {
+		err_info("Invalid pool buffer length: %llu\n", param->length);
+		return -EINVAL;
+	}
+
+	dev = demo_dev_get(param->dev_name);
+	if(!dev) {
+		return -ENODEV;
+	}
+
+	pool = get_dev_pool(dev);
+	if(IS_ERR(pool)) {
+		err = (int)PTR_ERR(pool);
+		goto err_pool;
+	}
+
+	buf = alloc_pool_buf(pool, nr_chunks);
+	if(IS_ERR(buf)) {
+		err = (int)PTR_ERR(buf);
+		kref_put(&pool->ref, free_pool);
+		goto err_pool;
+	}
+
+	sgtbl = alloc_premapped_sg_tbl(nr_chunks, param->length,
+				pool_buf_put, buf);
+	if(!sgtbl) {
+		err = -ENOMEM;
+		goto err_sgtbl;
+	}
+
+	for_each_sg(sgtbl->sgl, sg, sgtbl->nents, i) {
+		const struct pool_chunk *chunk = &pool->chunks[buf->idx[i]];
+		unsigned int len = min(remaining, POOL_CHUNK_SIZE);
+
+		sg_set_page(sg, chunk->page, len, 0);
+		sg_dma_address(sg) = chunk->dma_addr;
+		sg_dma_len(sg) = len;
+		remaining -= len;
+	}
+
+	err = register_premapped_sg_tbl(sgtbl, filep, &param->handle);
+	if(err) {
+		goto err_sgtbl;
+	}
+
+	param->mmap_offset = param->handle << POOL_MMAP_SHIFT;
+	demo_dev_put(dev);
+	return err;
+
+err_sgtbl:
+	pool_buf_put(buf);
+err_pool:
+	demo_dev_put(dev);
+	return err;
+}
+
+struct pool_buf *pool_buf_of_sg_tbl(const struct sg_table *sgtbl) {
+	return sg_tbl_priv(sgtbl);
+}
+
+/*
+ * The chunks stay mapped across transfers, so ownership is handed to the
+ * device and back around each of them; without bounce buffers or
+ * non-coherent caches, this costs nothing.
+ */
+int pool_buf_sync_for_device(struct pool_buf *buf,
+			struct ib_device *ib_dev, enum dma_data_direction dir) {
+	struct buf_pool *pool = buf->pool;
+	int i;
+
+	if(pool->ib_dev != ib_dev) {
+		err_info("Pool buffer belongs to another device\n");
+		return -EXDEV;
+	}
+
+	for(i = 0; i < buf->nr_chunks; i++) {
+		ib_dma_sync_single_for_device(ib_dev,
+					pool->chunks[buf->idx[i]].dma_addr, POOL_CHUNK_SIZE, dir);
+	}
+	return 0;
+}
+
+/* Once the device is gone, the chunks are unmapped and owned by the CPU */
+void pool_buf_sync_for_cpu(struct pool_buf *buf,
+			struct ib_device *ib_dev, enum dma_data_direction dir) {
+	struct buf_pool *pool = buf->pool;
+	int i;
+
+	if(pool->ib_dev != ib_dev)
+		return;
+
+	for(i = 0; i < buf->nr_chunks; i++) {
+		ib_dma_sync_single_for_cpu(ib_dev,
+					pool->chunks[buf->idx[i]].dma_addr, POOL_CHUNK_SIZE, dir);
+	}
+}
+
+static void pool_vm_open(struct vm_area_struct *vma) {
+	struct pool_buf *buf = vma->vm_private_data;
+
+	kref_get(&buf->ref);
+}
+
+static void pool_vm_close(struct vm_area_struct *vma) {
+	pool_buf_put(vma->vm_private_data);
+}
+
+#ifdef HAVE_POOL_HUGE_MAP
+/* The chunks are mapped back to back from the start of the VMA */
+static unsigned long pool_vm_pfn(struct vm_area_struct *vma,
+				unsigned long addr) {
+	struct pool_buf *buf = vma->vm_private_data;
+	unsigned long off = addr - vma->vm_start;
+	struct page *page;
+
+	page = buf->pool->chunks[buf->idx[off >> POOL_CHUNK_SHIFT]].page;
+	return page_to_pfn(page) + ((off & (POOL_CHUNK_SIZE - 1)) >> PAGE_SHIFT);
+}
+
+static vm_fault_t pool_vm_fault(struct vm_fault *vmf) {
+	return vmf_insert_pfn(vmf->vma, vmf->address,
+				pool_vm_pfn(vmf->vma, vmf->address));
+}
+
+/*
+ * Maps a whole chunk with one PMD. A VMA that does not start on a PMD
+ * boundary has its chunks straddle PMDs, and falls back to PTEs.
+ */
+static vm_fault_t pool_vm_huge_fault(struct vm_fault *vmf,
+				unsigned int order) {
+	struct vm_area_struct *vma = vmf->vma;
+	unsigned long addr = vmf->address & PMD_MASK;
+	unsigned long pfn;
+
+	if(order != PMD_ORDER || POOL_CHUNK_SIZE != PMD_SIZE ||
+				(vma->vm_start & ~PMD_MASK) || addr + PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+
+	pfn = pool_vm_pfn(vma, addr);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 17, 0)
+	return vmf_insert_pfn_pmd(vmf, pfn, vmf->flags & FAULT_FLAG_WRITE);
+#else
+	return vmf_insert_pfn_pmd(vmf, pfn_to_pfn_t(pfn),
+				vmf->flags & FAULT_FLAG_WRITE);
+#endif
+}
+#endif
+
+static const struct vm_operations_struct pool_vm_ops = {
+	.open			= pool_vm_open,
+	.close			= pool_vm_close,
+#ifdef HAVE_POOL_HUGE_MAP
+	.fault			= pool_vm_fault,
+	.huge_fault		= pool_vm_huge_fault,
+#endif
+};
+
+static int remap_pool_buf(struct vm_area_struct *vma, struct pool_buf *buf) {
+	unsigned long addr = vma->vm_start;
+	int err = 0;
+	int i;
+
+	for(i = 0; addr < vma->vm_end; i++) {
+		struct page *page = buf->pool->chunks[buf->idx[i]].page;
+		unsigned long len = min(vma->vm_end - addr, POOL_CHUNK_SIZE);
+
+		err = remap_pfn_range(vma, addr, page_to_pfn(page), len,
+					vma->vm_page_prot);
+		if(err) {
+			err_info("remap_pfn_range error, err: %d\n", err);
+			return err;
+		}
+		addr += len;
+	}
+	return err;
+}
+
+/*
+ * Maps the chunks of the buffer whose handle is encoded in the offset. The
+ * pages keep no count of the mapping, so the buffer is held instead.
+ *
+ * Where PFN mappings can be huge, a shared mapping is filled on fault,
+ * with one PMD per chunk; the device hands out PMD-aligned addresses for
+ * it. Otherwise, the PFNs are remapped up front in 4 KiB PTEs, in the way
+ * of demo 1.
+ */
+int pool_mmap(struct file *filep, struct vm_area_struct *vma) {
+	u64 handle = ((u64)vma->vm_pgoff << PAGE_SHIFT) >> POOL_MMAP_SHIFT;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct sg_table *sgtbl;
+	struct pool_buf *buf;
+	unsigned long length;
+	int access;
+	int err = 0;
+
+	if(((u64)vma->vm_pgoff << PAGE_SHIFT) & ((1ULL << POOL_MMAP_SHIFT) - 1))
+		return -EINVAL;
+
+	sgtbl = acquire_sg_tbl(current->mm, handle, &length, &access);
+	if(IS_ERR(sgtbl)) {
+		return (int)PTR_ERR(sgtbl);
+	}
+
+	buf = pool_buf_of_sg_tbl(sgtbl);
+	if(!buf || size > (unsigned long)buf->nr_chunks * POOL_CHUNK_SIZE) {
+		err = -EINVAL;
+		goto out;
+	}
+
+#ifdef HAVE_POOL_HUGE_MAP
+	if(vma->vm_flags & VM_SHARED)
+		vm_flags_set(vma, VM_IO | VM_PFNMAP | VM_DONTEXPAND |
+					VM_DONTDUMP | VM_HUGEPAGE);
+	else
+#endif
+		err = remap_pool_buf(vma, buf);
+	if(err) {
+		goto out;
+	}
+
+	kref_get(&buf->ref);
+	vma->vm_private_data = buf;
+	vma->vm_ops = &pool_vm_ops;
+
+out:
+	release_sg_tbl(sgtbl);
+	return err;
+}
@@ -0,0 +1,33 @@
+#ifndef __KERN_POOL_H__
+#define __KERN_POOL_H__
+
+#include <linux/mm.h>
+#include <linux/version.h>
+#include <linux/scatterlist.h>
+#include <linux/dma-direction.h>
+#include <rdma/ib_verbs.h>
+#include "kern_dev.h"
+#include "common.h"
+
+/*
+ * PFN mappings can be made of PMDs from Linux 6.12 on, where the
+ * architecture supports it.
+ */
+#if defined(CONFIG_ARCH_SUPPORTS_PMD_PFNMAP) && \
+			LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#define HAVE_POOL_HUGE_MAP
+#endif
+
+struct pool_buf;
+
+extern int pool_alloc_buf(struct file *filep, struct pool_param *param);
+extern int pool_mmap(struct file *filep, struct vm_area_struct *vma);
+extern void pool_detach_device(struct demo_dev *dev);
+
+extern struct pool_buf *pool_buf_of_sg_tbl(const struct sg_table *sgtbl);
+extern int pool_buf_sync_for_device(struct pool_buf *buf,
+			struct ib_device *ib_dev, enum dma_data_direction dir);
+extern void pool_buf_sync_for_cpu(struct pool_buf *buf,
+			struct ib_device *ib_dev, enum dma_data_direction dir);
+
+#endif
@@ -1,466 +1,1958 @@
-#include <linux/list.h>
 #include <linux/slab.h>
-#include <linux/rwlock.h>
+#include <linux/mm.h>
+#include <linux/sched/signal.h>
+#include <linux/nsproxy.h>
+#include <net/net_namespace.h>
+#include <linux/sizes.h>
+#include <linux/module.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
 #include <rdma/ib_verbs.h>
 #include <rdma/ib_cache.h>
+#include <rdma/mr_pool.h>
+#include <linux/iommu.h>
 #include "kern_rdma.h"
+#include "kern_conn.h"
+#include "kern_dev.h"
+#include "kern_tcp.h"
 #include "kern_sg.h"
+#include "kern_stats.h"
+#include "kern_pool.h"
+#include "kern_trace.h"
 #include "common.h"
 
-static struct list_head ib_dev_list;
-static rwlock_t rwlock;
+/* An RC message is limited to 2GB; stay well below */
+#define MAX_CHUNK_SIZE					SZ_1G
 
-struct ib_dev_ent {
-	struct ib_device				*device;
-	struct list_head				ent;
+static unsigned long chunk_size_limit = MAX_CHUNK_SIZE;
+module_param(chunk_size_limit, ulong, 0644);
+MODULE_PARM_DESC(chunk_size_limit, "Largest number of bytes carried by one work request");
+
+static unsigned int xfer_window = 64;
+module_param(xfer_window, uint, 0444);
+MODULE_PARM_DESC(xfer_window, "Work requests of a transfer kept outstanding on the QP");
+
+static unsigned int credit_grant = 16;
+module_param(credit_grant, uint, 0444);
+MODULE_PARM_DESC(credit_grant, "Receives posted by the receiver per credit message");
+
+static unsigned int signal_interval = 16;
+module_param(signal_interval, uint, 0644);
+MODULE_PARM_DESC(signal_interval, "Send WRs per signaled completion");
+
+static unsigned long stream_seg_size = SZ_4M;
+module_param(stream_seg_size, ulong, 0644);
+MODULE_PARM_DESC(stream_seg_size, "Bytes pinned and mapped at a time by a streamed transfer");
+
+static unsigned int eager_threshold;
+module_param(eager_threshold, uint, 0644);
+MODULE_PARM_DESC(eager_threshold, "Largest send copied through the bounce buffer of the connection; larger ones are pulled by the receiver (0: chunked sends only)");
+
+/* Ids of transfers and registrations in the trace events */
+static atomic64_t next_xfer_id;
+
+/*
+ * A buffer that is pinned and DMA-mapped one segment at a time while it is
+ * transferred, so that the device moves the chunks of the first segments
+ * while the next ones are being pinned. Segments end on page boundaries,
+ * at offset `end` of the buffer, and are mapped and released in order:
+ * the first nr_released are unpinned already, and those up to nr_mapped,
+ * which end at `mapped`, are in use.
+ */
+struct stream_seg {
+	struct sg_table				*sgtbl;
+	unsigned long				end;
+	int							dma_nents;
+};
+
+struct region_stream {
+	struct demo_dev				*dev;
+	unsigned long				virtaddr;
+	int							access;
+	unsigned long				seg_size;
+	struct stream_seg			*segs;
+	unsigned int				nr_segs;
+	unsigned int				nr_mapped;
+	unsigned int				nr_released;
+	unsigned long				mapped;
+};
+
+struct rdma_region {
+	struct sg_table				*sgtbl;
+	enum dma_data_direction		dir;
+	int							dma_nents;
+	u64							dma_addr;
+	bool						contig;
+	u32							lkey;
+	unsigned long				length;
+	struct ib_mr				*mr;
+	struct pool_buf				*pool_buf;
+	struct region_stream		*stream;
+	u64							id;
 };
 
-struct rdma_conn_param {
-	u32					qpn;
-	u32					psn;
-	u16					lid;
-	union ib_gid		gid;
+/* seg and left, the DMA segments left in it, only for a streamed region */
+struct region_cursor {
+	struct scatterlist			*sg;
+	unsigned long				off;
+	unsigned int				seg;
+	int							left;
 };
 
-static struct ib_client init_ibdev_client;
+struct xfer_ctx;
+struct xfer_lane;
 
-static int setup_connection(bool is_server, const struct sockaddr_in *s_addr,
-			struct socket **sock, struct socket **client_sock) {
-	struct socket **create_sock;
-	int flag = 1;
-	int err = 0;
+/*
+ * A signaled send WR, which completes the `nr` send WRs posted on its
+ * lane since the previous one. It was posted at `posted`.
+ */
+struct xfer_signal {
+	struct ib_cqe				cqe;
+	struct xfer_lane			*lane;
+	int							nr;
+	ktime_t						posted;
+};
+
+/*
+ * Per-QP state of a transfer. A transfer striped over N lanes sends chunk
+ * k on lane k % N, on both sides, so that every SEND meets the RECV posted
+ * for the same chunk. Receives complete on data_cqe, and only every
+ * signal_interval-th send WR, plus the last one of each chain, is
+ * signaled, on one of the sigs. Credit messages (zero-length
+ * SEND_WITH_IMM from the receiver, whose immediate data is the number of
+ * receives it has just posted on the lane) complete on credit_cqe.
+ */
+struct xfer_lane {
+	struct xfer_ctx				*ctx;
+	struct ib_qp				*qp;
+	struct ib_cqe				data_cqe;
+	struct ib_cqe				credit_cqe;
+	struct xfer_signal			sigs[QP_MAX_WR];
+	unsigned int				nr_sigs;
+	int							unsignaled;
+	unsigned long				nchunks;
+	unsigned long				posted;
+	int							batch;
+	atomic_t					data_done;
+	atomic_t					credits;
+	atomic_t					credit_recvs;
+	int							nr_credit_msgs;
+};
+
+/*
+ * State of one pipelined transfer. inflight counts every WR still owned
+ * by one of the QPs, plus one reference held by the poster; done completes
+ * when it drops to zero.
+ *
+ * The initiator of a one-sided operation targets `window`, the window of
+ * the remote buffer that starts at byte win_start of the transfer and
+ * takes the chunks below win_end. Every window but the last is win_size
+ * bytes long; see expose_windows.
+ */
+struct xfer_ctx {
+	struct xfer_lane			lanes[CONN_MAX_LANES];
+	int							nr_lanes;
+	atomic_t					inflight;
+	int							status;
+	wait_queue_head_t			wq;
+	struct completion			done;
 
-	*sock = (struct socket*)kzalloc(sizeof(struct socket), GFP_KERNEL);
-	*client_sock = (struct socket*)kzalloc(sizeof(struct socket), GFP_KERNEL);
-	if(!(*sock) || !(*client_sock)) {
-		err = -ENOMEM;
-		goto err_kzalloc;
+	struct rdma_region			*region;
+	struct region_cursor		cur;
+	unsigned long				length;
+	unsigned long				nchunks;
+	u32							chunk_size;
+	int							max_sge;
+	enum ib_wr_opcode			opcode;
+	bool						is_recv;
+	bool						inline_data;
+	struct rdma_conn			*conn;
+	struct rdma_xfer_info		window;
+	unsigned long				win_start;
+	unsigned long				win_end;
+	unsigned long				win_size;
+	struct ib_sge				*sges;
+	struct ib_rdma_wr			*send_wrs;
+	struct ib_recv_wr			*recv_wrs;
+
+	struct demo_stats			*dev_stats;
+	struct demo_stats			*conn_stats;
+};
+
+static bool dma_segments_contiguous(const struct rdma_region *region) {
+	struct scatterlist *sg;
+	u64 next = sg_dma_address(region->sgtbl->sgl);
+	int i;
+
+	for_each_sg(region->sgtbl->sgl, sg, region->dma_nents, i) {
+		if(sg_dma_address(sg) != next)
+			return false;
+		next += sg_dma_len(sg);
 	}
 
-	create_sock = (is_server)? sock: client_sock;
+	return true;
+}
+
+static int pin_region(struct demo_dev *dev, unsigned long virtaddr,
+				unsigned long length, int access, u64 id,
+				struct sg_table **p_sgtbl);
 
-	err = sock_create_kern(&init_net, AF_INET, SOCK_STREAM, 0, create_sock);
+/* Pins and maps the segment after the last mapped one */
+static int stream_map_seg(struct rdma_region *region) {
+	struct region_stream *stream = region->stream;
+	struct stream_seg *seg = &stream->segs[stream->nr_mapped];
+	struct sg_table *sgtbl;
+	ktime_t start;
+	int err = 0;
+
+	err = pin_region(stream->dev, stream->virtaddr + stream->mapped,
+				seg->end - stream->mapped, stream->access, region->id,
+				&sgtbl);
 	if(err) {
-		err_info("socket create error\n");
-		goto err_socket;
+		return err;
 	}
 
-	err = kernel_setsockopt(*create_sock, SOL_SOCKET, SO_REUSEPORT,
-				(char*)&flag, sizeof(int));
-	if(err) {
-		err_info("setsockopt error\n");
-		goto err_socket;
+	start = ktime_get();
+	seg->dma_nents = ib_dma_map_sg(stream->dev->ib_dev, sgtbl->sgl,
+					sgtbl->nents, region->dir);
+	if(seg->dma_nents <= 0) {
+		err = -EFAULT;
+		err_info("Failed to map DMA\n");
+		free_sg_list(sgtbl);
+		return err;
 	}
+	trace_demo_map(region->id, sgtbl->nents, seg->dma_nents, false, start);
+	stats_hist_since(stream->dev->stats, STATS_HIST_MAP, start);
+	stats_add(stream->dev->stats, dma_segs, seg->dma_nents);
 
-	if(is_server) {
-		err = kernel_bind(*sock, (struct sockaddr*)s_addr, sizeof(*s_addr));
-		if(err < 0) {
-			err_info("bind error\n");
-			goto out_sock_release;
-		}
+	seg->sgtbl = sgtbl;
+	stream->nr_mapped++;
+	stream->mapped = seg->end;
+	return err;
+}
 
-		err = kernel_listen(*sock, 10);
-		if(err < 0) {
-			err_info("listen error\n");
-			goto out_sock_release;
-		}
+/* Unmaps and unpins the mapped segments that end at or below `done` */
+static void stream_release(struct rdma_region *region, unsigned long done) {
+	struct region_stream *stream = region->stream;
+
+	while(stream->nr_released < stream->nr_mapped &&
+				stream->segs[stream->nr_released].end <= done) {
+		struct stream_seg *seg = &stream->segs[stream->nr_released++];
+
+		ib_dma_unmap_sg(stream->dev->ib_dev, seg->sgtbl->sgl,
+					seg->sgtbl->nents, region->dir);
+		free_sg_list(seg->sgtbl);
+		seg->sgtbl = NULL;
+	}
+}
+
+static void unmap_region(struct ib_device *ib_dev,
+				struct rdma_region *region) {
+	if(region->stream) {
+		stream_release(region, ULONG_MAX);
+		return;
+	}
+
+	if(region->pool_buf) {
+		pool_buf_sync_for_cpu(region->pool_buf, ib_dev, region->dir);
+		return;
+	}
+
+	ib_dma_unmap_sg(ib_dev, region->sgtbl->sgl,
+				region->sgtbl->nents, region->dir);
+}
 
-		err = kernel_accept(*sock, client_sock, 0);
-		if(err < 0) {
-			err_info("accept error\n");
-			goto out_sock_release;
+/*
+ * With an IOMMU, the DMA layer allocates one IOVA range for the whole
+ * scatterlist and lays the entries out back to back in it, so that
+ * ib_dma_map_sg may return far fewer segments than it was given. A region
+ * that comes out as one IOVA-contiguous range is used as a single DMA
+ * segment. A buffer of the device pool is mapped already, one segment per
+ * chunk, and only synced.
+ */
+static int map_region(struct ib_device *ib_dev, struct rdma_region *region) {
+	struct sg_table *sgtbl = region->sgtbl;
+	int err = 0;
+
+	if(region->pool_buf) {
+		err = pool_buf_sync_for_device(region->pool_buf, ib_dev, region->dir);
+		if(err) {
+			return err;
 		}
+		region->dma_nents = sgtbl->nents;
 	}
 	else {
-		err = kernel_connect(*client_sock, (struct sockaddr*)s_addr,
-						sizeof(*s_addr), 0);
-		if(err) {
-			err_info("kernel_connect error\n");
-			goto out_sock_release;
+		region->dma_nents = ib_dma_map_sg(ib_dev, sgtbl->sgl,
+						sgtbl->nents, region->dir);
+		if(region->dma_nents <= 0) {
+			err = -EFAULT;
+			err_info("Failed to map DMA\n");
+			return err;
 		}
 	}
 
+	region->dma_addr = get_dma_address_from_sgtbl(sgtbl);
+	region->contig = dma_segments_contiguous(region);
+	dbg_info("%u sg entries mapped to %d DMA segments, contiguous: %d\n",
+				sgtbl->nents, region->dma_nents, region->contig);
+	return err;
+}
+
+/*
+ * Maps the DMA segments of the region into a pooled fast-registration MR,
+ * which turns a fragmented buffer into one virtually contiguous range.
+ * The MR becomes valid once the IB_WR_REG_MR posted by reg_region_frmr
+ * has completed.
+ */
+static int map_region_frmr(struct ib_qp *qp, struct rdma_region *region) {
+	struct ib_mr *mr;
+	int n;
+
+	mr = ib_mr_pool_get(qp, &qp->rdma_mrs);
+	if(!mr)
+		return -EAGAIN;
+
+	n = ib_map_mr_sg(mr, region->sgtbl->sgl, region->dma_nents,
+				NULL, PAGE_SIZE);
+	if(n != region->dma_nents) {
+		ib_mr_pool_put(qp, &qp->rdma_mrs, mr);
+		return (n < 0)? n: -E2BIG;
+	}
+
+	ib_update_fast_reg_key(mr, ib_inc_rkey(mr->rkey));
+	region->mr = mr;
+	region->lkey = mr->lkey;
+	region->dma_addr = mr->iova;
+	region->contig = true;
 	return 0;
+}
+
+static int reg_frmr(struct ib_qp *qp, struct ib_mr *mr, int access_flags) {
+	struct ib_reg_wr reg_wr = {};
+	const struct ib_send_wr *bad_wr;
+	struct cq_waiter waiter;
+	int err;
 
-out_sock_release:
-	sock_release(*create_sock);
+	cq_waiter_init(&waiter, 1);
+	reg_wr.wr.wr_cqe = &waiter.cqe;
+	reg_wr.wr.opcode = IB_WR_REG_MR;
+	reg_wr.wr.send_flags = IB_SEND_SIGNALED;
+	reg_wr.mr = mr;
+	reg_wr.key = mr->rkey;
+	reg_wr.access = access_flags;
+	err = ib_post_send(qp, &reg_wr.wr, &bad_wr);
+	if(err) {
+		err_info("Failed to post REG_MR\n");
+		return err;
+	}
+
+	return cq_waiter_wait(&waiter, qp);
+}
+
+static void inv_frmr(struct ib_qp *qp, struct ib_mr *mr) {
+	struct ib_send_wr inv_wr = {};
+	const struct ib_send_wr *bad_wr;
+	struct cq_waiter waiter;
+
+	cq_waiter_init(&waiter, 1);
+	inv_wr.wr_cqe = &waiter.cqe;
+	inv_wr.opcode = IB_WR_LOCAL_INV;
+	inv_wr.send_flags = IB_SEND_SIGNALED;
+	inv_wr.ex.invalidate_rkey = mr->rkey;
+	if(ib_post_send(qp, &inv_wr, &bad_wr) ||
+				cq_waiter_wait(&waiter, qp))
+		err_info("Failed to invalidate MR\n");
+}
+
+static int reg_region_frmr(struct ib_qp *qp,
+				struct rdma_region *region, int access_flags) {
+	return reg_frmr(qp, region->mr, access_flags);
+}
+
+static void unreg_region_frmr(struct ib_qp *qp,
+				struct rdma_region *region, bool registered) {
+	if(!region->mr)
+		return;
+
+	if(registered)
+		inv_frmr(qp, region->mr);
+
+	ib_mr_pool_put(qp, &qp->rdma_mrs, region->mr);
+	region->mr = NULL;
+	region->dma_addr = get_dma_address_from_sgtbl(region->sgtbl);
+	region->contig = dma_segments_contiguous(region);
+}
+
+/* The bytes one pooled MR covers wherever they start in a page */
+static u64 frmr_window_size(const struct rdma_conn *conn) {
+	return (u64)(conn->frmr_pages - 1) << PAGE_SHIFT;
+}
+
+/*
+ * Maps the bytes of the region from `start` on into a pooled MR, as many
+ * as it covers, and registers it for remote access. ib_map_mr_sg maps a
+ * prefix of the DMA segments it is given when they do not all fit, and
+ * the MR length is what it mapped.
+ */
+static int map_window(struct ib_qp *qp, struct rdma_region *region,
+				unsigned long start, int access_flags, struct ib_mr **p_mr) {
+	struct scatterlist *sg;
+	unsigned long pos = 0;
+	unsigned int sg_offset;
+	struct ib_mr *mr;
+	int i, n;
+	int err = 0;
+
+	for_each_sg(region->sgtbl->sgl, sg, region->dma_nents, i) {
+		if(start < pos + sg_dma_len(sg))
+			break;
+		pos += sg_dma_len(sg);
+	}
+	if(i == region->dma_nents)
+		return -EINVAL;
+
+	mr = ib_mr_pool_get(qp, &qp->rdma_mrs);
+	if(!mr)
+		return -EAGAIN;
+
+	sg_offset = start - pos;
+	n = ib_map_mr_sg(mr, sg, region->dma_nents - i, &sg_offset, PAGE_SIZE);
+	if(n < 0) {
+		err = n;
+		goto err_map;
+	}
+
+	ib_update_fast_reg_key(mr, ib_inc_rkey(mr->rkey));
+	err = reg_frmr(qp, mr, access_flags);
+	if(err) {
+		goto err_map;
+	}
+
+	*p_mr = mr;
 	return err;
-err_socket:
-	kfree(*sock);
-	kfree(*client_sock);
-err_kzalloc:
+
+err_map:
+	ib_mr_pool_put(qp, &qp->rdma_mrs, mr);
 	return err;
 }
 
-static int exchange_info(bool is_server, struct rdma_conn_param *local,
-			struct rdma_conn_param *remote,
-			struct socket *sock, struct socket *client_sock) {
-	struct kvec vec;
-	struct msghdr msg;
-	int err = 0, i;
+static void unmap_window(struct ib_qp *qp, struct ib_mr *mr) {
+	inv_frmr(qp, mr);
+	ib_mr_pool_put(qp, &qp->rdma_mrs, mr);
+}
+
+/*
+ * The target of a one-sided operation exposes its buffer through MRs of
+ * the pool, whose page limit caps the bytes of one. The first window
+ * starts at byte 0 and holds as much as an MR covers; when that is not
+ * the whole transfer, the initiator cuts it into windows of win_size
+ * bytes, a multiple of its chunk size no larger than the target offered.
+ * Each window is announced by an exchange, once the initiator is done
+ * with the previous one, and the next one is registered while the
+ * initiator works on it, so two MRs at most are registered at a time.
+ */
+static int expose_windows(struct rdma_conn *conn, struct rdma_region *region,
+				unsigned long length, int access_flags) {
+	struct ib_qp *qp = conn->lanes[0].qp;
+	struct rdma_xfer_info local, remote;
+	struct ib_mr *mr, *prev;
+	unsigned long start = 0;
+	u64 win_size;
+	int err = 0;
+
+	err = map_window(qp, region, start, access_flags, &mr);
+	if(err) {
+		err_info("Cannot register target buffer, err: %d\n", err);
+		return err;
+	}
 
-	for(i = 0; i < 2; i++) {
-		memset(&vec, 0, sizeof(vec));
-		memset(&msg, 0, sizeof(msg));
-		if((i % 2) ^ is_server) {
-			vec.iov_base = remote;
-			vec.iov_len = sizeof(*remote);
-			err = kernel_recvmsg(client_sock, &msg, &vec, 1, sizeof(*remote), 0);
+	memset(&local, 0, sizeof(local));
+	local.addr = mr->iova;
+	local.rkey = mr->rkey;
+	local.length = mr->length;
+	err = rdma_conn_exchange(conn, &local, &remote, sizeof(local));
+	if(err) {
+		goto out;
+	}
+
+	/* A first window that covers the transfer is the only one */
+	win_size = remote.win_size;
+	if(length <= mr->length) {
+		win_size = length;
+	}
+	else if(!win_size || win_size > frmr_window_size(conn)) {
+		err = -EPROTO;
+		err_info("Invalid window size %llu\n", win_size);
+		goto out;
+	}
+
+	for(start = win_size; start < length; start += win_size) {
+		prev = mr;
+		err = map_window(qp, region, start, access_flags, &mr);
+		if(!err && mr->length < min_t(u64, win_size, length - start)) {
+			unmap_window(qp, mr);
+			err = -E2BIG;
 		}
-		else {
-			vec.iov_base = local;
-			vec.iov_len = sizeof(*local);
-			err = kernel_sendmsg(client_sock, &msg, &vec, 1, sizeof(*local));
+		if(err) {
+			err_info("Cannot register target window at %lu, err: %d\n",
+						start, err);
+			mr = prev;
+			goto out;
 		}
 
-		if(err < sizeof(*local)) {
-			err_info("msg error\n");
-			err = -EPIPE;
-			goto err_msg;
-		}
-		else {
-			err = 0;
+		local.addr = mr->iova;
+		local.rkey = mr->rkey;
+		local.length = mr->length;
+		err = rdma_conn_exchange(conn, &local, &remote, sizeof(local));
+		unmap_window(qp, prev);
+		if(err) {
+			goto out;
 		}
 	}
 
-err_msg:
+	/* The last window must not be invalidated before the initiator is done */
+	err = rdma_conn_sync(conn);
+
+out:
+	unmap_window(qp, mr);
 	return err;
 }
 
-static void close_connection(bool is_server,
-			struct socket *sock, struct socket *client_sock) {
-	sock_release(client_sock);
-	if(is_server)
-		sock_release(sock);
-//	kfree(client_sock);
-//	kfree(sock);
+/*
+ * The transfer is cut into chunks of the same size on both sides, so that
+ * every SEND lands in exactly one RECV. A chunk of a non-contiguous region
+ * may start in the middle of a DMA segment and touches at most
+ * chunk / PAGE_SIZE + 2 segments, which bounds it by the SGE limit.
+ */
+static u32 region_chunk_size(const struct rdma_region *region, int max_sge) {
+	unsigned long limit = clamp_t(unsigned long, chunk_size_limit,
+					PAGE_SIZE, MAX_CHUNK_SIZE);
+
+	if(region->contig)
+		return limit;
+	return min_t(unsigned long, limit, max(max_sge - 2, 1) << PAGE_SHIFT);
 }
 
-static void add_device_to_list(struct ib_device *ibdev) {
-	struct ib_dev_ent *dev_ent = NULL;
-	dev_ent = kzalloc(sizeof(*dev_ent), GFP_KERNEL);
-	if(!dev_ent) {
-		err_info("Failed to alloc new entry for ib_device\n");
+/* The first segment of a streamed region is looked up when it is needed */
+static void init_region_cursor(const struct rdma_region *region,
+				struct region_cursor *cur) {
+	cur->sg = region->stream? NULL: region->sgtbl->sgl;
+	cur->off = 0;
+	cur->seg = 0;
+	cur->left = 0;
+}
+
+/*
+ * Steps to the next DMA segment. Once the DMA segments of a segment of a
+ * streamed region are used up, the cursor moves on to the next segment,
+ * which may not be mapped yet; fill_sges looks it up when it needs it.
+ */
+static void next_dma_seg(const struct rdma_region *region,
+				struct region_cursor *cur) {
+	cur->off = 0;
+	if(region->stream && !--cur->left) {
+		cur->seg++;
+		cur->sg = NULL;
 		return;
 	}
+	cur->sg = sg_next(cur->sg);
+}
 
-	dev_ent->device = ibdev;
-	write_lock(&rwlock);
-	list_add_tail(&dev_ent->ent, &ib_dev_list);
-	ib_set_client_data(ibdev, &init_ibdev_client, dev_ent);
-	write_unlock(&rwlock);
+/*
+ * Inline data is copied by the CPU when the WR is posted, so its SGEs
+ * carry kernel virtual addresses. The cursor then walks the CPU view of
+ * the sg list rather than the DMA segments.
+ */
+static int fill_inline_sges(const struct rdma_region *region,
+				struct region_cursor *cur, unsigned long len,
+				struct ib_sge *sges, int max_sge) {
+	int n = 0;
+
+	while(len) {
+		unsigned long take = min_t(unsigned long, len,
+						cur->sg->length - cur->off);
+		if(n == max_sge) {
+			err_info("chunk needs more than %d SGEs\n", max_sge);
+			return -EINVAL;
+		}
+
+		sges[n].addr = (uintptr_t)sg_virt(cur->sg) + cur->off;
+		sges[n].length = take;
+		sges[n].lkey = 0;
+		n++;
+
+		len -= take;
+		cur->off += take;
+		if(cur->off == cur->sg->length) {
+			cur->sg = sg_next(cur->sg);
+			cur->off = 0;
+		}
+	}
+
+	return n;
 }
 
-static void rm_device_from_list(struct ib_device *ibdev, void *data) {
-	struct ib_dev_ent *dev_ent = (struct ib_dev_ent*)data;
-	write_lock(&rwlock);
-	list_del(&dev_ent->ent);
-	write_unlock(&rwlock);
-	kfree(dev_ent);
+static int fill_sges(const struct rdma_region *region,
+				struct region_cursor *cur, unsigned long len,
+				struct ib_sge *sges, int max_sge) {
+	int n = 0;
+
+	if(region->contig) {
+		sges[0].addr = region->dma_addr + cur->off;
+		sges[0].length = len;
+		sges[0].lkey = region->lkey;
+		cur->off += len;
+		return 1;
+	}
+
+	while(len) {
+		unsigned long take;
+
+		if(!cur->sg) {
+			const struct stream_seg *seg = &region->stream->segs[cur->seg];
+
+			cur->sg = seg->sgtbl->sgl;
+			cur->left = seg->dma_nents;
+		}
+
+		take = min_t(unsigned long, len, sg_dma_len(cur->sg) - cur->off);
+		if(n == max_sge) {
+			err_info("chunk needs more than %d SGEs\n", max_sge);
+			return -EINVAL;
+		}
+
+		sges[n].addr = sg_dma_address(cur->sg) + cur->off;
+		sges[n].length = take;
+		sges[n].lkey = region->lkey;
+		n++;
+
+		len -= take;
+		cur->off += take;
+		if(cur->off == sg_dma_len(cur->sg))
+			next_dma_seg(region, cur);
+	}
+
+	return n;
 }
 
-static struct ib_client init_ibdev_client = {
-	.name				= "init_ibdev_list",
-	.add				= add_device_to_list,
-	.remove				= rm_device_from_list,
+/*
+ * Whether the local buffer is read or written by the device for the given
+ * operation and role, checked against the direction it was mapped with.
+ */
+static bool xfer_dir_ok(int op, bool is_server, enum dma_data_direction dir) {
+	bool dev_reads = (is_server == (op == XFER_OP_READ));
+
+	return dev_reads? (dir != DMA_FROM_DEVICE): (dir != DMA_TO_DEVICE);
+}
+
+static int target_access_flags(int op) {
+	return (op == XFER_OP_WRITE)?
+			(IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_WRITE):
+			IB_ACCESS_REMOTE_READ;
+}
+
+static enum ib_wr_opcode xfer_op_to_wr_opcode(int op) {
+	switch(op) {
+	case XFER_OP_WRITE:
+		return IB_WR_RDMA_WRITE;
+	case XFER_OP_READ:
+		return IB_WR_RDMA_READ;
+	default:
+		return IB_WR_SEND;
+	}
+}
+
+static unsigned int xfer_window_size(void) {
+	return clamp_t(unsigned int, xfer_window, 1, QP_MAX_WR);
+}
+
+static void xfer_error(struct xfer_ctx *ctx, struct ib_wc *wc) {
+	if(wc->status != IB_WC_WR_FLUSH_ERR)
+		err_info("wc not success, status: %s\n",
+				ib_wc_status_msg(wc->status));
+	cmpxchg(&ctx->status, 0, -EIO);
+}
+
+/* Wakes the poster before dropping the reference that keeps ctx alive */
+static void xfer_put(struct xfer_ctx *ctx) {
+	wake_up(&ctx->wq);
+	if(atomic_dec_and_test(&ctx->inflight))
+		complete(&ctx->done);
+}
+
+static void xfer_data_done(struct ib_cq *cq, struct ib_wc *wc) {
+	struct xfer_lane *lane = container_of(wc->wr_cqe,
+					struct xfer_lane, data_cqe);
+	struct xfer_ctx *ctx = lane->ctx;
+
+	trace_demo_complete(ctx->region->id, lane - ctx->lanes, 1,
+				wc->status, 0);
+	if(wc->status != IB_WC_SUCCESS)
+		xfer_error(ctx, wc);
+	else
+		atomic_inc(&lane->data_done);
+
+	xfer_put(ctx);
+}
+
+static void xfer_signal_done(struct ib_cq *cq, struct ib_wc *wc) {
+	struct xfer_signal *sig = container_of(wc->wr_cqe,
+					struct xfer_signal, cqe);
+	struct xfer_ctx *ctx = sig->lane->ctx;
+	u64 ns;
+
+	trace_demo_complete(ctx->region->id, sig->lane - ctx->lanes, sig->nr,
+				wc->status, sig->posted);
+	if(wc->status != IB_WC_SUCCESS) {
+		xfer_error(ctx, wc);
+	}
+	else {
+		atomic_add(sig->nr, &sig->lane->data_done);
+		ns = ktime_to_ns(ktime_sub(ktime_get(), sig->posted));
+		stats_hist(ctx->dev_stats, STATS_HIST_POST, ns);
+		stats_hist(ctx->conn_stats, STATS_HIST_POST, ns);
+	}
+
+	xfer_put(ctx);
+}
+
+/*
+ * An unsignaled WR only completes when it fails. The last WR of every
+ * chain is signaled and completes after it, so the transfer notices the
+ * failure there; this cqe is not tied to a transfer, since a WR left
+ * unsignaled by a failed post may still be flushed after it is gone.
+ */
+static void xfer_unsignaled_done(struct ib_cq *cq, struct ib_wc *wc) {
+	if(wc->status != IB_WC_SUCCESS && wc->status != IB_WC_WR_FLUSH_ERR)
+		err_info("wc not success, status: %s\n",
+				ib_wc_status_msg(wc->status));
+}
+
+static struct ib_cqe unsignaled_cqe = {
+	.done		= xfer_unsignaled_done,
 };
 
-static struct ib_device *get_ib_dev_from_name(const char *devname) {
-	struct ib_device *ibdev = NULL;
-	struct ib_dev_ent *ibdev_ent;
+/*
+ * Posts a receive for a credit message, unless receives for all the
+ * credit messages due on the lane have been posted already.
+ */
+static int post_credit_recv(struct xfer_lane *lane) {
+	struct ib_recv_wr wr = {};
+	const struct ib_recv_wr *bad_wr;
+	int err;
 
-	read_lock(&rwlock);
-	list_for_each_entry(ibdev_ent, &ib_dev_list, ent) {
-		if(!strcmp(ibdev_ent->device->name, devname)) {
-			ibdev = ibdev_ent->device;
-			goto out;
+	if(!atomic_add_unless(&lane->credit_recvs, 1, lane->nr_credit_msgs))
+		return 0;
+
+	wr.wr_cqe = &lane->credit_cqe;
+	atomic_inc(&lane->ctx->inflight);
+	err = ib_post_recv(lane->qp, &wr, &bad_wr);
+	if(err)
+		atomic_dec(&lane->ctx->inflight);
+	return err;
+}
+
+/*
+ * On the sender, a credit message hands over the receives the peer has
+ * posted, and its receive is replaced as long as more credit messages
+ * are due. On the receiver, it is the completion of the credit send.
+ */
+static void xfer_credit_done(struct ib_cq *cq, struct ib_wc *wc) {
+	struct xfer_lane *lane = container_of(wc->wr_cqe,
+					struct xfer_lane, credit_cqe);
+	struct xfer_ctx *ctx = lane->ctx;
+
+	if(wc->status != IB_WC_SUCCESS) {
+		xfer_error(ctx, wc);
+	}
+	else if(wc->opcode == IB_WC_RECV) {
+		if(wc->wc_flags & IB_WC_WITH_IMM)
+			atomic_add(be32_to_cpu(wc->ex.imm_data), &lane->credits);
+		if(!READ_ONCE(ctx->status) && post_credit_recv(lane))
+			cmpxchg(&ctx->status, 0, -EIO);
+	}
+
+	xfer_put(ctx);
+}
+
+static int post_credit_msg(struct xfer_lane *lane, u32 nr_credits) {
+	struct ib_send_wr wr = {};
+	const struct ib_send_wr *bad_wr;
+	int err;
+
+	wr.wr_cqe = &lane->credit_cqe;
+	wr.opcode = IB_WR_SEND_WITH_IMM;
+	wr.send_flags = IB_SEND_SIGNALED;
+	wr.ex.imm_data = cpu_to_be32(nr_credits);
+	atomic_inc(&lane->ctx->inflight);
+	err = ib_post_send(lane->qp, &wr, &bad_wr);
+	if(err) {
+		atomic_dec(&lane->ctx->inflight);
+		cmpxchg(&lane->ctx->status, 0, err);
+	}
+	return err;
+}
+
+static struct xfer_ctx *alloc_xfer_ctx(struct rdma_conn *conn,
+				unsigned long nchunks, int max_sge, bool is_recv) {
+	struct xfer_ctx *ctx;
+	int nr_wrs = conn->nr_lanes * QP_MAX_WR;
+	int i, j;
+
+	ctx = kvzalloc(sizeof(*ctx), GFP_KERNEL);
+	if(!ctx)
+		return NULL;
+
+	ctx->sges = kvcalloc(nr_wrs * max_sge, sizeof(*ctx->sges), GFP_KERNEL);
+	if(is_recv)
+		ctx->recv_wrs = kvcalloc(nr_wrs, sizeof(*ctx->recv_wrs), GFP_KERNEL);
+	else
+		ctx->send_wrs = kvcalloc(nr_wrs, sizeof(*ctx->send_wrs), GFP_KERNEL);
+	if(!ctx->sges || !(ctx->recv_wrs || ctx->send_wrs)) {
+		kvfree(ctx->sges);
+		kvfree(ctx);
+		return NULL;
+	}
+
+	ctx->nr_lanes = conn->nr_lanes;
+	ctx->nchunks = nchunks;
+	ctx->max_sge = max_sge;
+	ctx->is_recv = is_recv;
+	atomic_set(&ctx->inflight, 1);
+	init_waitqueue_head(&ctx->wq);
+	init_completion(&ctx->done);
+
+	for(i = 0; i < ctx->nr_lanes; i++) {
+		struct xfer_lane *lane = &ctx->lanes[i];
+
+		lane->ctx = ctx;
+		lane->qp = conn->lanes[i].qp;
+		lane->data_cqe.done = xfer_data_done;
+		lane->credit_cqe.done = xfer_credit_done;
+		for(j = 0; j < QP_MAX_WR; j++) {
+			lane->sigs[j].cqe.done = xfer_signal_done;
+			lane->sigs[j].lane = lane;
 		}
+		lane->nchunks = (nchunks > i)?
+				DIV_ROUND_UP(nchunks - i, ctx->nr_lanes): 0;
 	}
 
-out:
-	read_unlock(&rwlock);
-	return ibdev;
+	return ctx;
+}
+
+static void free_xfer_ctx(struct xfer_ctx *ctx) {
+	kvfree(ctx->recv_wrs);
+	kvfree(ctx->send_wrs);
+	kvfree(ctx->sges);
+	kvfree(ctx);
+}
+
+/*
+ * Waits until every WR of the transfer has left the QPs. After an error
+ * or a fatal signal, the QPs are moved to the error state first, so that
+ * the outstanding WRs are flushed.
+ */
+static int drain_xfer(struct xfer_ctx *ctx) {
+	struct ib_qp_attr qp_attr = {
+		.qp_state		= IB_QPS_ERR,
+	};
+	int i;
+
+	if(atomic_dec_and_test(&ctx->inflight))
+		return ctx->status;
+
+	if(!READ_ONCE(ctx->status) &&
+			!wait_for_completion_killable(&ctx->done))
+		return ctx->status;
+
+	cmpxchg(&ctx->status, 0, -EINTR);
+	for(i = 0; i < ctx->nr_lanes; i++)
+		ib_modify_qp(ctx->lanes[i].qp, &qp_attr, IB_QP_STATE);
+	wait_for_completion(&ctx->done);
+	return ctx->status;
 }
 
-int init_ib_dev_list(void) {
+/*
+ * Completions are in order on each QP but not across them. The chunks
+ * completed in order are those below the first chunk still outstanding
+ * on any lane.
+ */
+static unsigned long xfer_chunks_done(struct xfer_ctx *ctx) {
+	unsigned long done = ctx->nchunks;
+	int i;
+
+	for(i = 0; i < ctx->nr_lanes; i++) {
+		unsigned long next = (unsigned long)
+				atomic_read(&ctx->lanes[i].data_done) * ctx->nr_lanes + i;
+		done = min(done, next);
+	}
+
+	return done;
+}
+
+/* The chunks whose bytes are all mapped */
+static unsigned long stream_chunks_ready(struct xfer_ctx *ctx) {
+	const struct region_stream *stream = ctx->region->stream;
+
+	if(!stream || stream->mapped >= ctx->length)
+		return ctx->nchunks;
+	return stream->mapped / ctx->chunk_size;
+}
+
+/*
+ * Called by the poster of a streamed region between two rounds, once the
+ * chunks below `posted` are with the device. Maps segments until the
+ * chunks below `need` are ready and a segment's worth of bytes is mapped
+ * ahead of those posted, then releases the segments whose chunks have all
+ * completed.
+ */
+static int stream_advance(struct xfer_ctx *ctx, unsigned long posted,
+				unsigned long need) {
+	struct rdma_region *region = ctx->region;
+	struct region_stream *stream = region->stream;
+	unsigned long queued = min(posted * ctx->chunk_size, ctx->length);
 	int err = 0;
-	INIT_LIST_HEAD(&ib_dev_list);
-	rwlock_init(&rwlock);
 
-	err = ib_register_client(&init_ibdev_client);
-	if(err) {
-		err_info("Failed to register ib_client\n");
+	if(!stream)
 		return err;
+
+	while(stream->mapped < ctx->length &&
+				(stream_chunks_ready(ctx) < need ||
+				stream->mapped - queued < stream->seg_size)) {
+		err = stream_map_seg(region);
+		if(err) {
+			cmpxchg(&ctx->status, 0, err);
+			return err;
+		}
 	}
 
+	stream_release(region,
+				min(xfer_chunks_done(ctx) * ctx->chunk_size, ctx->length));
 	return err;
 }
 
-void destroy_ib_dev_list(void) {
-	ib_unregister_client(&init_ibdev_client);
+/* WRs the lane can still take, counting those queued in its batch */
+static int lane_room(struct xfer_lane *lane) {
+	return xfer_window_size() - (lane->posted + lane->batch -
+				atomic_read(&lane->data_done));
+}
+
+static bool lane_ready(struct xfer_lane *lane, int needed, bool need_credits) {
+	return lane_room(lane) >= needed &&
+		(!need_credits || atomic_read(&lane->credits) - lane->batch > 0);
 }
 
-int kern_rdma_core(bool is_server, const char *dev_name,
-				const struct sockaddr_in *s_addr, 
-				int rdma_port, int sgid_index,
-				unsigned long virtaddr, unsigned long length) {
+/* Fills in the WR of chunk k at the end of its lane's batch */
+static int queue_chunk(struct xfer_ctx *ctx, unsigned long k) {
+	int lane_idx = k % ctx->nr_lanes;
+	struct xfer_lane *lane = &ctx->lanes[lane_idx];
+	int slot = lane_idx * QP_MAX_WR + lane->batch;
+	struct ib_sge *sg_list = ctx->sges + slot * ctx->max_sge;
+	unsigned long off = k * ctx->chunk_size;
+	unsigned long len = min_t(unsigned long, ctx->chunk_size,
+					ctx->length - off);
+	int n;
+
+	if(ctx->inline_data)
+		n = fill_inline_sges(ctx->region, &ctx->cur, len,
+					sg_list, ctx->max_sge);
+	else
+		n = fill_sges(ctx->region, &ctx->cur, len, sg_list, ctx->max_sge);
+	if(n < 0)
+		return n;
+
+	if(ctx->is_recv) {
+		struct ib_recv_wr *wr = &ctx->recv_wrs[slot];
+
+		memset(wr, 0, sizeof(*wr));
+		wr->wr_cqe = &lane->data_cqe;
+		wr->sg_list = sg_list;
+		wr->num_sge = n;
+		if(lane->batch)
+			ctx->recv_wrs[slot-1].next = wr;
+	}
+	else {
+		struct ib_rdma_wr *rdma_wr = &ctx->send_wrs[slot];
+
+		memset(rdma_wr, 0, sizeof(*rdma_wr));
+		rdma_wr->wr.sg_list = sg_list;
+		rdma_wr->wr.num_sge = n;
+		rdma_wr->wr.opcode = ctx->opcode;
+		if(ctx->inline_data)
+			rdma_wr->wr.send_flags = IB_SEND_INLINE;
+		if(ctx->opcode != IB_WR_SEND) {
+			rdma_wr->remote_addr = ctx->window.addr + off - ctx->win_start;
+			rdma_wr->rkey = ctx->window.rkey;
+		}
+		if(lane->batch)
+			ctx->send_wrs[slot-1].wr.next = &rdma_wr->wr;
+	}
+
+	lane->batch++;
+	return 0;
+}
+
+/*
+ * Signals every signal_interval-th send WR of the batch and its last one,
+ * and returns the number of signaled WRs. Each signaled WR covers at least
+ * one WR of the window, which is no deeper than QP_MAX_WR, so a signal
+ * slot has completed by the time it is reused.
+ */
+static int signal_send_batch(struct xfer_lane *lane, struct ib_rdma_wr *wrs,
+				int nr) {
+	unsigned int interval = max(signal_interval, 1U);
+	ktime_t now = ktime_get();
+	int nr_signaled = 0;
+	int i;
+
+	for(i = 0; i < nr; i++) {
+		struct ib_send_wr *wr = &wrs[i].wr;
+		struct xfer_signal *sig;
+
+		lane->unsignaled++;
+		if(lane->unsignaled < interval && i < nr - 1) {
+			wr->wr_cqe = &unsignaled_cqe;
+			continue;
+		}
+
+		sig = &lane->sigs[lane->nr_sigs++ % QP_MAX_WR];
+		sig->nr = lane->unsignaled;
+		sig->posted = now;
+		lane->unsignaled = 0;
+		wr->wr_cqe = &sig->cqe;
+		wr->send_flags |= IB_SEND_SIGNALED;
+		nr_signaled++;
+	}
+
+	return nr_signaled;
+}
+
+static int count_signaled(const struct ib_send_wr *wr) {
+	int n = 0;
+
+	for(; wr; wr = wr->next) {
+		if(wr->send_flags & IB_SEND_SIGNALED)
+			n++;
+	}
+	return n;
+}
+
+/* Only computed for the trace event */
+static unsigned long batch_bytes(struct xfer_ctx *ctx, int first, int nr) {
+	unsigned long bytes = 0;
+	int i, j;
+
+	for(i = first; i < first + nr; i++) {
+		const struct ib_sge *sges = ctx->is_recv? ctx->recv_wrs[i].sg_list:
+					ctx->send_wrs[i].wr.sg_list;
+		int num_sge = ctx->is_recv? ctx->recv_wrs[i].num_sge:
+					ctx->send_wrs[i].wr.num_sge;
+
+		for(j = 0; j < num_sge; j++)
+			bytes += sges[j].length;
+	}
+	return bytes;
+}
+
+/*
+ * Posts the batch of the lane as one chain. Returns the number of WRs
+ * that reached the QP.
+ */
+static int post_lane_batch(struct xfer_ctx *ctx, int lane_idx) {
+	struct xfer_lane *lane = &ctx->lanes[lane_idx];
+	int first = lane_idx * QP_MAX_WR;
+	int nr = lane->batch;
+	int nr_posted = nr;
+	int nr_completing, nr_lost = 0;
 	int err = 0;
-	struct ib_device *ib_dev;
-	struct ib_pd *pd;
-	struct ib_mr *mr;
-	struct ib_cq *cq;
-	struct ib_qp *qp;
-	struct ib_cq_init_attr cq_init_attr = {};
-	struct ib_qp_init_attr qp_init_attr;
-	struct ib_qp_attr qp_attr;
-	struct ib_port_attr port_attr;
-	struct ib_ah *ah;
-	union ib_gid local_gid;
-	struct rdma_conn_param local_info, remote_info;
-	struct ib_sge sge_list;
-	struct ib_recv_wr recv_wr, *bad_recv_wr;
-	struct ib_send_wr send_wr, *bad_send_wr;
-	struct socket *sock, *client_sock;
-	struct sg_table *sgtbl;
-	u64 dma_addr;
-	int attr_flag;
 
-	ib_dev = get_ib_dev_from_name(dev_name);
-	if(!ib_dev) {
-		return -ENODEV;
+	if(!nr)
+		return 0;
+
+	lane->batch = 0;
+	if(ctx->is_recv) {
+		const struct ib_recv_wr *bad_wr;
+
+		nr_completing = nr;
+		atomic_add(nr_completing, &ctx->inflight);
+		err = ib_post_recv(lane->qp, &ctx->recv_wrs[first], &bad_wr);
+		if(err) {
+			nr_posted = bad_wr - &ctx->recv_wrs[first];
+			nr_lost = nr - nr_posted;
+		}
 	}
+	else {
+		const struct ib_send_wr *bad_wr;
 
-	pd = ib_alloc_pd(ib_dev, 0);
-	if(IS_ERR(pd)) {
-		err = (int)PTR_ERR(pd);
-		goto err_alloc_pd;
+		nr_completing = signal_send_batch(lane, &ctx->send_wrs[first], nr);
+		atomic_add(nr_completing, &ctx->inflight);
+		err = ib_post_send(lane->qp, &ctx->send_wrs[first].wr, &bad_wr);
+		if(err) {
+			nr_posted = container_of(bad_wr, struct ib_rdma_wr, wr) -
+						&ctx->send_wrs[first];
+			nr_lost = count_signaled(bad_wr);
+		}
 	}
 
-	err = get_sg_list(virtaddr, length,
-			dma_get_max_seg_size(ib_dev->dma_device), &sgtbl);
 	if(err) {
-		err_info("Failed to get sg list\n");
-		goto err_sg_list;
+		err_info("Failed to post work requests\n");
+		atomic_sub(nr_lost, &ctx->inflight);
+		cmpxchg(&ctx->status, 0, err);
 	}
 
-	mr = ib_get_dma_mr(pd, IB_ACCESS_LOCAL_WRITE);
-	if(IS_ERR(mr)) {
-		err = (int)PTR_ERR(mr);
-		goto err_get_dma_mr;
+	lane->posted += nr_posted;
+	if(trace_demo_post_enabled())
+		trace_demo_post(ctx->region->id, lane_idx, ctx->is_recv, nr,
+					nr_posted, batch_bytes(ctx, first, nr_posted));
+	stats_add(ctx->dev_stats, wrs_posted, nr_posted);
+	stats_add(ctx->conn_stats, wrs_posted, nr_posted);
+	return nr_posted;
+}
+
+static void terminate_batches(struct xfer_ctx *ctx) {
+	int i;
+
+	for(i = 0; i < ctx->nr_lanes; i++) {
+		int last = i * QP_MAX_WR + ctx->lanes[i].batch - 1;
+
+		if(!ctx->lanes[i].batch)
+			continue;
+		if(ctx->is_recv)
+			ctx->recv_wrs[last].next = NULL;
+		else
+			ctx->send_wrs[last].wr.next = NULL;
 	}
+}
 
-	err = ib_dma_map_sg(ib_dev, sgtbl->sgl,
-					sgtbl->nents, DMA_BIDIRECTIONAL);
-	if(err <= 0) {
-		err_info("Failed to map DMA\n");
-		err = -EFAULT;
-		goto err_dma_map_single;
+static int wait_lane_ready(struct xfer_ctx *ctx, struct xfer_lane *lane,
+				int needed, bool need_credits) {
+	if(wait_event_killable(ctx->wq, READ_ONCE(ctx->status) ||
+				lane_ready(lane, needed, need_credits)))
+		cmpxchg(&ctx->status, 0, -EINTR);
+	return READ_ONCE(ctx->status);
+}
+
+/*
+ * Moves the initiator of a one-sided operation on to the window of the
+ * target that starts with chunk `posted`, once the chunks before it have
+ * completed: the exchange lets the target retire the previous window and
+ * brings the address, rkey and length of this one. The first exchange
+ * also tells the target the window size.
+ */
+static void next_window(struct xfer_ctx *ctx, unsigned long posted) {
+	struct rdma_xfer_info local;
+	unsigned long start = posted * ctx->chunk_size;
+	int err;
+
+	if(wait_event_killable(ctx->wq, READ_ONCE(ctx->status) ||
+				xfer_chunks_done(ctx) >= posted))
+		cmpxchg(&ctx->status, 0, -EINTR);
+	if(READ_ONCE(ctx->status))
+		return;
+
+	memset(&local, 0, sizeof(local));
+	local.win_size = ctx->win_size;
+	err = rdma_conn_exchange(ctx->conn, &local, &ctx->window, sizeof(local));
+	if(err) {
+		cmpxchg(&ctx->status, 0, err);
+		return;
+	}
+
+	ctx->win_start = start;
+	if(!posted && ctx->window.length >= ctx->length) {
+		ctx->win_end = ctx->nchunks;
+		return;
+	}
+
+	ctx->win_end = min(ctx->nchunks, posted + ctx->win_size / ctx->chunk_size);
+	if(ctx->window.length < min(ctx->win_size, ctx->length - start)) {
+		err_info("Target window at %lu is too short\n", start);
+		cmpxchg(&ctx->status, 0, -EPROTO);
+	}
+}
+
+/*
+ * The sender and the initiator of a one-sided operation queue chunks in
+ * order for as long as their lanes have room (and, for SEND, credits),
+ * then post one chain per lane. A streamed region is mapped further
+ * after each round, while the device works on it, and a one-sided
+ * operation moves on to the next window of the target once the current
+ * one is used up.
+ */
+static void post_initiator_chunks(struct xfer_ctx *ctx, bool need_credits) {
+	unsigned long posted = 0;
+	unsigned long ready;
+	int err;
+	int i;
+
+	while(posted < ctx->nchunks && !READ_ONCE(ctx->status)) {
+		unsigned long k = posted;
+		struct xfer_lane *lane = &ctx->lanes[k % ctx->nr_lanes];
+
+		ready = min(stream_chunks_ready(ctx), ctx->win_end);
+		if(k == ctx->win_end) {
+			next_window(ctx, posted);
+			continue;
+		}
+		if(k == ready) {
+			stream_advance(ctx, posted, posted + 1);
+			continue;
+		}
+
+		if(wait_lane_ready(ctx, lane, 1, need_credits))
+			break;
+
+		while(k < ready) {
+			lane = &ctx->lanes[k % ctx->nr_lanes];
+			if(!lane_ready(lane, 1, need_credits))
+				break;
+			err = queue_chunk(ctx, k);
+			if(err) {
+				cmpxchg(&ctx->status, 0, err);
+				break;
+			}
+			k++;
+		}
+
+		terminate_batches(ctx);
+		for(i = 0; i < ctx->nr_lanes; i++) {
+			if(need_credits)
+				atomic_sub(ctx->lanes[i].batch, &ctx->lanes[i].credits);
+			if(READ_ONCE(ctx->status))
+				ctx->lanes[i].batch = 0;
+			else
+				post_lane_batch(ctx, i);
+		}
+		posted = k;
+		stream_advance(ctx, posted, 0);
 	}
+}
+
+/*
+ * The receiver posts its receives in rounds of credit_grant chunks per
+ * lane, each followed by a credit message on the lane. Its window is at
+ * least credit_grant deep, so a lane always drains far enough to take
+ * its share of the next round. The sender expects full rounds, so all the
+ * chunks of a round of a streamed region are mapped before it is posted.
+ */
+static void post_receiver_chunks(struct xfer_ctx *ctx, u32 grant) {
+	unsigned long posted = 0;
+	int i;
+
+	while(posted < ctx->nchunks && !READ_ONCE(ctx->status)) {
+		unsigned long end = min(ctx->nchunks,
+					posted + (unsigned long)grant * ctx->nr_lanes);
+		unsigned long k;
+		int err = 0;
+
+		if(stream_advance(ctx, posted, end))
+			return;
+
+		for(i = 0; i < ctx->nr_lanes; i++) {
+			unsigned long share = (end > posted + i)?
+					DIV_ROUND_UP(end - posted - i, ctx->nr_lanes): 0;
+			if(wait_lane_ready(ctx, &ctx->lanes[i], share, false))
+				return;
+		}
+
+		for(k = posted; k < end && !err; k++)
+			err = queue_chunk(ctx, k);
+		if(err) {
+			cmpxchg(&ctx->status, 0, err);
+			for(i = 0; i < ctx->nr_lanes; i++)
+				ctx->lanes[i].batch = 0;
+			return;
+		}
+
+		terminate_batches(ctx);
+		for(i = 0; i < ctx->nr_lanes; i++) {
+			int nr = post_lane_batch(ctx, i);
+			if(nr && !READ_ONCE(ctx->status))
+				post_credit_msg(&ctx->lanes[i], nr);
+		}
+		posted = end;
+		stream_advance(ctx, posted, 0);
+	}
+}
+
+/*
+ * Moves `length` bytes of the region in chunks of chunk_size bytes, striped
+ * over the QPs of the connection and keeping up to xfer_window WRs
+ * outstanding on each of them. Chunks are SENDs, RDMA WRITEs or RDMA READs,
+ * or RECVs when is_recv is set; one-sided chunks target consecutive bytes
+ * of the windows the target exposes its buffer through, no larger than
+ * the win_size it offered in `remote`.
+ *
+ * Two-sided transfers are flow controlled by the receiver: it posts its
+ * receives credit_grant at a time and tells the sender with a credit
+ * message, and the sender only sends against credits, so a SEND never
+ * finds the receive queue empty.
+ *
+ * Chunks no larger than the inline limit of the QP are sent inline: the
+ * CPU copies them into the WR, and the device skips the DMA read of the
+ * payload. A streamed region is never sent inline, since its pages are
+ * only pinned as the transfer goes.
+ */
+static int post_chunks(struct rdma_conn *conn,
+				struct rdma_region *region, unsigned long length,
+				u32 chunk_size, int max_sge, int op, bool is_recv,
+				const struct rdma_xfer_info *local,
+				const struct rdma_xfer_info *remote) {
+	struct xfer_ctx *ctx;
+	unsigned long nchunks;
+	bool two_sided = (op == XFER_OP_SEND);
+	u32 grant = is_recv? local->credit_grant: remote->credit_grant;
+	int err = 0;
+	int i;
+
+	/* Each round of receives must fit in the receiver's window */
+	if(two_sided && (grant < 1 || grant > QP_MAX_WR / 2)) {
+		err_info("Invalid credit grant %u\n", grant);
+		return -EPROTO;
+	}
+
+	/* A chunk never straddles two windows of the target */
+	if(!two_sided) {
+		if(remote->win_size < PAGE_SIZE) {
+			err_info("Invalid target window size %llu\n", remote->win_size);
+			return -EPROTO;
+		}
+		chunk_size = min_t(u64, chunk_size, remote->win_size);
+	}
+
+	nchunks = DIV_ROUND_UP(length, chunk_size);
+	ctx = alloc_xfer_ctx(conn, nchunks, max_sge, is_recv);
+	if(!ctx) {
+		err_info("Failed to alloc work requests\n");
+		return -ENOMEM;
+	}
+
+	ctx->dev_stats = conn->dev->stats;
+	ctx->conn_stats = conn->stats;
+	ctx->region = region;
+	ctx->length = length;
+	ctx->chunk_size = chunk_size;
+	ctx->opcode = xfer_op_to_wr_opcode(op);
+	ctx->conn = conn;
+	ctx->win_end = nchunks;
+	if(!two_sided) {
+		ctx->win_size = rounddown((unsigned long)remote->win_size, chunk_size);
+		ctx->win_end = 0;
+	}
+	ctx->inline_data = (!is_recv && op != XFER_OP_READ &&
+				!IS_ENABLED(CONFIG_HIGHMEM) && !region->stream &&
+				min_t(unsigned long, length, chunk_size) <= conn->max_inline);
+	init_region_cursor(region, &ctx->cur);
+
+	if(two_sided && !is_recv) {
+		for(i = 0; i < ctx->nr_lanes; i++) {
+			struct xfer_lane *lane = &ctx->lanes[i];
+			int j;
+
+			lane->nr_credit_msgs = DIV_ROUND_UP(lane->nchunks, grant);
+			for(j = 0; j < QP_MAX_WR / 2 && !ctx->status; j++) {
+				if(post_credit_recv(lane))
+					cmpxchg(&ctx->status, 0, -EIO);
+			}
+		}
+	}
+
+	if(!two_sided)
+		next_window(ctx, 0);
+
+	if(two_sided && is_recv)
+		post_receiver_chunks(ctx, grant);
 	else
-		err = 0;
+		post_initiator_chunks(ctx, two_sided);
 
-	dma_addr = get_dma_address_from_sgtbl(sgtbl, virtaddr);
+	err = drain_xfer(ctx);
+	if(err)
+		err_info("Transfer failed after %lu of %lu bytes\n",
+				min(xfer_chunks_done(ctx) * chunk_size, length), length);
 
-	cq_init_attr.cqe = 1;
-	cq_init_attr.comp_vector = 0;
-	cq_init_attr.flags = 0;
-	cq = ib_create_cq(ib_dev, NULL, NULL,
-					NULL, &cq_init_attr);
-	if(IS_ERR(cq)) {
-		err = -ENODEV;
-		goto err_create_cq;
-	}
-
-	memset(&qp_init_attr, 0, sizeof(qp_init_attr));
-	qp_init_attr.send_cq = cq;
-	qp_init_attr.recv_cq = cq;
-	qp_init_attr.cap.max_send_wr = 128;
-	qp_init_attr.cap.max_recv_wr = 128;
-	qp_init_attr.cap.max_send_sge = 30;
-	qp_init_attr.cap.max_recv_sge = 30;
-	qp_init_attr.qp_type = IB_QPT_RC;
-	qp_init_attr.sq_sig_type = IB_SIGNAL_ALL_WR;
-	qp = ib_create_qp(pd, &qp_init_attr);
-	if(IS_ERR(qp)) {
-		err = -ENODEV;
-		goto err_create_qp;
+	free_xfer_ctx(ctx);
+	return err;
+}
+
+int get_ib_dev_numa_node(const char *dev_name) {
+	struct demo_dev *dev;
+	int node;
+
+	dev = demo_dev_get(dev_name);
+	if(!dev) {
+		return -ENODEV;
 	}
 
-	err = ib_query_port(ib_dev, rdma_port, &port_attr);
-	if(err) {
-		goto err_conn;
+	node = dev_to_node(dev->ib_dev->dma_device);
+	demo_dev_put(dev);
+	return node;
+}
+
+static int check_xfer_param(bool is_server, int op, int access) {
+	if(op < XFER_OP_SEND || op > XFER_OP_READ) {
+		err_info("Invalid opcode: %d\n", op);
+		return -EINVAL;
+	}
+
+	if(!xfer_dir_ok(op, is_server, access_to_dma_dir(access))) {
+		err_info("Access %d does not allow opcode %d\n", access, op);
+		return -EINVAL;
 	}
 
-	err = rdma_query_gid(ib_dev, rdma_port, sgid_index, &local_gid);
+	return 0;
+}
+
+static void account_xfer(struct demo_stats *stats,
+				unsigned long bytes, int err) {
 	if(err) {
-		goto err_conn;
+		stats_inc(stats, xfer_errors);
+		return;
 	}
-	dbg_info("server: %d, local gid: %pI4\n", is_server, local_gid.raw+12);
 
-	local_info.qpn = qp->qp_num;
-	local_info.psn = 0;
-	local_info.lid = port_attr.lid;
-	memcpy(&local_info.gid, &local_gid, sizeof(local_gid));
+	stats_inc(stats, xfers);
+	stats_add(stats, bytes, bytes);
+}
 
-	err = setup_connection(is_server, s_addr, &sock, &client_sock);
+static void account_proto(struct demo_stats *stats, bool eager, bool rndv) {
+	if(eager)
+		stats_inc(stats, eager_xfers);
+	if(rndv)
+		stats_inc(stats, rndv_xfers);
+}
+
+/* 0 when sends are never eager, nor pulled */
+static unsigned long eager_limit(void) {
+	return min_t(unsigned long, READ_ONCE(eager_threshold), CONN_BOUNCE_SIZE);
+}
+
+/*
+ * The segments of an sg list are as large as the device can map. Without
+ * a device, for the TCP fallback, the default DMA segment limit is used.
+ */
+static unsigned int max_seg_size(const struct demo_dev *dev) {
+	return dev? dma_get_max_seg_size(dev->ib_dev->dma_device): SZ_64K;
+}
+
+/* Pins the buffer into an sg list with segments the device can map */
+static int pin_region(struct demo_dev *dev, unsigned long virtaddr,
+				unsigned long length, int access, u64 id,
+				struct sg_table **p_sgtbl) {
+	struct demo_stats *stats = dev? dev->stats: NULL;
+	ktime_t start = ktime_get();
+	int err = 0;
+
+	err = get_sg_list(virtaddr, length, access, max_seg_size(dev),
+				id, p_sgtbl);
 	if(err) {
-		err_info("setup_connection error\n");
+		err_info("Failed to get sg list\n");
+		return err;
+	}
+
+	stats_hist_since(stats, STATS_HIST_PIN, start);
+	stats_add(stats, pages_pinned, sg_tbl_npages(*p_sgtbl));
+	stats_add(stats, sg_ents, (*p_sgtbl)->nents);
+	return err;
+}
+
+/*
+ * Runs one transfer of the pinned sg list, or of the buffer of stream,
+ * which is pinned and mapped as it goes. The list is DMA-mapped for the
+ * duration of the transfer only. The connection to the peer is set up in
+ * the network namespace net. id tags the trace events of the transfer.
+ *
+ * With neither, the transfer is an eager send of the user buffer of
+ * param: it is copied into or out of the bounce buffer of the connection,
+ * which the send moves instead. A send of a pinned buffer larger than
+ * eager_threshold is offered to the receiver instead, which pulls it
+ * with RDMA READs if it can, as the initiator of a read of which the
+ * sender is the target.
+ */
+static int rdma_xfer(bool is_server, const struct write_param *param,
+				struct ib_device *ib_dev, struct net *net,
+				struct sg_table *sgtbl, struct region_stream *stream,
+				unsigned long length, int access, u64 id) {
+	struct rdma_region region = {
+		.dir			= access_to_dma_dir(access),
+		.sgtbl			= sgtbl,
+		.length			= length,
+		.pool_buf		= sgtbl? pool_buf_of_sg_tbl(sgtbl): NULL,
+		.stream			= stream,
+		.id				= id,
+	};
+	int err = 0;
+	struct demo_stats *dev_stats = demo_dev_of(ib_dev)->stats;
+	struct rdma_conn *conn;
+	struct rdma_xfer_info local_info, remote_info;
+	unsigned long xfer_len = 0;
+	ktime_t start = ktime_get();
+	u32 chunk_size;
+	int max_sge;
+	int op = param->opcode;
+	int xfer_op = op;
+	bool one_sided = (op != XFER_OP_SEND);
+	bool is_target = (is_server && one_sided);
+	bool eager = (!sgtbl && !stream);
+	bool rndv = false;
+	bool registered = false, retried = false;
+	bool use_frmr = (param->map_mode == MAP_MODE_FRMR);
+	int access_flags;
+
+	if(sgtbl) {
+		err = map_region(ib_dev, &region);
+		if(err) {
+			account_xfer(dev_stats, 0, err);
+			trace_demo_xfer(id, is_server, op, 0, start, err);
+			return err;
+		}
+		trace_demo_map(id, sgtbl->nents, region.dma_nents, region.contig,
+					start);
+		stats_hist_since(dev_stats, STATS_HIST_MAP, start);
+		stats_add(dev_stats, dma_segs, region.dma_nents);
+
+		/*
+		 * Without an IOMMU, or with one that did not merge the whole
+		 * buffer, MAP_MODE_IOVA is served like MAP_MODE_FRMR.
+		 */
+		if(param->map_mode == MAP_MODE_IOVA && !region.contig) {
+			dbg_info("%s: buffer is not IOVA-contiguous (IOMMU %s)\n",
+					ib_dev->name,
+					iommu_get_domain_for_dev(ib_dev->dma_device)?
+								"present": "absent");
+			stats_inc(dev_stats, iova_fallbacks);
+			use_frmr = true;
+		}
+	}
+
+retry:
+	conn = rdma_conn_get(ib_dev, net, is_server, param);
+	if(IS_ERR(conn)) {
+		err = (int)PTR_ERR(conn);
+		err_info("Failed to get connection\n");
 		goto err_conn;
 	}
 
-	err = exchange_info(is_server, &local_info, &remote_info, sock, client_sock);
-	if(err) {
-		err_info("exchange_info error\n");
-		goto err_modify_qp;
+	region.lkey = conn->dma_mr->lkey;
+	max_sge = conn->max_sge;
+	if(op == XFER_OP_READ && !is_server)
+		max_sge = min_t(int, max_sge, ib_dev->attrs.max_sge_rd);
+
+	if(eager) {
+		region.sgtbl = &conn->bounce_sgt;
+		region.dma_addr = conn->bounce_dma;
+		region.dma_nents = 1;
+		region.contig = true;
+		if(!is_server) {
+			if(copy_from_user(conn->bounce_buf,
+						(const void __user *)param->virtaddr, length)) {
+				err = -EFAULT;
+				err_info("Failed to copy from user\n");
+				goto err_xfer;
+			}
+			ib_dma_sync_single_for_device(ib_dev, conn->bounce_dma,
+						length, DMA_TO_DEVICE);
+		}
+	}
+	else if(op == XFER_OP_SEND && !is_server && !stream &&
+				eager_limit() && length > eager_limit()) {
+		rndv = true;
 	}
 
-	memset(&qp_attr, 0, sizeof(qp_attr));
-	qp_attr.qp_state = IB_QPS_INIT;
-	qp_attr.pkey_index = 0;
-	qp_attr.port_num = rdma_port;
-	qp_attr.qp_access_flags = IB_ACCESS_LOCAL_WRITE;
-	attr_flag = (IB_QP_STATE | IB_QP_PKEY_INDEX |
-				IB_QP_PORT | IB_QP_ACCESS_FLAGS);
-	err = ib_modify_qp(qp, &qp_attr, attr_flag);
-	if(err) {
-		goto err_modify_qp;
-	}
-
-	memset(&qp_attr, 0, sizeof(qp_attr));
-	qp_attr.qp_state = IB_QPS_RTR;
-	qp_attr.path_mtu = IB_MTU_1024;
-	qp_attr.dest_qp_num = remote_info.qpn;
-	qp_attr.rq_psn = remote_info.psn;
-	qp_attr.max_dest_rd_atomic = 1;
-	qp_attr.min_rnr_timer = 12;
-	qp_attr.ah_attr.ib.dlid = remote_info.lid;
-	qp_attr.ah_attr.sl = 0;
-	qp_attr.ah_attr.ib.src_path_bits = 0;
-	qp_attr.ah_attr.port_num = rdma_port;
-	qp_attr.ah_attr.ah_flags = IB_AH_GRH;
-	qp_attr.ah_attr.grh.hop_limit = 255;
-	memcpy(&qp_attr.ah_attr.grh.dgid, &remote_info.gid,
-							sizeof(remote_info.gid));
-	qp_attr.ah_attr.grh.sgid_index = sgid_index;
-	qp_attr.ah_attr.grh.traffic_class = 0;
-	qp_attr.ah_attr.type = RDMA_AH_ATTR_TYPE_ROCE;
-
-	attr_flag = (IB_QP_STATE | IB_QP_AV | IB_QP_PATH_MTU |
-				IB_QP_DEST_QPN | IB_QP_RQ_PSN |
-			IB_QP_MAX_DEST_RD_ATOMIC | IB_QP_MIN_RNR_TIMER);
-
-	ah = rdma_create_user_ah(qp->pd, &qp_attr.ah_attr, NULL);
-	if(IS_ERR(ah)) {
-		goto err_modify_qp;
-	}
-	
-	err = rdma_destroy_ah(ah, 0);
-	if(err) {
-		goto err_modify_qp;
+	/*
+	 * The target of a one-sided operation always exposes its buffer
+	 * through fast-registration MRs, since the DMA MR carries no rkey.
+	 * So does a sender that offers its buffer to be pulled, and it sends
+	 * it as usual if it cannot.
+	 */
+	if((is_target || rndv) && !conn->mr_pool) {
+		if(is_target) {
+			err = -EOPNOTSUPP;
+			err_info("Cannot register target buffer, err: %d\n", err);
+			goto err_xfer;
+		}
+		rndv = false;
+	}
+
+	if(use_frmr && !is_target) {
+		err = conn->mr_pool? map_region_frmr(conn->lanes[0].qp, &region):
+					-EOPNOTSUPP;
+		if(err) {
+			dbg_info("FRMR unavailable (err: %d), posting %d DMA segments\n",
+						err, region.dma_nents);
+			err = 0;
+		}
 	}
 
-	err = ib_modify_qp(qp, &qp_attr, attr_flag);
+	memset(&local_info, 0, sizeof(local_info));
+	local_info.chunk_size = region_chunk_size(&region, max_sge);
+	local_info.length = length;
+	local_info.win_size = (is_target || rndv)? frmr_window_size(conn): 0;
+	local_info.opcode = op;
+	local_info.credit_grant = clamp_t(u32, credit_grant, 1,
+					min_t(u32, xfer_window_size(), QP_MAX_WR / 2));
+	local_info.rndv = rndv || (is_server && op == XFER_OP_SEND && !eager);
+
+	err = rdma_conn_exchange(conn, &local_info, &remote_info,
+					sizeof(local_info));
+	if(err && conn->reused && !retried) {
+		/* The peer dropped the pooled connection; establish a new one */
+		dbg_info("Pooled connection is stale, reconnecting\n");
+		unreg_region_frmr(conn->lanes[0].qp, &region, false);
+		rdma_conn_put(conn, true);
+		retried = true;
+		goto retry;
+	}
 	if(err) {
-		goto err_modify_qp;
+		err_info("exchange_info error\n");
+		goto err_xfer;
+	}
+
+	if(remote_info.opcode != local_info.opcode) {
+		err = -EPROTO;
+		err_info("Opcode mismatch: local %u, remote %u\n",
+					local_info.opcode, remote_info.opcode);
+		goto err_xfer;
 	}
 
-	memset(&qp_attr, 0, sizeof(qp_attr));
-	qp_attr.qp_state = IB_QPS_RTS;
-	qp_attr.timeout = 14;
-	qp_attr.retry_cnt = 7;
-	qp_attr.rnr_retry = 7;
-	qp_attr.sq_psn = local_info.psn;
-	qp_attr.max_rd_atomic = 1;
+	/* Both sides agree on pulling, whatever their eager_threshold */
+	rndv = (local_info.rndv && remote_info.rndv);
+	if(rndv) {
+		xfer_op = XFER_OP_READ;
+		one_sided = true;
+		is_target = !is_server;
+		if(is_server) {
+			max_sge = min_t(int, max_sge, ib_dev->attrs.max_sge_rd);
+			local_info.chunk_size = region_chunk_size(&region, max_sge);
+		}
+	}
 
-	attr_flag = (IB_QP_STATE | IB_QP_TIMEOUT | IB_QP_RETRY_CNT |
-			IB_QP_RNR_RETRY | IB_QP_SQ_PSN | IB_QP_MAX_QP_RD_ATOMIC);
+	/* A target exposes its buffer through windows of its own */
+	if(is_target)
+		unreg_region_frmr(conn->lanes[0].qp, &region, false);
 
-	err = ib_modify_qp(qp, &qp_attr, attr_flag);
-	if(err) {
-		goto err_modify_qp;
+	if(region.mr) {
+		access_flags = (region.dir == DMA_TO_DEVICE)? 0: IB_ACCESS_LOCAL_WRITE;
+		err = reg_region_frmr(conn->lanes[0].qp, &region, access_flags);
+		if(err) {
+			goto err_xfer;
+		}
+		registered = true;
 	}
 
-	sge_list.addr = (uintptr_t)dma_addr;
-	sge_list.length = length;
-	sge_list.lkey = mr->lkey;
+	if(one_sided)
+		chunk_size = local_info.chunk_size;
+	else
+		chunk_size = min(local_info.chunk_size, remote_info.chunk_size);
+	xfer_len = is_server? remote_info.length: length;
+	if((is_server? length: remote_info.length) < xfer_len) {
+		err = -EMSGSIZE;
+		err_info("Receive buffer smaller than %lu bytes\n", xfer_len);
+		goto err_xfer;
+	}
 
-	if(is_server) {
-		recv_wr.wr_id = 1;
-		recv_wr.sg_list = &sge_list;
-		recv_wr.next = NULL;
-		recv_wr.num_sge = 1;
-		err = ib_post_recv(qp, &recv_wr, (const struct ib_recv_wr**)&bad_recv_wr);
+	if(is_target) {
+		err = expose_windows(conn, &region, xfer_len,
+						target_access_flags(xfer_op));
 		if(err) {
-			goto err_modify_qp;
+			err_info("server: %d, transfer failed\n", is_server);
+			goto err_xfer;
 		}
 	}
 	else {
-		send_wr.wr_id = 1;
-		send_wr.sg_list = &sge_list;
-		send_wr.next = NULL;
-		send_wr.num_sge = 1;
-		send_wr.opcode = IB_WR_SEND;
-		send_wr.send_flags = IB_SEND_SIGNALED;
-		err = ib_post_send(qp, &send_wr, (const struct ib_send_wr**)&bad_send_wr);
+		err = post_chunks(conn, &region, xfer_len, chunk_size, max_sge,
+						xfer_op, is_server && !one_sided,
+						&local_info, &remote_info);
 		if(err) {
-			goto err_modify_qp;
+			err_info("server: %d, transfer failed\n", is_server);
+			goto err_xfer;
 		}
 	}
 
-	while(1) {
-		struct ib_wc wc;
-		int ne = ib_poll_cq(cq, 1, &wc);
-		if(ne < 0) {
+	/* Only then may the target invalidate its last window */
+	if(one_sided && !is_target) {
+		err = rdma_conn_sync(conn);
+	}
+
+	/* The bounce buffer goes with the connection */
+	if(!err && eager && is_server) {
+		ib_dma_sync_single_for_cpu(ib_dev, conn->bounce_dma, xfer_len,
+					DMA_FROM_DEVICE);
+		if(copy_to_user((void __user *)param->virtaddr, conn->bounce_buf,
+					xfer_len)) {
 			err = -EFAULT;
-			err_info("ib_poll_cq error\n");
-			goto err_modify_qp;
+			err_info("Failed to copy to user\n");
 		}
+	}
 
-		if(ne > 0) {
-			if(wc.status != IB_WC_SUCCESS) {
-				err_info("server: %d, wc not success\n", is_server);
-				goto err_modify_qp;
-			}
-			break;
-		}
+err_xfer:
+	account_xfer(conn->stats, xfer_len, err);
+	if(!err)
+		account_proto(conn->stats, eager, rndv);
+	unreg_region_frmr(conn->lanes[0].qp, &region, registered);
+	rdma_conn_put(conn, err != 0);
+err_conn:
+	if(!eager)
+		unmap_region(ib_dev, &region);
+	account_xfer(dev_stats, xfer_len, err);
+	if(!err)
+		account_proto(dev_stats, eager, rndv);
+	trace_demo_xfer(id, is_server, op, xfer_len, start, err);
+	return err;
+}
+
+/*
+ * Runs the transfer on the device named by param, or over kernel TCP when
+ * there is no such device and the fallback is enabled.
+ */
+static int xfer_on_dev(bool is_server, const struct write_param *param,
+				struct demo_dev *dev, struct net *net,
+				struct sg_table *sgtbl, unsigned long length, int access,
+				u64 id) {
+	if(!dev) {
+		dbg_info("No device %s, transferring over TCP\n", param->dev_name);
+		return tcp_xfer(is_server, param, net, sgtbl, length);
+	}
+
+	return rdma_xfer(is_server, param, dev->ib_dev, net,
+				sgtbl, NULL, length, access, id);
+}
 
-		err = exchange_info(is_server, &local_info, &remote_info,
-						sock, client_sock);
+/*
+ * Streaming needs nothing of the buffer but its DMA segments, one chunk at
+ * a time: the whole of it is only needed by MAP_MODE_IOVA and
+ * MAP_MODE_FRMR, and by the target of a one-sided operation, which
+ * exposes it through an MR.
+ */
+static bool can_stream(bool is_server, const struct write_param *param) {
+	return param->map_mode == MAP_MODE_DMA &&
+		!(is_server && param->opcode != XFER_OP_SEND);
+}
+
+/* Cuts the buffer of param into segments of stream_seg_size bytes */
+static int init_stream(struct region_stream *stream, struct demo_dev *dev,
+				const struct write_param *param) {
+	unsigned long base = ALIGN_DOWN(param->virtaddr, PAGE_SIZE);
+	unsigned long end = param->virtaddr + param->length;
+	unsigned int i;
+
+	memset(stream, 0, sizeof(*stream));
+	stream->dev = dev;
+	stream->virtaddr = param->virtaddr;
+	stream->access = param->access;
+	stream->seg_size = max(PAGE_ALIGN(stream_seg_size), PAGE_SIZE);
+	stream->nr_segs = DIV_ROUND_UP(end - base, stream->seg_size);
+
+	stream->segs = kvcalloc(stream->nr_segs, sizeof(*stream->segs),
+					GFP_KERNEL);
+	if(!stream->segs) {
+		return -ENOMEM;
+	}
+
+	for(i = 0; i < stream->nr_segs; i++) {
+		stream->segs[i].end = min(base + (i + 1) * stream->seg_size, end) -
+					param->virtaddr;
+	}
+	return 0;
+}
+
+/*
+ * Pins the buffer described by param and transfers it. The pages stay
+ * pinned after a successful transfer, until they are unpinned or filep
+ * is released. With XFER_F_STREAM, they are pinned and unpinned segment
+ * by segment while they are transferred instead, and the buffer of an
+ * eager send is not pinned at all.
+ */
+int kern_rdma_core(struct file *filep, bool is_server,
+				const struct write_param *param) {
+	struct demo_dev *dev;
+	struct sg_table *sgtbl;
+	u64 id = atomic64_inc_return(&next_xfer_id);
+	int err = 0;
+
+	err = check_xfer_param(is_server, param->opcode, param->access);
+	if(err) {
+		return err;
+	}
+
+	dev = demo_dev_get(param->dev_name);
+	if(!dev && !tcp_fallback) {
+		return -ENODEV;
+	}
+
+	/* A small send is copied, so nothing is pinned for it */
+	if(param->opcode == XFER_OP_SEND && dev && eager_limit() &&
+				param->length <= eager_limit()) {
+		err = rdma_xfer(is_server, param, dev->ib_dev,
+					current->nsproxy->net_ns, NULL, NULL,
+					param->length, param->access, id);
+		goto out;
+	}
+
+	if((param->flags & XFER_F_STREAM) && dev &&
+				can_stream(is_server, param)) {
+		struct region_stream stream;
+
+		err = init_stream(&stream, dev, param);
 		if(err) {
-			if(err != -EPIPE) {
-				err_info("server: %d, Remote peer has closed connection\n", is_server);
-			}
-			else {
-				err = 0;
-			}
-			goto err_modify_qp;
+			goto out;
 		}
+
+		err = rdma_xfer(is_server, param, dev->ib_dev,
+					current->nsproxy->net_ns, NULL, &stream,
+					param->length, param->access, id);
+		kvfree(stream.segs);
+		goto out;
 	}
 
-err_modify_qp:
-	close_connection(is_server, sock, client_sock);
-err_conn:
-	ib_destroy_qp(qp);
-err_create_qp:
-	ib_destroy_cq(cq);
-err_create_cq:
-	ib_dma_unmap_sg(ib_dev, sgtbl->sgl,
-				sgtbl->nents, DMA_BIDIRECTIONAL);
-err_dma_map_single:
-	ib_dereg_mr(mr);
-err_get_dma_mr:
-	if(err)
+	err = pin_region(dev, param->virtaddr, param->length,
+				param->access, id, &sgtbl);
+	if(err) {
+		goto out;
+	}
+
+	/*
+	 * The sg list is busy while it is transferred, so an unpin of the
+	 * same range cannot free it. A buffer that cannot be streamed is
+	 * still unpinned at the end.
+	 */
+	err = xfer_on_dev(is_server, param, dev, current->nsproxy->net_ns,
+				sgtbl, param->length, param->access, id);
+	if(err || (param->flags & XFER_F_STREAM))
 		free_sg_list(sgtbl);
-err_sg_list:
-	ib_dealloc_pd(pd);
-err_alloc_pd:
+	else
+		park_sg_tbl(sgtbl, filep);
+
+out:
+	if(dev)
+		demo_dev_put(dev);
 	return err;
 }
 
-void kern_rdma_release(void) {
-	struct sg_table *sgtbl =
-				get_sg_tbl_from_pid(current->pid);
-	if(!sgtbl)
-		return;
+/*
+ * Transfers the buffer of the registration `handle` of the process whose
+ * mm is mm, connecting in the network namespace net. The virtaddr, length, access
+ * and flags of param are not used.
+ */
+int kern_rdma_xfer_registered(bool is_server, const struct write_param *param,
+				struct net *net, const struct mm_struct *mm, u64 handle) {
+	struct demo_dev *dev;
+	struct sg_table *sgtbl;
+	unsigned long length;
+	int access;
+	int err = 0;
+
+	sgtbl = acquire_sg_tbl(mm, handle, &length, &access);
+	if(IS_ERR(sgtbl)) {
+		err = (int)PTR_ERR(sgtbl);
+		err_info("Cannot use registration %llu, err: %d\n", handle, err);
+		return err;
+	}
+
+	err = check_xfer_param(is_server, param->opcode, access);
+	if(err) {
+		goto out;
+	}
+
+	dev = demo_dev_get(param->dev_name);
+	if(!dev && !tcp_fallback) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	err = xfer_on_dev(is_server, param, dev, net, sgtbl, length, access,
+				atomic64_inc_return(&next_xfer_id));
+	if(dev)
+		demo_dev_put(dev);
+
+out:
+	release_sg_tbl(sgtbl);
+	return err;
+}
+
+/* Any file of the process may use the registration; it goes with filep */
+int kern_rdma_register(struct file *filep, const struct reg_param *param,
+				u64 *p_handle) {
+	struct demo_dev *dev;
+	struct sg_table *sgtbl;
+	int err = 0;
+
+	if(param->access < ACCESS_BIDIRECTIONAL ||
+				param->access > ACCESS_WRITE_ONLY) {
+		err_info("Invalid access: %d\n", param->access);
+		return -EINVAL;
+	}
+
+	dev = demo_dev_get(param->dev_name);
+	if(!dev && !tcp_fallback) {
+		return -ENODEV;
+	}
+
+	err = pin_region(dev, param->virtaddr, param->length,
+				param->access, atomic64_inc_return(&next_xfer_id), &sgtbl);
+	if(dev)
+		demo_dev_put(dev);
+	if(err) {
+		return err;
+	}
+
+	*p_handle = register_sg_tbl(sgtbl, filep);
+	return err;
+}
+
+int kern_rdma_deregister(u64 handle) {
+	return free_sg_tbl_by_handle(current->mm, handle);
+}
+
+int kern_rdma_unpin(const struct write_param *param) {
+	struct sg_table *sgtbl;
+	int err = 0;
+
+	sgtbl = claim_sg_tbl_by_range(current->mm,
+					param->virtaddr, param->length);
+	if(IS_ERR(sgtbl)) {
+		err = (int)PTR_ERR(sgtbl);
+		err_info("Cannot unpin 0x%lx, err: %d\n", param->virtaddr, err);
+		return err;
+	}
+
 	free_sg_list(sgtbl);
+	return err;
+}
+
+/*
+ * Counts the sg entries pin_region would build for the buffer of param.
+ * Making a buffer contiguous is up to user space (e.g. with MADV_COLLAPSE),
+ * which calls this before and after to see what it gained.
+ */
+int kern_rdma_count_sg(struct sg_count_param *param) {
+	struct demo_dev *dev;
+	int err = 0;
+
+	if(param->stage != SG_COUNT_BEFORE && param->stage != SG_COUNT_AFTER) {
+		err_info("Invalid stage: %d\n", param->stage);
+		return -EINVAL;
+	}
+
+	dev = demo_dev_get(param->dev_name);
+	err = count_sg_ents(param->virtaddr, param->length, param->access,
+				max_seg_size(dev), &param->nents);
+	if(dev)
+		demo_dev_put(dev);
+	if(err) {
+		return err;
+	}
+
+	if(param->stage == SG_COUNT_BEFORE)
+		stats_add(module_stats, contig_ents_before, param->nents);
+	else
+		stats_add(module_stats, contig_ents_after, param->nents);
+	return err;
+}
+
+/*
+ * Frees what was registered or left pinned through filep, whichever task
+ * drops the last reference to it. One still carrying a transfer queued on
+ * another file of the process is freed when that transfer ends.
+ */
+void kern_rdma_release(struct file *filep) {
+	free_owned_sg_tbls(filep);
 }
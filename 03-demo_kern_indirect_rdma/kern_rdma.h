@@ -2,15 +2,51 @@
 #define __KERN_RDMA_H__
 
 #include <linux/in.h>
+#include <linux/types.h>
 
-extern int init_ib_dev_list(void);
-extern void destroy_ib_dev_list(void);
-extern int kern_rdma_core(bool is_server, const char *dev_name,
-				const struct sockaddr_in *s_addr, 
-				int rdma_port, int sgid_index,
-				unsigned long virtaddr, unsigned long length);
+/*
+ * Exchanged over the connection before every transfer. For a send, rndv
+ * is set by a sender whose buffer can be pulled, and by a receiver that
+ * can pull it. The target of a one-sided operation, or such a sender,
+ * fills in win_size, the bytes one of its MRs is sure to cover.
+ *
+ * The target then exposes its buffer one window at a time, and the same
+ * struct carries each window: the target fills in its address, rkey and
+ * length, and the initiator, in its first one, the window size it cut
+ * its chunks for.
+ */
+struct rdma_xfer_info {
+	u32					chunk_size;
+	u64					length;
+	u64					addr;
+	u32					rkey;
+	u32					opcode;
+	u32					credit_grant;
+	u32					rndv;
+	u64					win_size;
+};
 
-extern void kern_rdma_release(void);
+struct write_param;
+struct sg_count_param;
+struct reg_param;
+struct net;
+struct mm_struct;
+struct file;
+
+extern int get_ib_dev_numa_node(const char *dev_name);
+extern int kern_rdma_core(struct file *filep, bool is_server,
+			const struct write_param *param);
+
+extern int kern_rdma_xfer_registered(bool is_server,
+			const struct write_param *param, struct net *net,
+			const struct mm_struct *mm, u64 handle);
+extern int kern_rdma_register(struct file *filep,
+			const struct reg_param *param, u64 *p_handle);
+extern int kern_rdma_deregister(u64 handle);
+
+extern int kern_rdma_unpin(const struct write_param *param);
+extern int kern_rdma_count_sg(struct sg_count_param *param);
+extern void kern_rdma_release(struct file *filep);
 
 #endif
 
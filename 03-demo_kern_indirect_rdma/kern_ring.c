@@ -0,0 +1,363 @@
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/completion.h>
+#include <linux/log2.h>
+#include <linux/uaccess.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/nsproxy.h>
+#include <net/net_namespace.h>
+#include "kern_ring.h"
+#include "kern_rdma.h"
+#include "common.h"
+
+#define RING_MAX_ENTRIES				4096
+#define RING_ALIGN						64
+
+static unsigned int ring_idle_us = 1000;
+module_param(ring_idle_us, uint, 0644);
+MODULE_PARM_DESC(ring_idle_us, "Microseconds the ring worker polls for SQEs before it sleeps");
+
+/*
+ * The rings of one open file of the device. The header, SQEs and CQEs
+ * live in one vmalloc_user area mapped by user space, which may write
+ * anything into it; the kernel keeps its own copy of the sizes and of the
+ * indexes it owns (sq_head and cq_tail). Transfers use the registrations
+ * of the mm that set the rings up, and connect in its network namespace.
+ */
+struct xfer_ring {
+	void							*mem;
+	size_t							size;
+	struct ring_hdr					*hdr;
+	struct ring_sqe					*sqes;
+	struct ring_cqe					*cqes;
+	u32								sq_entries;
+	u32								cq_entries;
+	u32								sq_head;
+	u32								cq_tail;
+	struct mm_struct				*mm;
+	struct net						*net;
+
+	struct task_struct				*worker;
+	wait_queue_head_t				worker_wq;
+	bool							wakeup;
+	atomic_t						inflight;
+	atomic_t						refs;
+	struct completion				done;
+
+	spinlock_t						cq_lock;
+	wait_queue_head_t				cq_wq;
+};
+
+struct ring_req {
+	struct work_struct				work;
+	struct xfer_ring				*ring;
+	struct ring_sqe					sqe;
+};
+
+static struct workqueue_struct *ring_wq;
+
+static void ring_complete(struct xfer_ring *ring, u64 user_data, int res) {
+	struct ring_cqe *cqe;
+
+	spin_lock(&ring->cq_lock);
+	cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+	cqe->user_data = user_data;
+	cqe->res = res;
+	cqe->resv = 0;
+	smp_store_release(&ring->hdr->cq_tail, ++ring->cq_tail);
+	spin_unlock(&ring->cq_lock);
+	wake_up(&ring->cq_wq);
+}
+
+static void ring_req_work(struct work_struct *work) {
+	struct ring_req *req = container_of(work, struct ring_req, work);
+	struct xfer_ring *ring = req->ring;
+	struct write_param *param = &req->sqe.param;
+	bool is_server;
+	int res;
+
+	param->dev_name[DEV_NAME_SIZE - 1] = '\0';
+	is_server = (param->s_addr.sin_addr.s_addr == htonl(INADDR_ANY));
+	res = kern_rdma_xfer_registered(is_server, param, ring->net,
+					ring->mm, req->sqe.handle);
+	ring_complete(ring, req->sqe.user_data, res);
+	kfree(req);
+
+	/* A CQ slot is free for the worker again */
+	atomic_dec(&ring->inflight);
+	wake_up(&ring->worker_wq);
+	if(atomic_dec_and_test(&ring->refs))
+		complete(&ring->done);
+}
+
+/*
+ * Every transfer taken from the SQ has a CQ slot reserved, counting the
+ * CQEs user space has not reaped yet, so the CQ never overflows.
+ */
+static u32 ring_cq_room(struct xfer_ring *ring) {
+	u32 pending = ring->cq_tail - READ_ONCE(ring->hdr->cq_head);
+	u32 used = pending + atomic_read(&ring->inflight);
+
+	return (pending > ring->cq_entries || used >= ring->cq_entries)?
+				0: ring->cq_entries - used;
+}
+
+static bool ring_sq_pending(struct xfer_ring *ring) {
+	return smp_load_acquire(&ring->hdr->sq_tail) != ring->sq_head;
+}
+
+/* Hands the published SQEs to the transfer workqueue */
+static int ring_consume_sqes(struct xfer_ring *ring) {
+	u32 tail = smp_load_acquire(&ring->hdr->sq_tail);
+	u32 room = ring_cq_room(ring);
+	int n = 0;
+
+	while(ring->sq_head != tail && room) {
+		const struct ring_sqe *sqe;
+		struct ring_req *req;
+
+		sqe = &ring->sqes[ring->sq_head & (ring->sq_entries - 1)];
+		req = kmalloc(sizeof(*req), GFP_KERNEL);
+		if(req) {
+			memcpy(&req->sqe, sqe, sizeof(*sqe));
+			req->ring = ring;
+			INIT_WORK(&req->work, ring_req_work);
+			atomic_inc(&ring->inflight);
+			atomic_inc(&ring->refs);
+			queue_work(ring_wq, &req->work);
+		}
+		else {
+			ring_complete(ring, READ_ONCE(sqe->user_data), -ENOMEM);
+		}
+
+		ring->sq_head++;
+		room--;
+		n++;
+	}
+
+	smp_store_release(&ring->hdr->sq_head, ring->sq_head);
+	return n;
+}
+
+static void ring_set_flags(struct xfer_ring *ring, u32 set, u32 clear) {
+	u32 flags = READ_ONCE(ring->hdr->flags);
+
+	WRITE_ONCE(ring->hdr->flags, (flags | set) & ~clear);
+}
+
+/*
+ * Polls the SQ while there is work, and for ring_idle_us after it has
+ * run dry. Then it raises RING_F_NEED_WAKEUP and sleeps until user space
+ * rings the doorbell, or a finished transfer frees a CQ slot for SQEs
+ * still waiting in the SQ.
+ */
+static int ring_worker(void *data) {
+	struct xfer_ring *ring = data;
+	unsigned long idle_end = jiffies + usecs_to_jiffies(ring_idle_us);
+
+	while(!kthread_should_stop()) {
+		if(ring_consume_sqes(ring)) {
+			idle_end = jiffies + usecs_to_jiffies(ring_idle_us);
+			cond_resched();
+			continue;
+		}
+
+		if(time_before(jiffies, idle_end)) {
+			cond_resched();
+			continue;
+		}
+
+		ring_set_flags(ring, RING_F_NEED_WAKEUP, 0);
+		smp_mb();
+		wait_event_idle(ring->worker_wq, READ_ONCE(ring->wakeup) ||
+				kthread_should_stop() ||
+				(ring_sq_pending(ring) && ring_cq_room(ring)));
+		WRITE_ONCE(ring->wakeup, false);
+		ring_set_flags(ring, 0, RING_F_NEED_WAKEUP);
+		idle_end = jiffies + usecs_to_jiffies(ring_idle_us);
+	}
+
+	return 0;
+}
+
+static struct xfer_ring *alloc_ring(u32 sq_entries, u32 cq_entries,
+				struct ring_setup_param *param) {
+	struct xfer_ring *ring;
+	size_t sqes_off, cqes_off, size;
+
+	sqes_off = ALIGN(sizeof(struct ring_hdr), RING_ALIGN);
+	cqes_off = ALIGN(sqes_off + sq_entries * sizeof(struct ring_sqe), RING_ALIGN);
+	size = PAGE_ALIGN(cqes_off + cq_entries * sizeof(struct ring_cqe));
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if(!ring)
+		return NULL;
+
+	ring->mem = vmalloc_user(size);
+	if(!ring->mem) {
+		kfree(ring);
+		return NULL;
+	}
+
+	ring->size = size;
+	ring->hdr = ring->mem;
+	ring->sqes = ring->mem + sqes_off;
+	ring->cqes = ring->mem + cqes_off;
+	ring->sq_entries = sq_entries;
+	ring->cq_entries = cq_entries;
+	ring->hdr->sq_entries = sq_entries;
+	ring->hdr->cq_entries = cq_entries;
+	ring->mm = current->mm;
+	mmgrab(ring->mm);
+	ring->net = get_net(current->nsproxy->net_ns);
+	init_waitqueue_head(&ring->worker_wq);
+	atomic_set(&ring->refs, 1);
+	init_completion(&ring->done);
+	init_waitqueue_head(&ring->cq_wq);
+	spin_lock_init(&ring->cq_lock);
+
+	param->sq_entries = sq_entries;
+	param->cq_entries = cq_entries;
+	param->sqes_off = sqes_off;
+	param->cqes_off = cqes_off;
+	param->ring_size = size;
+	return ring;
+}
+
+static void free_ring(struct xfer_ring *ring) {
+	mmdrop(ring->mm);
+	put_net(ring->net);
+	vfree(ring->mem);
+	kfree(ring);
+}
+
+long ring_setup(struct file *filep, struct ring_setup_param __user *uparam) {
+	struct ring_setup_param param;
+	struct xfer_ring *ring;
+	u32 sq_entries, cq_entries;
+	int err = 0;
+
+	if(copy_from_user(&param, uparam, sizeof(param))) {
+		err = -EFAULT;
+		err_info("Failed to copy from user\n");
+		return err;
+	}
+
+	if(!param.sq_entries || param.sq_entries > RING_MAX_ENTRIES ||
+				param.cq_entries > RING_MAX_ENTRIES) {
+		err = -EINVAL;
+		err_info("Invalid ring size: %u, %u\n",
+					param.sq_entries, param.cq_entries);
+		return err;
+	}
+
+	sq_entries = roundup_pow_of_two(param.sq_entries);
+	cq_entries = roundup_pow_of_two(max(param.cq_entries, sq_entries));
+	ring = alloc_ring(sq_entries, cq_entries, &param);
+	if(!ring) {
+		err = -ENOMEM;
+		err_info("Failed to alloc rings\n");
+		return err;
+	}
+
+	if(cmpxchg(&filep->private_data, NULL, ring)) {
+		err = -EBUSY;
+		goto err_busy;
+	}
+
+	ring->worker = kthread_run(ring_worker, ring, "demo_ring/%d", current->tgid);
+	if(IS_ERR(ring->worker)) {
+		err = (int)PTR_ERR(ring->worker);
+		err_info("Failed to start ring worker\n");
+		goto err_worker;
+	}
+
+	if(copy_to_user(uparam, &param, sizeof(param))) {
+		err = -EFAULT;
+		err_info("Failed to copy to user\n");
+	}
+
+	return err;
+
+err_worker:
+	filep->private_data = NULL;
+err_busy:
+	free_ring(ring);
+	return err;
+}
+
+long ring_enter(struct file *filep, struct ring_enter_param __user *uparam) {
+	struct xfer_ring *ring = filep->private_data;
+	struct ring_enter_param param;
+	u32 min_complete;
+
+	if(!ring)
+		return -EINVAL;
+
+	if(copy_from_user(&param, uparam, sizeof(param))) {
+		err_info("Failed to copy from user\n");
+		return -EFAULT;
+	}
+
+	if(param.flags & RING_ENTER_F_WAKEUP) {
+		WRITE_ONCE(ring->wakeup, true);
+		wake_up(&ring->worker_wq);
+	}
+
+	if(!(param.flags & RING_ENTER_F_GETEVENTS))
+		return 0;
+
+	min_complete = min(param.min_complete, ring->cq_entries);
+	return wait_event_interruptible(ring->cq_wq,
+			smp_load_acquire(&ring->hdr->cq_tail) -
+			READ_ONCE(ring->hdr->cq_head) >= min_complete);
+}
+
+int ring_mmap(struct file *filep, struct vm_area_struct *vma) {
+	struct xfer_ring *ring = filep->private_data;
+
+	if(!ring)
+		return -EINVAL;
+	if(vma->vm_pgoff || vma->vm_end - vma->vm_start > ring->size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+/*
+ * The mappings of the rings hold a reference to the file, so they are gone
+ * by now; the worker is stopped and the transfers in flight, which hold a
+ * reference to the ring each, are waited for.
+ */
+void ring_release(struct file *filep) {
+	struct xfer_ring *ring = filep->private_data;
+
+	if(!ring)
+		return;
+
+	kthread_stop(ring->worker);
+	if(!atomic_dec_and_test(&ring->refs))
+		wait_for_completion(&ring->done);
+	free_ring(ring);
+	filep->private_data = NULL;
+}
+
+int init_ring_wq(void) {
+	ring_wq = alloc_workqueue("demo_rdma_xfer", WQ_UNBOUND, 0);
+	if(!ring_wq) {
+		err_info("Failed to alloc transfer workqueue\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void destroy_ring_wq(void) {
+	destroy_workqueue(ring_wq);
+}
@@ -0,0 +1,18 @@
+#ifndef __KERN_RING_H__
+#define __KERN_RING_H__
+
+#include <linux/fs.h>
+#include <linux/mm_types.h>
+#include "common.h"
+
+extern int init_ring_wq(void);
+extern void destroy_ring_wq(void);
+
+extern long ring_setup(struct file *filep,
+			struct ring_setup_param __user *uparam);
+extern long ring_enter(struct file *filep,
+			struct ring_enter_param __user *uparam);
+extern int ring_mmap(struct file *filep, struct vm_area_struct *vma);
+extern void ring_release(struct file *filep);
+
+#endif
@@ -1,50 +1,374 @@
 #include <linux/sched/mm.h>
 #include <linux/sched/signal.h>
-#include <linux/rwlock.h>
-#include <linux/list.h>
+#include <linux/xarray.h>
+#include <linux/rculist.h>
+#include <linux/hashtable.h>
+#include <linux/spinlock.h>
+#include <linux/slab.h>
 #include <linux/highmem.h>
 #include "kern_sg.h"
+#include "kern_stats.h"
+#include "kern_trace.h"
+#include "../common/demo_compat.h"
 #include "common.h"
 
+/*
+ * Every sg list and kmap table is an entry of the registry, indexed by its
+ * handle in sg_tbl_xa, and linked into the group of the mm that pinned it,
+ * hashed in sg_group_ht. Threads and io-wq workers share the mm of the
+ * process, so they see the same entries, and a group holds a reference on
+ * its mm, so that the mm cannot be reused while the group matches it. The
+ * sg list a transfer leaves pinned is also hashed by range in sg_range_ht,
+ * for the unpin that names it by address. Lookups run under RCU; only
+ * adding and removing entries takes sg_group_lock, which covers the
+ * groups and both hash tables.
+ *
+ * Whoever uses or frees an entry holds its busy bit, so that an entry
+ * found under RCU stays valid after it. A pinned sg list is busy from the
+ * start, and its owner only lets it go by registering or parking it.
+ *
+ * Registering or parking an entry ties it to the file it was done
+ * through, and it is freed with that file. The mm is only the scope of
+ * the lookups: a file of the process may use the registrations of another
+ * one, but its release leaves them alone.
+ */
 struct sg_tbl_entry {
 	struct sg_table				sg_tbl;
 	struct kmap_table			*kaddr_tbl;
-	pid_t						pid;
 	struct mm_struct			*mm;
+	struct file					*owner;
 	struct list_head			ent;
+	struct hlist_node			range;
 	unsigned long				npages;
+	unsigned long				virtaddr;
+	unsigned long				length;
+	int							access;
+	u32							handle;
+	u64							id;
+	unsigned long				flags;
+	void						(*release)(void *priv);
+	void						*priv;
+	struct rcu_head				rcu;
 };
 
-static struct list_head sg_tbl_list;
-static rwlock_t rwlock;
+/* Bits of sg_tbl_entry.flags */
+#define SG_ENT_REGISTERED				0
+#define SG_ENT_BUSY						1
+#define SG_ENT_PREMAPPED				2
+#define SG_ENT_ORPHANED					3
+
+struct sg_tbl_group {
+	struct mm_struct			*mm;
+	struct hlist_node			node;
+	struct list_head			ents;
+	struct rcu_head				rcu;
+};
+
+static struct xarray sg_tbl_xa;
+static DEFINE_HASHTABLE(sg_group_ht, 6);
+static DEFINE_HASHTABLE(sg_range_ht, 8);
+static DEFINE_SPINLOCK(sg_group_lock);
+static u32 next_handle;
 
 void init_sg_tbl_list(void) {
-	INIT_LIST_HEAD(&sg_tbl_list);
-	rwlock_init(&rwlock);
+	xa_init_flags(&sg_tbl_xa, XA_FLAGS_ALLOC1);
+}
+
+/* Under sg_group_lock or RCU */
+static struct sg_tbl_group *find_sg_tbl_group(const struct mm_struct *mm) {
+	struct sg_tbl_group *group;
+
+	hash_for_each_possible_rcu(sg_group_ht, group, node, (unsigned long)mm) {
+		if(group->mm == mm)
+			return group;
+	}
+	return NULL;
+}
+
+static int add_sg_tbl_ent(struct sg_tbl_entry *sg_tbl_ent) {
+	struct sg_tbl_group *group, *new_group;
+	int err = 0;
+
+	new_group = kzalloc(sizeof(*new_group), GFP_KERNEL);
+	if(!new_group) {
+		return -ENOMEM;
+	}
+	new_group->mm = sg_tbl_ent->mm;
+	INIT_LIST_HEAD(&new_group->ents);
+
+	/* Handles are not reused right away, so a stale one rarely matches */
+	err = xa_alloc_cyclic(&sg_tbl_xa, &sg_tbl_ent->handle, sg_tbl_ent,
+				xa_limit_32b, &next_handle, GFP_KERNEL);
+	if(err < 0) {
+		kfree(new_group);
+		return err;
+	}
+
+	spin_lock(&sg_group_lock);
+	group = find_sg_tbl_group(sg_tbl_ent->mm);
+	if(!group) {
+		mmgrab(new_group->mm);
+		hash_add_rcu(sg_group_ht, &new_group->node,
+					(unsigned long)new_group->mm);
+		group = new_group;
+		new_group = NULL;
+	}
+	list_add_tail_rcu(&sg_tbl_ent->ent, &group->ents);
+	spin_unlock(&sg_group_lock);
+
+	kfree(new_group);
+	return 0;
 }
 
-static struct sg_tbl_entry *get_list_ent_from_pid(pid_t pid) {
+/* The entry itself is freed by the caller, after an RCU grace period */
+static void del_sg_tbl_ent(struct sg_tbl_entry *sg_tbl_ent) {
+	struct sg_tbl_group *group;
+
+	xa_erase(&sg_tbl_xa, sg_tbl_ent->handle);
+
+	spin_lock(&sg_group_lock);
+	list_del_rcu(&sg_tbl_ent->ent);
+	if(!hlist_unhashed(&sg_tbl_ent->range))
+		hash_del_rcu(&sg_tbl_ent->range);
+	group = find_sg_tbl_group(sg_tbl_ent->mm);
+	if(group && list_empty(&group->ents))
+		hash_del_rcu(&group->node);
+	else
+		group = NULL;
+	spin_unlock(&sg_group_lock);
+
+	if(group) {
+		mmdrop(group->mm);
+		kfree_rcu(group, rcu);
+	}
+}
+
+static unsigned long range_key(const struct mm_struct *mm,
+				unsigned long virtaddr, unsigned long length) {
+	return virtaddr ^ length ^ (unsigned long)mm;
+}
+
+/*
+ * Leaves the sg list pinned after the transfer that pinned it, until it is
+ * unpinned by range or owner is released.
+ */
+void park_sg_tbl(struct sg_table *sgtbl, struct file *owner) {
 	struct sg_tbl_entry *sg_tbl_ent;
 
-	read_lock(&rwlock);
-	list_for_each_entry(sg_tbl_ent, &sg_tbl_list, ent) {
-		if(sg_tbl_ent->pid == pid) {
+	sg_tbl_ent = container_of(sgtbl, struct sg_tbl_entry, sg_tbl);
+	sg_tbl_ent->owner = owner;
+	spin_lock(&sg_group_lock);
+	hash_add_rcu(sg_range_ht, &sg_tbl_ent->range,
+				range_key(sg_tbl_ent->mm, sg_tbl_ent->virtaddr,
+							sg_tbl_ent->length));
+	spin_unlock(&sg_group_lock);
+	clear_bit_unlock(SG_ENT_BUSY, &sg_tbl_ent->flags);
+}
+
+/*
+ * Takes the busy bit of a parked sg list of mm for the range. Several
+ * may have been left for the same range; a busy one is skipped, and only
+ * makes the lookup fail with -EBUSY if no other is found.
+ */
+struct sg_table *claim_sg_tbl_by_range(const struct mm_struct *mm,
+				unsigned long virtaddr, unsigned long length) {
+	struct sg_tbl_entry *sg_tbl_ent;
+	struct sg_table *sgtbl = ERR_PTR(-ENOENT);
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(sg_range_ht, sg_tbl_ent, range,
+				range_key(mm, virtaddr, length)) {
+		if(sg_tbl_ent->mm != mm || sg_tbl_ent->virtaddr != virtaddr ||
+					sg_tbl_ent->length != length)
+			continue;
+		if(!test_and_set_bit_lock(SG_ENT_BUSY, &sg_tbl_ent->flags)) {
+			sgtbl = &sg_tbl_ent->sg_tbl;
 			break;
 		}
+		sgtbl = ERR_PTR(-EBUSY);
 	}
+	rcu_read_unlock();
+	return sgtbl;
+}
 
-	if(&sg_tbl_ent->ent == &sg_tbl_list) {
-		sg_tbl_ent = NULL;
+/*
+ * Turns the sg list into a registration that outlives the transfers
+ * using it, until it is deregistered or owner is released, and returns
+ * the handle they refer to it by.
+ */
+u64 register_sg_tbl(struct sg_table *sgtbl, struct file *owner) {
+	struct sg_tbl_entry *sg_tbl_ent;
+
+	sg_tbl_ent = container_of(sgtbl, struct sg_tbl_entry, sg_tbl);
+	sg_tbl_ent->owner = owner;
+	set_bit(SG_ENT_REGISTERED, &sg_tbl_ent->flags);
+	clear_bit_unlock(SG_ENT_BUSY, &sg_tbl_ent->flags);
+	return sg_tbl_ent->handle;
+}
+
+/*
+ * Looks the registration up and takes its busy bit. Whoever holds the bit
+ * is the only one allowed to use or free the entry, so it stays valid
+ * after the RCU read side section.
+ */
+static struct sg_tbl_entry *claim_sg_tbl_ent(const struct mm_struct *mm,
+				u64 handle) {
+	struct sg_tbl_entry *sg_tbl_ent;
+
+	if(handle > U32_MAX)
+		return ERR_PTR(-ENOENT);
+
+	rcu_read_lock();
+	sg_tbl_ent = xa_load(&sg_tbl_xa, handle);
+	if(!sg_tbl_ent || sg_tbl_ent->mm != mm ||
+				!test_bit(SG_ENT_REGISTERED, &sg_tbl_ent->flags))
+		sg_tbl_ent = ERR_PTR(-ENOENT);
+	else if(test_and_set_bit_lock(SG_ENT_BUSY, &sg_tbl_ent->flags))
+		sg_tbl_ent = ERR_PTR(-EBUSY);
+	rcu_read_unlock();
+	return sg_tbl_ent;
+}
+
+/*
+ * Takes exclusive use of a registration for one transfer: the DMA
+ * mapping of a transfer lives in the sg list itself.
+ */
+struct sg_table *acquire_sg_tbl(const struct mm_struct *mm, u64 handle,
+				unsigned long *p_length, int *p_access) {
+	struct sg_tbl_entry *sg_tbl_ent;
+
+	sg_tbl_ent = claim_sg_tbl_ent(mm, handle);
+	if(IS_ERR(sg_tbl_ent))
+		return ERR_CAST(sg_tbl_ent);
+
+	*p_length = sg_tbl_ent->length;
+	*p_access = sg_tbl_ent->access;
+	return &sg_tbl_ent->sg_tbl;
+}
+
+/*
+ * Sets up an sg list of nents entries that the caller fills with pages it
+ * owns and their DMA addresses, such as a buffer of a device pool. Once
+ * registered, it is used and freed like any other registration, but its
+ * pages are neither pinned nor unpinned: release(priv) is called instead.
+ */
+struct sg_table *alloc_premapped_sg_tbl(unsigned int nents,
+				unsigned long length, void (*release)(void *priv), void *priv) {
+	struct sg_tbl_entry *sg_tbl_ent;
+
+	sg_tbl_ent = kzalloc(sizeof(*sg_tbl_ent), GFP_KERNEL);
+	if(!sg_tbl_ent)
+		return NULL;
+
+	if(sg_alloc_table(&sg_tbl_ent->sg_tbl, nents, GFP_KERNEL)) {
+		kfree(sg_tbl_ent);
+		return NULL;
+	}
+
+	sg_tbl_ent->mm = current->mm;
+	mmgrab(sg_tbl_ent->mm);
+	sg_tbl_ent->length = length;
+	sg_tbl_ent->access = ACCESS_BIDIRECTIONAL;
+	sg_tbl_ent->release = release;
+	sg_tbl_ent->priv = priv;
+	__set_bit(SG_ENT_PREMAPPED, &sg_tbl_ent->flags);
+	return &sg_tbl_ent->sg_tbl;
+}
+
+/* On failure, the sg list is freed without calling release */
+int register_premapped_sg_tbl(struct sg_table *sgtbl, struct file *owner,
+				u64 *p_handle) {
+	struct sg_tbl_entry *sg_tbl_ent;
+	int err = 0;
+
+	sg_tbl_ent = container_of(sgtbl, struct sg_tbl_entry, sg_tbl);
+	sg_tbl_ent->owner = owner;
+	set_bit(SG_ENT_REGISTERED, &sg_tbl_ent->flags);
+	err = add_sg_tbl_ent(sg_tbl_ent);
+	if(err) {
+		sg_free_table(sgtbl);
+		mmdrop(sg_tbl_ent->mm);
+		kfree(sg_tbl_ent);
+		return err;
 	}
 
-	read_unlock(&rwlock);
+	*p_handle = sg_tbl_ent->handle;
+	return err;
+}
+
+/* The priv of a premapped sg list, NULL for pinned user memory */
+void *sg_tbl_priv(const struct sg_table *sgtbl) {
+	const struct sg_tbl_entry *sg_tbl_ent;
+
+	sg_tbl_ent = container_of(sgtbl, struct sg_tbl_entry, sg_tbl);
+	return sg_tbl_ent->priv;
+}
+
+/*
+ * Lets the registration go after a transfer. If its owner was released in
+ * the meantime, whichever of the two takes the busy bit last frees it.
+ */
+void release_sg_tbl(struct sg_table *sgtbl) {
+	struct sg_tbl_entry *sg_tbl_ent;
+	bool orphaned;
+
+	sg_tbl_ent = container_of(sgtbl, struct sg_tbl_entry, sg_tbl);
+	rcu_read_lock();
+	clear_bit_unlock(SG_ENT_BUSY, &sg_tbl_ent->flags);
+	smp_mb__after_atomic();
+	orphaned = (test_bit(SG_ENT_ORPHANED, &sg_tbl_ent->flags) &&
+				!test_and_set_bit_lock(SG_ENT_BUSY, &sg_tbl_ent->flags));
+	rcu_read_unlock();
+
+	if(orphaned)
+		free_sg_list(sgtbl);
+}
+
+int free_sg_tbl_by_handle(const struct mm_struct *mm, u64 handle) {
+	struct sg_tbl_entry *sg_tbl_ent;
+
+	sg_tbl_ent = claim_sg_tbl_ent(mm, handle);
+	if(IS_ERR(sg_tbl_ent))
+		return (int)PTR_ERR(sg_tbl_ent);
+
+	free_sg_list(&sg_tbl_ent->sg_tbl);
+	return 0;
+}
+
+/*
+ * Takes the busy bit of the next entry of owner from *p_index on. One that
+ * is held is marked orphaned instead, for its holder to free.
+ */
+static struct sg_tbl_entry *claim_owned_sg_tbl_ent(const struct file *owner,
+				unsigned long *p_index) {
+	struct sg_tbl_entry *sg_tbl_ent;
+
+	rcu_read_lock();
+	for(sg_tbl_ent = xa_find(&sg_tbl_xa, p_index, ULONG_MAX, XA_PRESENT);
+				sg_tbl_ent;
+				sg_tbl_ent = xa_find_after(&sg_tbl_xa, p_index,
+							ULONG_MAX, XA_PRESENT)) {
+		if(sg_tbl_ent->owner != owner)
+			continue;
+		set_bit(SG_ENT_ORPHANED, &sg_tbl_ent->flags);
+		if(!test_and_set_bit_lock(SG_ENT_BUSY, &sg_tbl_ent->flags))
+			break;
+	}
+	rcu_read_unlock();
 	return sg_tbl_ent;
 }
 
-struct sg_table *get_sg_tbl_from_pid(pid_t pid) {
+/*
+ * Frees the entries owner registered or parked. It does not depend on the
+ * task that drops the last reference to the file, which may be a kworker
+ * without an mm.
+ */
+void free_owned_sg_tbls(const struct file *owner) {
 	struct sg_tbl_entry *sg_tbl_ent;
-	sg_tbl_ent = get_list_ent_from_pid(pid);
-	return sg_tbl_ent? (&sg_tbl_ent->sg_tbl): NULL;
+	unsigned long index = 0;
+
+	while((sg_tbl_ent = claim_owned_sg_tbl_ent(owner, &index)))
+		free_sg_list(&sg_tbl_ent->sg_tbl);
 }
 
 static inline bool addr_int_overflow(unsigned long virt_addr, size_t length) {
@@ -62,15 +386,21 @@ static inline unsigned long pg_offset(unsigned long addr) {
 	return (addr & (~PAGE_MASK));
 }
 
+static inline unsigned int access_to_gup_flags(int access) {
+	return (access == ACCESS_READ_ONLY)? 0: (FOLL_WRITE | FOLL_FORCE);
+}
+
 static int get_pagelist_and_pin(unsigned long virt_addr, size_t length,
-		struct page ***p_page_list, unsigned long *p_npages) {
+		int access, u64 id, struct page ***p_page_list, unsigned long *p_npages) {
+	ktime_t start = ktime_get();
 	struct mm_struct *mm;
 	struct page **page_list;
 	unsigned long lock_limit;
 	unsigned long new_pinned;
 	unsigned long cur_base;
 	unsigned long npages;
-	unsigned int gup_flags = FOLL_WRITE;
+	unsigned long pinned;
+	unsigned int gup_flags;
 	int err = 0;
 
 	if(!p_page_list || !p_npages) {
@@ -82,6 +412,13 @@ static int get_pagelist_and_pin(unsigned long virt_addr, size_t length,
 	*p_page_list = NULL;
 	*p_npages = 0;
 
+	if(access < ACCESS_BIDIRECTIONAL || access > ACCESS_WRITE_ONLY) {
+		err = -EINVAL;
+		err_info("invalid access direction: %d\n", access);
+		return err;
+	}
+	gup_flags = access_to_gup_flags(access);
+
 	if(addr_int_overflow(virt_addr, length)) {
 		err = -EINVAL;
 		err_info("address integer overflow\n");
@@ -94,21 +431,21 @@ static int get_pagelist_and_pin(unsigned long virt_addr, size_t length,
 		return err;
 	}
 
+	npages = get_npages(virt_addr, length);
+	if(npages == 0 || npages > UINT_MAX) {
+		err = -EINVAL;
+		err_info("Page range overflow\n");
+		return err;
+	}
+
 	mm = current->mm;
 	mmgrab(mm);
 
-	page_list = (struct page **)__get_free_page(GFP_KERNEL);
+	page_list = kvmalloc_array(npages, sizeof(*page_list), GFP_KERNEL);
 	if(!page_list) {
 		err = -ENOMEM;
-		err_info("Failed to get free page\n");
-		goto err_get_free_page;
-	}
-
-	npages = get_npages(virt_addr, length);
-	if(npages == 0 || npages > UINT_MAX) {
-		err = -EINVAL;
-		err_info("Page range overflow\n");
-		goto err_npages;
+		err_info("Failed to alloc page list\n");
+		goto err_alloc_page_list;
 	}
 
 	lock_limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
@@ -120,33 +457,36 @@ static int get_pagelist_and_pin(unsigned long virt_addr, size_t length,
 	}
 
 	cur_base = virt_addr & PAGE_MASK;
-	*p_npages = npages;
-	while(npages) {
-		down_read(&mm->mmap_sem);
-		err = get_user_pages(cur_base, npages,
-						gup_flags | FOLL_FORCE, page_list, NULL);
+	pinned = 0;
+	while(pinned < npages) {
+		mmap_read_lock(mm);
+		err = pin_pages(cur_base, npages - pinned,
+						gup_flags, page_list + pinned);
+		mmap_read_unlock(mm);
 		if(err < 0) {
 			err_info("Failed to get user pages\n");
-			up_read(&mm->mmap_sem);
 			goto err_get_upages;
 		}
 
 		cur_base += err * PAGE_SIZE;
-		npages -= err;
-		up_read(&mm->mmap_sem);
+		pinned += err;
 	}
 
 	err = 0;
 	*p_page_list = page_list;
+	*p_npages = npages;
+	trace_demo_pin(id, virt_addr, length, npages, start, err);
 	return err;
 
 err_get_upages:
+	while(pinned)
+		unpin_page(page_list[--pinned]);
 err_npages_pinned:
 	atomic64_sub(npages, (atomic64_t*)&mm->pinned_vm);
-err_npages:
-	free_page((unsigned long)page_list);
-err_get_free_page:
+	kvfree(page_list);
+err_alloc_page_list:
 	mmdrop(mm);
+	trace_demo_pin(id, virt_addr, length, npages, start, err);
 	return err;
 }
 
@@ -159,22 +499,75 @@ static void free_page_list(struct page **pagelist,
 
 	if(unpin) {
 		for(i = 0; i < npages; i++) {
-			put_page(pagelist[i]);
+			unpin_page(pagelist[i]);
 		}
 		atomic64_sub(npages, (atomic64_t*)&current->mm->pinned_vm);
 		mmdrop(current->mm);
 	}
-	free_page((unsigned long)pagelist);
+	kvfree(pagelist);
+}
+
+/*
+ * Walks the pinned pages and merges physically consecutive ones into runs
+ * of at most max_seg_sz bytes. The first run starts at the offset of
+ * virtaddr in its page and the last one stops at virtaddr + length, so the
+ * entries are byte-accurate. With sgl == NULL, only the runs are counted,
+ * which sizes the sg table before it is allocated.
+ */
+static unsigned int walk_sg_runs(struct page **page_list, size_t npages,
+				unsigned long virtaddr, unsigned long length,
+				unsigned int max_seg_sz, struct scatterlist *sgl) {
+	struct scatterlist *sg = NULL;
+	unsigned long offset = pg_offset(virtaddr);
+	unsigned long remaining = length;
+	unsigned long run_len = 0;
+	unsigned int nents = 0;
+	size_t i;
+
+	for(i = 0; i < npages; i++) {
+		unsigned long len = min_t(unsigned long, PAGE_SIZE - offset, remaining);
+		bool merge = (i > 0 &&
+				page_to_pfn(page_list[i]) == page_to_pfn(page_list[i-1]) + 1 &&
+				run_len + len <= max_seg_sz);
+
+		if(merge) {
+			run_len += len;
+			if(sg)
+				sg->length = run_len;
+		}
+		else {
+			nents++;
+			run_len = len;
+			if(sgl) {
+				sg = sg? sg_next(sg): sgl;
+				sg_set_page(sg, page_list[i], len, offset);
+			}
+		}
+
+		offset = 0;
+		remaining -= len;
+	}
+
+	if(sg)
+		sg_mark_end(sg);
+	return nents;
 }
 
+/*
+ * id tags the trace events of the pinning, see kern_trace.h. The sg list
+ * is returned busy, and belongs to the caller until it is freed,
+ * registered or parked.
+ */
 int get_sg_list(unsigned long virtaddr, unsigned long length,
-			unsigned int max_seg_sz, struct sg_table **pp_sg_head) {
+			int access, unsigned int max_seg_sz, u64 id,
+			struct sg_table **pp_sg_head) {
 	struct page **page_list;
 	struct sg_tbl_entry *sg_tbl_ent;
 	struct sg_table *p_sg_head;
-	struct scatterlist *sg;
-	size_t npages, i;
-	int n_sg_ent = 0;
+	size_t npages;
+	unsigned int n_sg_ent;
+	ktime_t start = ktime_get();
+	ktime_t sg_start;
 	int err = 0;
 
 	if(!pp_sg_head) {
@@ -183,11 +576,13 @@ int get_sg_list(unsigned long virtaddr, unsigned long length,
 		return err;
 	}
 
-	err = get_pagelist_and_pin(virtaddr, length, &page_list, &npages);
+	err = get_pagelist_and_pin(virtaddr, length, access, id,
+					&page_list, &npages);
 	if(err) {
 		err_info("Failed to get pagelist\n");
 		return err;
 	}
+	sg_start = ktime_get();
 
 	sg_tbl_ent = kzalloc(sizeof(*sg_tbl_ent), GFP_KERNEL);
 	if(!sg_tbl_ent) {
@@ -196,47 +591,41 @@ int get_sg_list(unsigned long virtaddr, unsigned long length,
 		goto err_alloc_tbl_ent;
 	}
 
-	sg_tbl_ent->pid = current->pid;
 	sg_tbl_ent->mm = current->mm;
+	sg_tbl_ent->npages = npages;
+	sg_tbl_ent->id = id;
+	sg_tbl_ent->virtaddr = virtaddr;
+	sg_tbl_ent->length = length;
+	sg_tbl_ent->access = access;
+	__set_bit(SG_ENT_BUSY, &sg_tbl_ent->flags);
 	p_sg_head = &sg_tbl_ent->sg_tbl;
-	err = sg_alloc_table(p_sg_head, npages, GFP_KERNEL);
+	n_sg_ent = walk_sg_runs(page_list, npages, virtaddr, length,
+						max_seg_sz, NULL);
+	err = sg_alloc_table(p_sg_head, n_sg_ent, GFP_KERNEL);
 	if(err) {
 		err_info("Failed to alloc sg table\n");
 		goto err_alloc_sg;
 	}
 
-	sg = NULL;
-	while(i < npages) {
-		unsigned long n_cont_page;
-		struct page *cur_page = page_list[i];
-		unsigned long cur_pfn = page_to_pfn(page_list[i]);
-		bool is_first = (i == 0);
-
-		sg = is_first? p_sg_head->sgl: sg_next(sg);
-
-		for(n_cont_page = 0;
-					i < npages && n_cont_page < (max_seg_sz >> PAGE_SHIFT);
-					i++, n_cont_page++) {
-			unsigned long end_pfn = page_to_pfn(page_list[i]);
-			if(cur_pfn + n_cont_page != end_pfn) {
-				break;
-			}
-		}
-
-		sg_set_page(sg, cur_page, n_cont_page << PAGE_SHIFT, 0);
-
-		n_sg_ent++;
+	walk_sg_runs(page_list, npages, virtaddr, length,
+						max_seg_sz, p_sg_head->sgl);
+	err = add_sg_tbl_ent(sg_tbl_ent);
+	if(err) {
+		err_info("Failed to add sg tbl entry\n");
+		goto err_add_ent;
 	}
 
-	sg_mark_end(sg);
-	p_sg_head->nents = n_sg_ent;
 	free_page_list(page_list, npages, false);
-	write_lock(&rwlock);
-	list_add_tail(&sg_tbl_ent->ent, &sg_tbl_list);
-	write_unlock(&rwlock);
 	*pp_sg_head = p_sg_head;
+	trace_demo_sg(id, npages, n_sg_ent, sg_start);
+
+	stats_add(module_stats, pages_pinned, npages);
+	stats_add(module_stats, sg_ents, n_sg_ent);
+	stats_hist_since(module_stats, STATS_HIST_PIN, start);
 	return err;
 
+err_add_ent:
+	sg_free_table(p_sg_head);
 err_alloc_sg:
 	kfree(sg_tbl_ent);
 err_alloc_tbl_ent:
@@ -244,12 +633,51 @@ err_alloc_tbl_ent:
 	return err;
 }
 
+/*
+ * Counts the entries get_sg_list would build for the range, and unpins it
+ * right away. The pages are pinned with the same flags, so a buffer that
+ * will be written is not counted as the zero page.
+ */
+int count_sg_ents(unsigned long virtaddr, unsigned long length,
+			int access, unsigned int max_seg_sz, unsigned int *p_nents) {
+	struct page **page_list;
+	unsigned long npages;
+	int err = 0;
+
+	err = get_pagelist_and_pin(virtaddr, length, access, 0,
+					&page_list, &npages);
+	if(err) {
+		err_info("Failed to get pagelist\n");
+		return err;
+	}
+
+	*p_nents = walk_sg_runs(page_list, npages, virtaddr, length,
+						max_seg_sz, NULL);
+	free_page_list(page_list, npages, true);
+	return err;
+}
+
 void free_sg_list(const struct sg_table *sg_head) {
 	int i;
 	int npages = 0;
 	struct scatterlist *sg;
 	struct sg_tbl_entry *sg_tbl_ent;
 	struct mm_struct *mm;
+	ktime_t start = ktime_get();
+	unsigned int nents = sg_head->nents;
+	bool dirty;
+
+	sg_tbl_ent = container_of(sg_head, struct sg_tbl_entry, sg_tbl);
+	if(test_bit(SG_ENT_PREMAPPED, &sg_tbl_ent->flags)) {
+		del_sg_tbl_ent(sg_tbl_ent);
+		sg_free_table((struct sg_table*)sg_head);
+		sg_tbl_ent->release(sg_tbl_ent->priv);
+		mmdrop(sg_tbl_ent->mm);
+		kfree_rcu(sg_tbl_ent, rcu);
+		return;
+	}
+
+	dirty = (sg_tbl_ent->access != ACCESS_READ_ONLY);
 
 	for_each_sg(sg_head->sgl, sg, sg_head->nents, i) {
 		unsigned long cur_pfn = page_to_pfn(sg_page(sg));
@@ -257,26 +685,32 @@ void free_sg_list(const struct sg_table *sg_head) {
 		int j;
 		npages += cur_npg;
 		for(j = 0; j < cur_npg; j++) {
-			put_page(pfn_to_page(cur_pfn + j));
+			struct page *pg = pfn_to_page(cur_pfn + j);
+			if(dirty)
+				set_page_dirty_lock(pg);
+			unpin_page(pg);
 		}
 	}
 
 	sg_free_table((struct sg_table*)sg_head);
 
-	sg_tbl_ent = container_of(sg_head, struct sg_tbl_entry, sg_tbl);
 	mm = sg_tbl_ent->mm;
 	atomic64_sub(npages, (atomic64_t*)&mm->pinned_vm);
 	mmdrop(mm);
+	trace_demo_unpin(sg_tbl_ent->id, npages, nents, start);
 
-	write_lock(&rwlock);
-	list_del(&sg_tbl_ent->ent);
-	write_unlock(&rwlock);
+	del_sg_tbl_ent(sg_tbl_ent);
+	kfree_rcu(sg_tbl_ent, rcu);
+
+	stats_add(module_stats, pages_unpinned, npages);
+	stats_hist_since(module_stats, STATS_HIST_TEARDOWN, start);
 }
 
-struct kmap_table **get_kmap_table_from_pid(pid_t pid) {
-	struct sg_tbl_entry *sg_tbl_ent;
-	sg_tbl_ent = get_list_ent_from_pid(pid);
-	return sg_tbl_ent? (&sg_tbl_ent->kaddr_tbl): NULL;
+unsigned long sg_tbl_npages(const struct sg_table *sg_head) {
+	const struct sg_tbl_entry *sg_tbl_ent;
+
+	sg_tbl_ent = container_of(sg_head, struct sg_tbl_entry, sg_tbl);
+	return sg_tbl_ent->npages;
 }
 
 int kmap_user_addr(unsigned long virtaddr, unsigned long length,
@@ -297,7 +731,8 @@ int kmap_user_addr(unsigned long virtaddr, unsigned long length,
 	*p_kmap_addr = NULL;
 	*p_npages = 0;
 
-	err = get_pagelist_and_pin(virtaddr, length, &page_list, p_npages);
+	err = get_pagelist_and_pin(virtaddr, length, ACCESS_BIDIRECTIONAL, 0,
+					&page_list, p_npages);
 	if(err) {
 		err_info("Failed to get page list\n");
 		return err;
@@ -310,9 +745,9 @@ int kmap_user_addr(unsigned long virtaddr, unsigned long length,
 		goto err_kmap_alloc;
 	}
 
-	tbl_entry->pid = current->pid;
 	tbl_entry->mm = current->mm;
 	tbl_entry->npages = (*p_npages);
+	tbl_entry->access = ACCESS_BIDIRECTIONAL;
 
 	kmap_addr = &tbl_entry->kaddr_tbl;
 	*kmap_addr = kzalloc(sizeof(**kmap_addr)*(*p_npages), GFP_KERNEL);
@@ -339,9 +774,11 @@ int kmap_user_addr(unsigned long virtaddr, unsigned long length,
 		(*kmap_addr)[i].length = cur_size;
 	}
 
-	write_lock(&rwlock);
-	list_add_tail(&tbl_entry->ent, &sg_tbl_list);
-	write_unlock(&rwlock);
+	err = add_sg_tbl_ent(tbl_entry);
+	if(err) {
+		err_info("Failed to add kmap tbl entry\n");
+		goto err_kmap;
+	}
 
 	free_page_list(page_list, *p_npages, false);
 	*p_kmap_addr = kmap_addr;
@@ -365,14 +802,12 @@ void free_kmap_table(struct kmap_table **kmap_tbl) {
 	tbl_entry = container_of(kmap_tbl, struct sg_tbl_entry, kaddr_tbl);
 	for(i = 0; i < tbl_entry->npages; i++) {
 		struct page *pg = virt_to_page((*kmap_tbl)[i].base);
-		put_page(pg);
+		unpin_page(pg);
 	}
 
 	mm = tbl_entry->mm;
 	atomic64_sub(tbl_entry->npages, (atomic64_t*)&mm->pinned_vm);
 	mmdrop(mm);
 
-	write_lock(&rwlock);
-	list_del(&tbl_entry->ent);
-	write_unlock(&rwlock);
+	del_sg_tbl_ent(tbl_entry);
 }
@@ -2,6 +2,11 @@
 #define __KERN_SG_H__
 
 #include <linux/scatterlist.h>
+#include <linux/dma-direction.h>
+#include "common.h"
+
+struct mm_struct;
+struct file;
 
 struct kmap_table {
 	void*							base;
@@ -10,20 +15,48 @@ struct kmap_table {
 };
 
 extern int get_sg_list(unsigned long virtaddr, unsigned long length,
-			unsigned int max_seg_sz, struct sg_table **pp_sg_head);
+			int access, unsigned int max_seg_sz, u64 id,
+			struct sg_table **pp_sg_head);
 extern void free_sg_list(const struct sg_table *sg_head);
+extern unsigned long sg_tbl_npages(const struct sg_table *sg_head);
+extern int count_sg_ents(unsigned long virtaddr, unsigned long length,
+			int access, unsigned int max_seg_sz, unsigned int *p_nents);
 
 extern void init_sg_tbl_list(void);
-extern struct sg_table *get_sg_tbl_from_pid(pid_t pid);
-extern struct kmap_table **get_kmap_table_from_pid(pid_t pid);
+extern void park_sg_tbl(struct sg_table *sgtbl, struct file *owner);
+extern struct sg_table *claim_sg_tbl_by_range(const struct mm_struct *mm,
+				unsigned long virtaddr, unsigned long length);
+
+extern u64 register_sg_tbl(struct sg_table *sgtbl, struct file *owner);
+extern struct sg_table *acquire_sg_tbl(const struct mm_struct *mm, u64 handle,
+				unsigned long *p_length, int *p_access);
+extern void release_sg_tbl(struct sg_table *sgtbl);
+extern struct sg_table *alloc_premapped_sg_tbl(unsigned int nents,
+				unsigned long length, void (*release)(void *priv), void *priv);
+extern int register_premapped_sg_tbl(struct sg_table *sgtbl,
+				struct file *owner, u64 *p_handle);
+extern void *sg_tbl_priv(const struct sg_table *sgtbl);
+extern int free_sg_tbl_by_handle(const struct mm_struct *mm, u64 handle);
+extern void free_owned_sg_tbls(const struct file *owner);
 
 extern int kmap_user_addr(unsigned long virtaddr, unsigned long length,
 			struct kmap_table ***p_kmap_addr, unsigned long *p_npages);
 extern void free_kmap_table(struct kmap_table **kmap_tbl);
 
+static inline enum dma_data_direction access_to_dma_dir(int access) {
+	switch(access) {
+	case ACCESS_READ_ONLY:
+		return DMA_TO_DEVICE;
+	case ACCESS_WRITE_ONLY:
+		return DMA_FROM_DEVICE;
+	default:
+		return DMA_BIDIRECTIONAL;
+	}
+}
+
 static inline u64 get_dma_address_from_sgtbl(
-				const struct sg_table *sg_head, unsigned long virtaddr) {
-	return sg_dma_address(sg_head->sgl) + (virtaddr & (~PAGE_MASK));
+				const struct sg_table *sg_head) {
+	return sg_dma_address(sg_head->sgl);
 }
 
 #endif
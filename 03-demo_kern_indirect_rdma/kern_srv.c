@@ -0,0 +1,1030 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/kthread.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/module.h>
+#include <linux/sizes.h>
+#include <linux/net.h>
+#include <linux/version.h>
+#include <net/sock.h>
+#include <net/net_namespace.h>
+#include <rdma/ib_verbs.h>
+#include <rdma/ib_cache.h>
+#include "kern_srv.h"
+#include "kern_conn.h"
+#include "kern_rdma.h"
+#include "kern_cq.h"
+#include "common.h"
+
+static unsigned int srv_buf_size = SZ_64K;
+module_param(srv_buf_size, uint, 0444);
+MODULE_PARM_DESC(srv_buf_size, "Bytes of each receive buffer of a server");
+
+static unsigned int srv_min_bufs = 64;
+module_param(srv_min_bufs, uint, 0444);
+MODULE_PARM_DESC(srv_min_bufs, "Receive buffers a server posts when it starts");
+
+static unsigned int srv_max_bufs = 1024;
+module_param(srv_max_bufs, uint, 0444);
+MODULE_PARM_DESC(srv_max_bufs, "Receive buffers a server grows its shared receive queue to");
+
+#define SRV_BACKLOG						64
+#define SRV_CREDIT_GRANT				16
+/* Receive buffers added to the SRQ at a time */
+#define SRV_GROW_STEP					64
+/* CQ entries reserved for the send queue and the SRQ receives of a QP */
+#define SESS_CQE						(2 * QP_MAX_WR)
+/*
+ * A client keeps QP_MAX_WR / 2 receives posted for credit messages, so a
+ * client is never granted more chunks than those messages cover.
+ */
+#define SESS_MAX_OUTSTANDING			((QP_MAX_WR / 2 - 2) * SRV_CREDIT_GRANT)
+#define SESS_SOCK_TIMEO					(5 * HZ)
+#define SESS_LAST_WQE_TIMEOUT_MS		1000
+
+/* A receive buffer of the SRQ, posted for as long as the server runs */
+struct srv_buf {
+	struct ib_cqe					cqe;
+	struct demo_srv					*srv;
+	void							*data;
+	u64								dma;
+};
+
+/*
+ * A client of a server: an RC QP that takes its receives from the SRQ of
+ * the server, and the TCP connection its QP was set up over and its
+ * transfers are announced on. The embedded connection only carries what
+ * bring_up_qp needs; it is not pooled.
+ *
+ * A transfer of nchunks chunks is granted credits as buffers of the SRQ
+ * become free, and is done when nchunks receives of the QP completed.
+ * granted is protected by the lock of the server; received is only
+ * touched by the completions of the QP.
+ */
+struct srv_sess {
+	struct rdma_conn				conn;
+	struct demo_srv					*srv;
+	struct list_head				ent;
+	struct list_head				wait_ent;
+	struct work_struct				work;
+	struct ib_cqe					credit_cqe;
+	struct completion				last_wqe;
+	void							(*saved_data_ready)(struct sock *sk);
+	void							(*saved_state_change)(struct sock *sk);
+
+	struct rdma_xfer_info			req;
+	size_t							req_len;
+	bool							active;
+	bool							dead;
+	u64								nchunks;
+	u64								granted;
+	u64								received;
+	u64								xfers;
+	u64								bytes;
+};
+
+/*
+ * A sink server. A kernel thread accepts clients on a listening socket;
+ * their QPs share one SRQ and complete on the CQ pool of the device, and
+ * the transfer announcements of all clients are read from the socket
+ * callbacks by works on an unbound workqueue, so the number of clients
+ * only costs a QP and a few hundred bytes each.
+ *
+ * The SRQ starts with srv_min_bufs buffers. avail counts the posted
+ * buffers no client has been promised; a client waiting for credits when
+ * there are none, or the SRQ running low (SRQ_LIMIT_REACHED), makes the
+ * server post more buffers, up to srv_max_bufs.
+ */
+struct demo_srv {
+	struct list_head				ent;
+	struct demo_dev					*dev;
+	struct net						*net;
+	struct sockaddr_in				addr;
+	int								rdma_port;
+	int								sgid_index;
+	struct socket					*sock;
+	struct task_struct				*thread;
+	u32								nr_sess;
+
+	struct ib_srq					*srq;
+	u32								buf_size;
+	struct srv_buf					*bufs;
+	u32								nr_bufs;
+	u32								max_bufs;
+	struct work_struct				grow_work;
+	bool							stopping;
+
+	spinlock_t						lock;
+	u32								avail;
+	struct list_head				waiters;
+	struct list_head				dead;
+	struct work_struct				reap_work;
+
+	struct mutex					sess_lock;
+	struct list_head				sessions;
+
+	atomic64_t						xfers;
+	atomic64_t						bytes;
+};
+
+static struct list_head srv_list;
+static struct mutex srv_mutex;
+static struct workqueue_struct *srv_wq;
+
+/* Called with the lock of the server held */
+static void __sess_kill(struct srv_sess *sess) {
+	struct demo_srv *srv = sess->srv;
+
+	if(sess->dead)
+		return;
+
+	WRITE_ONCE(sess->dead, true);
+	list_del_init(&sess->wait_ent);
+	list_add_tail(&sess->wait_ent, &srv->dead);
+	queue_work(srv_wq, &srv->reap_work);
+}
+
+static void sess_kill(struct srv_sess *sess) {
+	spin_lock(&sess->srv->lock);
+	__sess_kill(sess);
+	spin_unlock(&sess->srv->lock);
+}
+
+static int sess_post_credit(struct srv_sess *sess, u32 nr_credits) {
+	struct ib_send_wr wr = {};
+	const struct ib_send_wr *bad_wr;
+
+	wr.wr_cqe = &sess->credit_cqe;
+	wr.opcode = IB_WR_SEND_WITH_IMM;
+	wr.send_flags = IB_SEND_SIGNALED;
+	wr.ex.imm_data = cpu_to_be32(nr_credits);
+	return ib_post_send(sess->conn.lanes[0].qp, &wr, &bad_wr);
+}
+
+/*
+ * Promises the free buffers to the waiting clients, a credit message at a
+ * time, in the order they started waiting. When the first of them cannot
+ * be served, the SRQ grows.
+ */
+static void srv_grant(struct demo_srv *srv) {
+	struct srv_sess *sess, *tmp;
+	bool starved = false;
+
+	spin_lock(&srv->lock);
+	list_for_each_entry_safe(sess, tmp, &srv->waiters, wait_ent) {
+		u32 nr = min_t(u64, SRV_CREDIT_GRANT, sess->nchunks - sess->granted);
+
+		if(sess->granted - READ_ONCE(sess->received) + nr > SESS_MAX_OUTSTANDING)
+			continue;
+
+		if(srv->avail < nr) {
+			starved = true;
+			break;
+		}
+
+		if(sess_post_credit(sess, nr)) {
+			err_info("Failed to post credit message\n");
+			__sess_kill(sess);
+			continue;
+		}
+
+		srv->avail -= nr;
+		sess->granted += nr;
+		if(sess->granted == sess->nchunks)
+			list_del_init(&sess->wait_ent);
+	}
+	spin_unlock(&srv->lock);
+
+	if(starved && READ_ONCE(srv->nr_bufs) < srv->max_bufs &&
+				!READ_ONCE(srv->stopping))
+		queue_work(srv_wq, &srv->grow_work);
+}
+
+static int srv_post_buf(struct demo_srv *srv, struct srv_buf *buf) {
+	struct ib_recv_wr wr = {};
+	const struct ib_recv_wr *bad_wr;
+	struct ib_sge sge;
+
+	sge.addr = buf->dma;
+	sge.length = srv->buf_size;
+	sge.lkey = srv->dev->dma_mr->lkey;
+	wr.wr_cqe = &buf->cqe;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	return ib_post_srq_recv(srv->srq, &wr, &bad_wr);
+}
+
+/*
+ * A chunk of some client has landed in a buffer, which goes straight back
+ * to the SRQ: the server is a sink and only counts the bytes. The last
+ * chunk of a transfer lets the client announce its next one.
+ */
+static void srv_recv_done(struct ib_cq *cq, struct ib_wc *wc) {
+	struct srv_buf *buf = container_of(wc->wr_cqe, struct srv_buf, cqe);
+	struct demo_srv *srv = buf->srv;
+	struct srv_sess *sess = wc->qp->qp_context;
+	bool reposted;
+
+	if(wc->status == IB_WC_SUCCESS) {
+		sess->bytes += wc->byte_len;
+		atomic64_add(wc->byte_len, &srv->bytes);
+	}
+	else {
+		if(wc->status != IB_WC_WR_FLUSH_ERR)
+			err_info("wc not success, status: %s\n",
+					ib_wc_status_msg(wc->status));
+		sess_kill(sess);
+	}
+
+	reposted = !srv_post_buf(srv, buf);
+	if(!reposted)
+		err_info("Failed to repost receive buffer\n");
+
+	spin_lock(&srv->lock);
+	if(reposted)
+		srv->avail++;
+	spin_unlock(&srv->lock);
+
+	WRITE_ONCE(sess->received, sess->received + 1);
+	if(sess->active && sess->received == sess->nchunks) {
+		sess->xfers++;
+		atomic64_inc(&srv->xfers);
+		WRITE_ONCE(sess->active, false);
+		queue_work(srv_wq, &sess->work);
+	}
+
+	srv_grant(srv);
+}
+
+static void sess_credit_done(struct ib_cq *cq, struct ib_wc *wc) {
+	struct srv_sess *sess = wc->qp->qp_context;
+
+	if(wc->status == IB_WC_SUCCESS)
+		return;
+
+	if(wc->status != IB_WC_WR_FLUSH_ERR)
+		err_info("wc not success, status: %s\n",
+				ib_wc_status_msg(wc->status));
+	sess_kill(sess);
+}
+
+static int sess_recv_req(struct srv_sess *sess) {
+	struct kvec vec;
+	struct msghdr msg;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	vec.iov_base = (void*)&sess->req + sess->req_len;
+	vec.iov_len = sizeof(sess->req) - sess->req_len;
+	ret = kernel_recvmsg(sess->conn.client_sock, &msg, &vec, 1,
+				vec.iov_len, MSG_DONTWAIT);
+	if(ret == 0)
+		return -ECONNRESET;
+	if(ret < 0)
+		return ret;
+
+	sess->req_len += ret;
+	if(sess->req_len < sizeof(sess->req))
+		return -EAGAIN;
+
+	sess->req_len = 0;
+	return 0;
+}
+
+/*
+ * Answers an announced transfer the way a server running rdma_xfer would:
+ * the client sends chunks of at most one SRQ buffer each, and only
+ * against credits.
+ */
+static int sess_start_xfer(struct srv_sess *sess) {
+	struct demo_srv *srv = sess->srv;
+	struct rdma_xfer_info reply;
+	struct kvec vec;
+	struct msghdr msg;
+	u32 chunk_size;
+	int ret;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.chunk_size = srv->buf_size;
+	reply.length = sess->req.length;
+	reply.opcode = XFER_OP_SEND;
+	reply.credit_grant = SRV_CREDIT_GRANT;
+
+	memset(&msg, 0, sizeof(msg));
+	vec.iov_base = &reply;
+	vec.iov_len = sizeof(reply);
+	ret = kernel_sendmsg(sess->conn.client_sock, &msg, &vec, 1, sizeof(reply));
+	if(ret < (int)sizeof(reply)) {
+		err_info("msg error\n");
+		return -EPIPE;
+	}
+
+	/* The client gives up on any other opcode */
+	if(sess->req.opcode != XFER_OP_SEND) {
+		dbg_info("Client asked for opcode %u\n", sess->req.opcode);
+		return 0;
+	}
+
+	chunk_size = min(sess->req.chunk_size, srv->buf_size);
+	if(!chunk_size) {
+		err_info("Invalid chunk size\n");
+		return -EPROTO;
+	}
+
+	sess->nchunks = DIV_ROUND_UP(sess->req.length, chunk_size);
+	sess->received = 0;
+	if(!sess->nchunks) {
+		sess->xfers++;
+		atomic64_inc(&srv->xfers);
+		return 0;
+	}
+
+	spin_lock(&srv->lock);
+	sess->granted = 0;
+	WRITE_ONCE(sess->active, true);
+	if(!sess->dead)
+		list_add_tail(&sess->wait_ent, &srv->waiters);
+	spin_unlock(&srv->lock);
+
+	srv_grant(srv);
+	return 0;
+}
+
+/*
+ * Reads the announcements of the client from its socket without blocking.
+ * A transfer in progress holds the next one back; its last chunk queues
+ * the work again.
+ */
+static void sess_work(struct work_struct *work) {
+	struct srv_sess *sess = container_of(work, struct srv_sess, work);
+	int err;
+
+	while(!READ_ONCE(sess->dead) && !READ_ONCE(sess->active)) {
+		err = sess_recv_req(sess);
+		if(err == -EAGAIN)
+			return;
+
+		if(!err)
+			err = sess_start_xfer(sess);
+		if(err) {
+			if(err != -ECONNRESET)
+				err_info("Client failed, err: %d\n", err);
+			sess_kill(sess);
+			return;
+		}
+	}
+}
+
+static void sess_data_ready(struct sock *sk) {
+	struct srv_sess *sess;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	sess = sk->sk_user_data;
+	if(sess)
+		queue_work(srv_wq, &sess->work);
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void sess_install_callbacks(struct srv_sess *sess) {
+	struct sock *sk = sess->conn.client_sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sess->saved_data_ready = sk->sk_data_ready;
+	sess->saved_state_change = sk->sk_state_change;
+	sk->sk_user_data = sess;
+	sk->sk_data_ready = sess_data_ready;
+	sk->sk_state_change = sess_data_ready;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void sess_restore_callbacks(struct srv_sess *sess) {
+	struct sock *sk = sess->conn.client_sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_user_data = NULL;
+	sk->sk_data_ready = sess->saved_data_ready;
+	sk->sk_state_change = sess->saved_state_change;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void sess_qp_event(struct ib_event *event, void *context) {
+	struct srv_sess *sess = context;
+
+	if(event->event == IB_EVENT_QP_LAST_WQE_REACHED)
+		complete(&sess->last_wqe);
+	else
+		dbg_info("QP event: %s\n", ib_event_msg(event->event));
+}
+
+/*
+ * A QP on an SRQ is drained once the device has reported that it took
+ * its last receive (not every device does, hence the timeout), and a
+ * send posted after it moved to the error state has been flushed: by
+ * then every completion of the QP has been handled.
+ */
+static void sess_drain_qp(struct srv_sess *sess) {
+	struct ib_qp *qp = sess->conn.lanes[0].qp;
+	struct ib_qp_attr qp_attr = {
+		.qp_state		= IB_QPS_ERR,
+	};
+	struct ib_send_wr wr = {};
+	const struct ib_send_wr *bad_wr;
+	struct cq_waiter waiter;
+
+	if(ib_modify_qp(qp, &qp_attr, IB_QP_STATE))
+		return;
+
+	wait_for_completion_timeout(&sess->last_wqe,
+				msecs_to_jiffies(SESS_LAST_WQE_TIMEOUT_MS));
+
+	cq_waiter_init(&waiter, 1);
+	wr.wr_cqe = &waiter.cqe;
+	wr.opcode = IB_WR_SEND;
+	wr.send_flags = IB_SEND_SIGNALED;
+	if(!ib_post_send(qp, &wr, &bad_wr))
+		wait_for_completion(&waiter.done);
+}
+
+/*
+ * The last completions of the QP may queue the work again, so it is
+ * cancelled after the drain. The buffers promised to the client for
+ * chunks it never sent are still on the SRQ, and are handed to the other
+ * clients.
+ */
+static void sess_destroy(struct srv_sess *sess) {
+	struct demo_srv *srv = sess->srv;
+	struct conn_lane *lane = &sess->conn.lanes[0];
+
+	sess_restore_callbacks(sess);
+	sess_drain_qp(sess);
+	cancel_work_sync(&sess->work);
+
+	spin_lock(&srv->lock);
+	if(sess->granted > sess->received)
+		srv->avail += sess->granted - sess->received;
+	spin_unlock(&srv->lock);
+
+	dbg_info("Client gone after %llu transfers, %llu bytes\n",
+				sess->xfers, sess->bytes);
+	ib_destroy_qp(lane->qp);
+	cq_pool_put(&srv->dev->cq_pool, lane->dcq, SESS_CQE);
+	sock_release(sess->conn.client_sock);
+	kfree(sess);
+	srv_grant(srv);
+}
+
+static void srv_reap(struct work_struct *work) {
+	struct demo_srv *srv = container_of(work, struct demo_srv, reap_work);
+	struct srv_sess *sess;
+
+	for(;;) {
+		spin_lock(&srv->lock);
+		sess = list_first_entry_or_null(&srv->dead,
+					struct srv_sess, wait_ent);
+		if(sess)
+			list_del_init(&sess->wait_ent);
+		spin_unlock(&srv->lock);
+		if(!sess)
+			break;
+
+		mutex_lock(&srv->sess_lock);
+		list_del(&sess->ent);
+		mutex_unlock(&srv->sess_lock);
+		sess_destroy(sess);
+	}
+}
+
+static int sess_create_qp(struct srv_sess *sess) {
+	struct demo_srv *srv = sess->srv;
+	struct ib_device *ib_dev = srv->dev->ib_dev;
+	struct conn_lane *lane = &sess->conn.lanes[0];
+	struct ib_qp_init_attr qp_init_attr;
+	int err = 0;
+
+	lane->dcq = cq_pool_get(&srv->dev->cq_pool, SESS_CQE,
+				srv->nr_sess % ib_dev->num_comp_vectors);
+	if(IS_ERR(lane->dcq)) {
+		err = -ENODEV;
+		goto err_create_cq;
+	}
+
+	memset(&qp_init_attr, 0, sizeof(qp_init_attr));
+	qp_init_attr.event_handler = sess_qp_event;
+	qp_init_attr.qp_context = sess;
+	qp_init_attr.send_cq = lane->dcq->cq;
+	qp_init_attr.recv_cq = lane->dcq->cq;
+	qp_init_attr.srq = srv->srq;
+	qp_init_attr.cap.max_send_wr = QP_MAX_WR;
+	qp_init_attr.cap.max_send_sge = 1;
+	qp_init_attr.qp_type = IB_QPT_RC;
+	qp_init_attr.sq_sig_type = IB_SIGNAL_REQ_WR;
+	lane->qp = ib_create_qp(srv->dev->pd, &qp_init_attr);
+	if(IS_ERR(lane->qp)) {
+		err = (int)PTR_ERR(lane->qp);
+		goto err_create_qp;
+	}
+
+	return err;
+
+err_create_qp:
+	cq_pool_put(&srv->dev->cq_pool, lane->dcq, SESS_CQE);
+err_create_cq:
+	return err;
+}
+
+/* Sets the QP of a new client up over its TCP connection, like create_conn_tcp */
+static int sess_connect(struct srv_sess *sess) {
+	struct rdma_conn *conn = &sess->conn;
+	struct ib_port_attr port_attr;
+	struct conn_setup_info *local_info, *remote_info;
+	struct qp_conn_param *qp_info;
+	int err = 0;
+
+	local_info = kzalloc(2 * sizeof(*local_info), GFP_KERNEL);
+	if(!local_info) {
+		return -ENOMEM;
+	}
+	remote_info = local_info + 1;
+
+	err = ib_query_port(conn->ib_dev, conn->rdma_port, &port_attr);
+	if(err) {
+		goto out;
+	}
+
+	qp_info = &local_info->lanes[0];
+	err = rdma_query_gid(conn->ib_dev, conn->rdma_port,
+				conn->sgid_index, &qp_info->gid);
+	if(err) {
+		goto out;
+	}
+
+	local_info->nr_lanes = 1;
+	qp_info->qpn = conn->lanes[0].qp->qp_num;
+	qp_info->psn = 0;
+	qp_info->lid = port_attr.lid;
+	qp_info->mtu = port_attr.active_mtu;
+
+	err = exchange_info(true, local_info, remote_info,
+				sizeof(*local_info), conn->client_sock);
+	if(err) {
+		err_info("exchange_info error\n");
+		goto out;
+	}
+
+	if(remote_info->nr_lanes != 1) {
+		err = -EPROTO;
+		err_info("Client uses %u QPs, not 1\n", remote_info->nr_lanes);
+		goto out;
+	}
+
+	err = bring_up_qp(conn, conn->lanes[0].qp,
+				&local_info->lanes[0], &remote_info->lanes[0]);
+
+out:
+	kfree(local_info);
+	return err;
+}
+
+static int sess_create(struct demo_srv *srv, struct socket *client_sock) {
+	struct srv_sess *sess;
+	int err = 0;
+
+	sess = kzalloc(sizeof(*sess), GFP_KERNEL);
+	if(!sess) {
+		err = -ENOMEM;
+		err_info("Failed to alloc client\n");
+		goto err_alloc;
+	}
+
+	sess->srv = srv;
+	sess->conn.ib_dev = srv->dev->ib_dev;
+	sess->conn.rdma_port = srv->rdma_port;
+	sess->conn.sgid_index = srv->sgid_index;
+	sess->conn.net = srv->net;
+	sess->conn.is_server = true;
+	sess->conn.dev = srv->dev;
+	sess->conn.pd = srv->dev->pd;
+	sess->conn.dma_mr = srv->dev->dma_mr;
+	sess->conn.nr_lanes = 1;
+	sess->conn.client_sock = client_sock;
+	INIT_LIST_HEAD(&sess->wait_ent);
+	INIT_WORK(&sess->work, sess_work);
+	sess->credit_cqe.done = sess_credit_done;
+	init_completion(&sess->last_wqe);
+
+	client_sock->sk->sk_rcvtimeo = SESS_SOCK_TIMEO;
+	client_sock->sk->sk_sndtimeo = SESS_SOCK_TIMEO;
+
+	err = sess_create_qp(sess);
+	if(err) {
+		err_info("Failed to create QP, err: %d\n", err);
+		goto err_create_qp;
+	}
+
+	err = sess_connect(sess);
+	if(err) {
+		goto err_connect;
+	}
+
+	mutex_lock(&srv->sess_lock);
+	list_add_tail(&sess->ent, &srv->sessions);
+	srv->nr_sess++;
+	mutex_unlock(&srv->sess_lock);
+
+	/* The first announcement may have arrived already */
+	sess_install_callbacks(sess);
+	queue_work(srv_wq, &sess->work);
+	return 0;
+
+err_connect:
+	ib_destroy_qp(sess->conn.lanes[0].qp);
+	cq_pool_put(&srv->dev->cq_pool, sess->conn.lanes[0].dcq, SESS_CQE);
+err_create_qp:
+	kfree(sess);
+err_alloc:
+	sock_release(client_sock);
+	return err;
+}
+
+static int srv_listen(void *data) {
+	struct demo_srv *srv = data;
+	struct socket *client_sock;
+	int err;
+
+	while(!kthread_should_stop()) {
+		err = kernel_accept(srv->sock, &client_sock, 0);
+		if(err) {
+			/* The listening socket is shut down before the thread is stopped */
+			if(!kthread_should_stop())
+				schedule_timeout_interruptible(HZ / 10);
+			continue;
+		}
+
+		sess_create(srv, client_sock);
+	}
+
+	return 0;
+}
+
+/* Posts up to nr more buffers; only the grow work and start call this */
+static u32 srv_add_bufs(struct demo_srv *srv, u32 nr) {
+	struct ib_device *ib_dev = srv->dev->ib_dev;
+	u32 added = 0;
+
+	while(added < nr && srv->nr_bufs < srv->max_bufs) {
+		struct srv_buf *buf = &srv->bufs[srv->nr_bufs];
+
+		buf->data = kmalloc(srv->buf_size, GFP_KERNEL);
+		if(!buf->data)
+			break;
+
+		buf->dma = ib_dma_map_single(ib_dev, buf->data, srv->buf_size,
+					DMA_FROM_DEVICE);
+		if(ib_dma_mapping_error(ib_dev, buf->dma)) {
+			kfree(buf->data);
+			break;
+		}
+
+		buf->srv = srv;
+		buf->cqe.done = srv_recv_done;
+		if(srv_post_buf(srv, buf)) {
+			ib_dma_unmap_single(ib_dev, buf->dma, srv->buf_size,
+						DMA_FROM_DEVICE);
+			kfree(buf->data);
+			break;
+		}
+
+		WRITE_ONCE(srv->nr_bufs, srv->nr_bufs + 1);
+		spin_lock(&srv->lock);
+		srv->avail++;
+		spin_unlock(&srv->lock);
+		added++;
+	}
+
+	return added;
+}
+
+static void srv_free_bufs(struct demo_srv *srv) {
+	struct ib_device *ib_dev = srv->dev->ib_dev;
+	u32 i;
+
+	for(i = 0; i < srv->nr_bufs; i++) {
+		ib_dma_unmap_single(ib_dev, srv->bufs[i].dma, srv->buf_size,
+					DMA_FROM_DEVICE);
+		kfree(srv->bufs[i].data);
+	}
+	kvfree(srv->bufs);
+}
+
+/* Asks for SRQ_LIMIT_REACHED when a quarter of the buffers is left */
+static void srv_arm_limit(struct demo_srv *srv) {
+	struct ib_srq_attr attr = {
+		.srq_limit		= max(srv->nr_bufs / 4, 1U),
+	};
+
+	if(srv->nr_bufs >= srv->max_bufs)
+		return;
+
+	if(ib_modify_srq(srv->srq, &attr, IB_SRQ_LIMIT))
+		dbg_info("SRQ limit not supported\n");
+}
+
+static void srv_grow(struct work_struct *work) {
+	struct demo_srv *srv = container_of(work, struct demo_srv, grow_work);
+
+	if(READ_ONCE(srv->stopping))
+		return;
+
+	if(!srv_add_bufs(srv, SRV_GROW_STEP))
+		return;
+
+	dbg_info("Server on port %u has %u receive buffers\n",
+				ntohs(srv->addr.sin_port), srv->nr_bufs);
+	srv_arm_limit(srv);
+	srv_grant(srv);
+}
+
+static void srv_srq_event(struct ib_event *event, void *context) {
+	struct demo_srv *srv = context;
+
+	if(event->event == IB_EVENT_SRQ_LIMIT_REACHED && !READ_ONCE(srv->stopping))
+		queue_work(srv_wq, &srv->grow_work);
+	else if(event->event != IB_EVENT_SRQ_LIMIT_REACHED)
+		err_info("SRQ event: %s\n", ib_event_msg(event->event));
+}
+
+static int srv_create_srq(struct demo_srv *srv) {
+	struct ib_device *ib_dev = srv->dev->ib_dev;
+	struct ib_srq_init_attr srq_init_attr;
+	int err = 0;
+
+	srv->max_bufs = min_t(u32, max_t(u32, srv_max_bufs, SRV_CREDIT_GRANT),
+				ib_dev->attrs.max_srq_wr);
+	if(srv->max_bufs < SRV_CREDIT_GRANT) {
+		err_info("%s has no shared receive queues\n", ib_dev->name);
+		return -EOPNOTSUPP;
+	}
+
+	srv->buf_size = clamp_t(u32, srv_buf_size, SZ_4K, SZ_4M);
+	srv->bufs = kvcalloc(srv->max_bufs, sizeof(*srv->bufs), GFP_KERNEL);
+	if(!srv->bufs) {
+		return -ENOMEM;
+	}
+
+	memset(&srq_init_attr, 0, sizeof(srq_init_attr));
+	srq_init_attr.event_handler = srv_srq_event;
+	srq_init_attr.srq_context = srv;
+	srq_init_attr.srq_type = IB_SRQT_BASIC;
+	srq_init_attr.attr.max_wr = srv->max_bufs;
+	srq_init_attr.attr.max_sge = 1;
+	srv->srq = ib_create_srq(srv->dev->pd, &srq_init_attr);
+	if(IS_ERR(srv->srq)) {
+		err = (int)PTR_ERR(srv->srq);
+		err_info("Failed to create SRQ\n");
+		goto err_create_srq;
+	}
+
+	/* A credit message worth of buffers at least, or no client gets going */
+	if(srv_add_bufs(srv, max_t(u32, srv_min_bufs, SRV_CREDIT_GRANT)) <
+				SRV_CREDIT_GRANT) {
+		err = -ENOMEM;
+		err_info("Failed to post receive buffers\n");
+		goto err_add_bufs;
+	}
+
+	srv_arm_limit(srv);
+	return err;
+
+err_add_bufs:
+	ib_destroy_srq(srv->srq);
+err_create_srq:
+	srv_free_bufs(srv);
+	return err;
+}
+
+/* kernel_setsockopt() is gone from 5.8 on */
+static int sock_reuse_addr(struct socket *sock) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	sock_set_reuseaddr(sock->sk);
+	return 0;
+#else
+	int flag = 1;
+
+	return kernel_setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+				(char*)&flag, sizeof(int));
+#endif
+}
+
+static int srv_create_sock(struct demo_srv *srv) {
+	int err = 0;
+
+	err = sock_create_kern(srv->net, AF_INET, SOCK_STREAM, 0, &srv->sock);
+	if(err) {
+		err_info("socket create error\n");
+		return err;
+	}
+
+	err = sock_reuse_addr(srv->sock);
+	if(err) {
+		err_info("setsockopt error\n");
+		goto out_sock_release;
+	}
+
+	err = kernel_bind(srv->sock, (struct sockaddr*)&srv->addr,
+				sizeof(srv->addr));
+	if(err < 0) {
+		err_info("bind error\n");
+		goto out_sock_release;
+	}
+
+	err = kernel_listen(srv->sock, SRV_BACKLOG);
+	if(err < 0) {
+		err_info("listen error\n");
+		goto out_sock_release;
+	}
+
+	return 0;
+
+out_sock_release:
+	sock_release(srv->sock);
+	return err;
+}
+
+/*
+ * Once the listener is gone no client is added. The clients are killed
+ * and reaped, which drains their QPs, so no completion can touch the SRQ
+ * buffers any more when they are freed.
+ */
+static void srv_destroy(struct demo_srv *srv) {
+	struct srv_sess *sess;
+
+	kernel_sock_shutdown(srv->sock, SHUT_RDWR);
+	kthread_stop(srv->thread);
+	sock_release(srv->sock);
+
+	WRITE_ONCE(srv->stopping, true);
+	mutex_lock(&srv->sess_lock);
+	list_for_each_entry(sess, &srv->sessions, ent)
+		sess_kill(sess);
+	mutex_unlock(&srv->sess_lock);
+	flush_work(&srv->reap_work);
+	cancel_work_sync(&srv->grow_work);
+
+	dbg_info("Server on port %u stopped after %lld transfers, %lld bytes, %u receive buffers\n",
+				ntohs(srv->addr.sin_port), atomic64_read(&srv->xfers),
+				atomic64_read(&srv->bytes), srv->nr_bufs);
+	ib_destroy_srq(srv->srq);
+	srv_free_bufs(srv);
+	demo_dev_put(srv->dev);
+	put_net(srv->net);
+	kfree(srv);
+}
+
+static struct demo_srv *find_srv(struct net *net, const struct sockaddr_in *addr) {
+	struct demo_srv *srv;
+
+	list_for_each_entry(srv, &srv_list, ent) {
+		if(net_eq(srv->net, net) && srv->addr.sin_port == addr->sin_port)
+			return srv;
+	}
+
+	return NULL;
+}
+
+int srv_start(const struct srv_param *param, struct net *net) {
+	struct demo_srv *srv;
+	int err = 0;
+
+	srv = kzalloc(sizeof(*srv), GFP_KERNEL);
+	if(!srv) {
+		err = -ENOMEM;
+		err_info("Failed to alloc server\n");
+		goto err_alloc;
+	}
+
+	srv->dev = demo_dev_get(param->dev_name);
+	if(!srv->dev) {
+		err = -ENODEV;
+		err_info("No such device: %s\n", param->dev_name);
+		goto err_dev;
+	}
+
+	srv->net = get_net(net);
+	srv->addr.sin_family = AF_INET;
+	srv->addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	srv->addr.sin_port = param->s_addr.sin_port;
+	srv->rdma_port = param->rdma_port;
+	srv->sgid_index = param->sgid_index;
+	spin_lock_init(&srv->lock);
+	INIT_LIST_HEAD(&srv->waiters);
+	INIT_LIST_HEAD(&srv->dead);
+	INIT_WORK(&srv->reap_work, srv_reap);
+	INIT_WORK(&srv->grow_work, srv_grow);
+	mutex_init(&srv->sess_lock);
+	INIT_LIST_HEAD(&srv->sessions);
+	atomic64_set(&srv->xfers, 0);
+	atomic64_set(&srv->bytes, 0);
+
+	mutex_lock(&srv_mutex);
+	if(find_srv(net, &srv->addr)) {
+		err = -EADDRINUSE;
+		err_info("A server runs on port %u already\n", ntohs(srv->addr.sin_port));
+		goto err_busy;
+	}
+
+	err = srv_create_srq(srv);
+	if(err) {
+		goto err_busy;
+	}
+
+	err = srv_create_sock(srv);
+	if(err) {
+		goto err_sock;
+	}
+
+	srv->thread = kthread_run(srv_listen, srv, "demo_srv/%u",
+				ntohs(srv->addr.sin_port));
+	if(IS_ERR(srv->thread)) {
+		err = (int)PTR_ERR(srv->thread);
+		err_info("Failed to start listener\n");
+		goto err_thread;
+	}
+
+	list_add(&srv->ent, &srv_list);
+	mutex_unlock(&srv_mutex);
+	return 0;
+
+err_thread:
+	sock_release(srv->sock);
+err_sock:
+	WRITE_ONCE(srv->stopping, true);
+	cancel_work_sync(&srv->grow_work);
+	ib_destroy_srq(srv->srq);
+	srv_free_bufs(srv);
+err_busy:
+	mutex_unlock(&srv_mutex);
+	put_net(srv->net);
+	demo_dev_put(srv->dev);
+err_dev:
+	kfree(srv);
+err_alloc:
+	return err;
+}
+
+int srv_stop(const struct srv_param *param, struct net *net) {
+	struct demo_srv *srv;
+
+	mutex_lock(&srv_mutex);
+	srv = find_srv(net, &param->s_addr);
+	if(srv)
+		list_del(&srv->ent);
+	mutex_unlock(&srv_mutex);
+
+	if(!srv)
+		return -ENOENT;
+
+	srv_destroy(srv);
+	return 0;
+}
+
+/* The servers hold a reference on their device, so they go before it */
+void srv_flush_device(struct demo_dev *dev) {
+	struct demo_srv *srv, *tmp;
+	LIST_HEAD(flush_list);
+
+	mutex_lock(&srv_mutex);
+	list_for_each_entry_safe(srv, tmp, &srv_list, ent) {
+		if(srv->dev == dev)
+			list_move(&srv->ent, &flush_list);
+	}
+	mutex_unlock(&srv_mutex);
+
+	list_for_each_entry_safe(srv, tmp, &flush_list, ent)
+		srv_destroy(srv);
+}
+
+int init_srv_list(void) {
+	INIT_LIST_HEAD(&srv_list);
+	mutex_init(&srv_mutex);
+	srv_wq = alloc_workqueue("demo_rdma_srv", WQ_UNBOUND, 0);
+	if(!srv_wq) {
+		err_info("Failed to alloc server workqueue\n");
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void destroy_srv_list(void) {
+	struct demo_srv *srv, *tmp;
+
+	list_for_each_entry_safe(srv, tmp, &srv_list, ent) {
+		list_del(&srv->ent);
+		srv_destroy(srv);
+	}
+	destroy_workqueue(srv_wq);
+}
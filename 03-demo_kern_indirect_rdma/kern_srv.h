@@ -0,0 +1,16 @@
+#ifndef __KERN_SRV_H__
+#define __KERN_SRV_H__
+
+#include "kern_dev.h"
+#include "common.h"
+
+struct net;
+
+extern int init_srv_list(void);
+extern void destroy_srv_list(void);
+
+extern int srv_start(const struct srv_param *param, struct net *net);
+extern int srv_stop(const struct srv_param *param, struct net *net);
+extern void srv_flush_device(struct demo_dev *dev);
+
+#endif
@@ -0,0 +1,187 @@
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/module.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include "kern_stats.h"
+#include "../common/demo_compat.h"
+#include "common.h"
+
+struct demo_stats *module_stats;
+
+/*
+ * demo_indirect_rdma/{stats,stats_page} for the module, and a directory
+ * with the same two files for every device, which also holds one file per
+ * connection on the device.
+ */
+static struct dentry *stats_root;
+
+static const char * const stats_hist_names[NR_STATS_HISTS] = {
+	[STATS_HIST_PIN]			= "pin",
+	[STATS_HIST_MAP]			= "dma_map",
+	[STATS_HIST_POST]			= "post_to_completion",
+	[STATS_HIST_TEARDOWN]		= "teardown",
+};
+
+/* Prints x / y with two decimals */
+static void stats_print_ratio(struct seq_file *m, const char *name,
+			u64 x, u64 y) {
+	u64 r;
+
+	if(!y)
+		return;
+
+	r = div64_u64(x * 100, y);
+	seq_printf(m, "%s: %llu.%02llu\n", name, r / 100, r % 100);
+}
+
+void stats_seq_show(struct seq_file *m, const struct demo_stats *stats) {
+	u64 pages = READ_ONCE(stats->pages_pinned);
+	u64 sg_ents = READ_ONCE(stats->sg_ents);
+	u64 dma_segs = READ_ONCE(stats->dma_segs);
+	int i, j;
+
+	seq_printf(m, "xfers: %llu\n", READ_ONCE(stats->xfers));
+	seq_printf(m, "xfer_errors: %llu\n", READ_ONCE(stats->xfer_errors));
+	seq_printf(m, "bytes: %llu\n", READ_ONCE(stats->bytes));
+	seq_printf(m, "wrs_posted: %llu\n", READ_ONCE(stats->wrs_posted));
+	seq_printf(m, "completions: %llu\n", READ_ONCE(stats->completions));
+	seq_printf(m, "cq_polls: %llu\n", READ_ONCE(stats->cq_polls));
+	seq_printf(m, "cq_empty_polls: %llu\n", READ_ONCE(stats->cq_empty_polls));
+	seq_printf(m, "pages_pinned: %llu\n", pages);
+	seq_printf(m, "pages_unpinned: %llu\n", READ_ONCE(stats->pages_unpinned));
+	seq_printf(m, "sg_ents: %llu\n", sg_ents);
+	seq_printf(m, "dma_segs: %llu\n", dma_segs);
+	seq_printf(m, "eager_xfers: %llu\n", READ_ONCE(stats->eager_xfers));
+	seq_printf(m, "rndv_xfers: %llu\n", READ_ONCE(stats->rndv_xfers));
+	seq_printf(m, "iova_fallbacks: %llu\n", READ_ONCE(stats->iova_fallbacks));
+	seq_printf(m, "contig_ents_before: %llu\n",
+				READ_ONCE(stats->contig_ents_before));
+	seq_printf(m, "contig_ents_after: %llu\n",
+				READ_ONCE(stats->contig_ents_after));
+	stats_print_ratio(m, "pages_per_sg_ent", pages, sg_ents);
+	stats_print_ratio(m, "sg_ents_per_dma_seg", sg_ents, dma_segs);
+
+	for(i = 0; i < NR_STATS_HISTS; i++) {
+		const u64 *hist = stats->hist[i];
+		bool header = false;
+
+		for(j = 0; j < STATS_HIST_BUCKETS; j++) {
+			u64 n = READ_ONCE(hist[j]);
+
+			if(!n)
+				continue;
+			if(!header) {
+				seq_printf(m, "%s_ns:\n", stats_hist_names[i]);
+				header = true;
+			}
+
+			if(j == 0)
+				seq_printf(m, "\t0: %llu\n", n);
+			else if(j == STATS_HIST_BUCKETS - 1)
+				seq_printf(m, "\t>= %llu: %llu\n", 1ULL << (j - 1), n);
+			else
+				seq_printf(m, "\t%llu - %llu: %llu\n",
+							1ULL << (j - 1), (1ULL << j) - 1, n);
+		}
+	}
+}
+
+static int stats_show(struct seq_file *m, void *v) {
+	stats_seq_show(m, m->private);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+/*
+ * The stats page is mapped read-only. A mapping holds a reference on the
+ * page, so it stays valid after its device is gone; the open file only
+ * gets to the page while the debugfs file exists.
+ */
+static int stats_page_mmap(struct file *filep, struct vm_area_struct *vma) {
+	struct dentry *dentry = filep->f_path.dentry;
+	int err = 0;
+
+	if(vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE ||
+				(vma->vm_flags & VM_WRITE))
+		return -EINVAL;
+
+	err = debugfs_file_get(dentry);
+	if(err) {
+		return err;
+	}
+
+	vm_flags_clear(vma, VM_MAYWRITE);
+	err = vm_insert_page(vma, vma->vm_start,
+				virt_to_page(filep->private_data));
+	debugfs_file_put(dentry);
+	return err;
+}
+
+static ssize_t stats_page_read(struct file *filep, char __user *buf,
+			size_t count, loff_t *ppos) {
+	struct dentry *dentry = filep->f_path.dentry;
+	ssize_t ret;
+
+	ret = debugfs_file_get(dentry);
+	if(ret) {
+		return ret;
+	}
+
+	ret = simple_read_from_buffer(buf, count, ppos, filep->private_data,
+				sizeof(struct demo_stats));
+	debugfs_file_put(dentry);
+	return ret;
+}
+
+/* Created unsafe, since the debugfs proxy has no mmap */
+static const struct file_operations stats_page_fops = {
+	.owner			= THIS_MODULE,
+	.open			= simple_open,
+	.read			= stats_page_read,
+	.mmap			= stats_page_mmap,
+	.llseek			= default_llseek,
+};
+
+struct demo_stats *stats_alloc_page(void) {
+	BUILD_BUG_ON(sizeof(struct demo_stats) > PAGE_SIZE);
+	return (struct demo_stats*)get_zeroed_page(GFP_KERNEL);
+}
+
+/* Mappings of the page keep it alive until they are gone */
+void stats_free_page(struct demo_stats *stats) {
+	if(stats)
+		free_page((unsigned long)stats);
+}
+
+/* Removed with debugfs_remove_recursive */
+struct dentry *stats_create_dir(const char *name, struct demo_stats *stats) {
+	struct dentry *dir;
+
+	dir = debugfs_create_dir(name, stats_root);
+	debugfs_create_file("stats", 0444, dir, stats, &stats_fops);
+	debugfs_create_file_unsafe("stats_page", 0444, dir, stats,
+				&stats_page_fops);
+	return dir;
+}
+
+int init_stats(void) {
+	module_stats = stats_alloc_page();
+	if(!module_stats) {
+		err_info("Failed to alloc stats page\n");
+		return -ENOMEM;
+	}
+
+	stats_root = debugfs_create_dir(DEV_NAME, NULL);
+	debugfs_create_file("stats", 0444, stats_root, module_stats, &stats_fops);
+	debugfs_create_file_unsafe("stats_page", 0444, stats_root, module_stats,
+				&stats_page_fops);
+	return 0;
+}
+
+void destroy_stats(void) {
+	debugfs_remove_recursive(stats_root);
+	stats_free_page(module_stats);
+}
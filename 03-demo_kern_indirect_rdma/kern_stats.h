@@ -0,0 +1,49 @@
+#ifndef __KERN_STATS_H__
+#define __KERN_STATS_H__
+
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+#include "common.h"
+
+/*
+ * Counters are the u64 fields of struct demo_stats, which user space sees
+ * through the stats pages, bumped with atomic64 operations. A NULL block
+ * is skipped, e.g. for a transfer without a device.
+ */
+#define stats_add(stats, field, n)		do {								\
+	struct demo_stats *___s = (stats);										\
+	if(___s)																\
+		atomic64_add((n), (atomic64_t*)&___s->field);						\
+} while(0)
+
+#define stats_inc(stats, field)			stats_add(stats, field, 1)
+
+static inline void stats_hist(struct demo_stats *stats, int hist, u64 ns) {
+	int bucket = min_t(int, fls64(ns), STATS_HIST_BUCKETS - 1);
+
+	if(stats)
+		atomic64_inc((atomic64_t*)&stats->hist[hist][bucket]);
+}
+
+static inline void stats_hist_since(struct demo_stats *stats, int hist,
+			ktime_t start) {
+	if(stats)
+		stats_hist(stats, hist, ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
+/* Pinning and unpinning, which do not depend on a device */
+extern struct demo_stats *module_stats;
+
+extern int init_stats(void);
+extern void destroy_stats(void);
+
+extern struct demo_stats *stats_alloc_page(void);
+extern void stats_free_page(struct demo_stats *stats);
+extern struct dentry *stats_create_dir(const char *name,
+			struct demo_stats *stats);
+extern void stats_seq_show(struct seq_file *m, const struct demo_stats *stats);
+
+#endif
@@ -0,0 +1,214 @@
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/net.h>
+#include <linux/uio.h>
+#include <linux/bvec.h>
+#include <linux/module.h>
+#include <linux/version.h>
+#include <net/sock.h>
+#include "kern_tcp.h"
+#include "kern_conn.h"
+#include "common.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define HAVE_SPLICE_PAGES
+#endif
+
+bool tcp_fallback = true;
+module_param(tcp_fallback, bool, 0644);
+MODULE_PARM_DESC(tcp_fallback, "Transfer over kernel TCP when the RDMA device does not exist");
+
+/* Exchanged before the data; both sides must agree on the operation */
+struct tcp_xfer_info {
+	u64					length;
+	u32					opcode;
+};
+
+/*
+ * Describes the pinned pages of the sg list as one bio_vec per page, so
+ * that neither the socket nor the iov_iter sees a segment that crosses a
+ * page boundary.
+ */
+static struct bio_vec *sg_to_bvec(struct sg_table *sgtbl,
+			unsigned long length, unsigned int *p_nr) {
+	struct scatterlist *sg;
+	struct bio_vec *bvec;
+	unsigned int nr = 0, max_nr = 0;
+	int i;
+
+	for_each_sg(sgtbl->sgl, sg, sgtbl->nents, i)
+		max_nr += DIV_ROUND_UP(sg->offset + sg->length, PAGE_SIZE);
+
+	bvec = kvmalloc_array(max_nr, sizeof(*bvec), GFP_KERNEL);
+	if(!bvec)
+		return NULL;
+
+	for_each_sg(sgtbl->sgl, sg, sgtbl->nents, i) {
+		struct page *page = sg_page(sg) + sg->offset / PAGE_SIZE;
+		unsigned int off = offset_in_page(sg->offset);
+		unsigned int left = sg->length;
+
+		while(left && length) {
+			unsigned int len = min_t(unsigned long,
+						min_t(unsigned int, left, PAGE_SIZE - off), length);
+
+			bvec[nr].bv_page = page++;
+			bvec[nr].bv_offset = off;
+			bvec[nr].bv_len = len;
+			nr++;
+			left -= len;
+			length -= len;
+			off = 0;
+		}
+	}
+
+	*p_nr = nr;
+	return bvec;
+}
+
+/*
+ * The socket takes its own references to the pages and keeps them until
+ * the peer has acknowledged the data, so nothing is copied on this side.
+ */
+#ifdef HAVE_SPLICE_PAGES
+static int send_pages(struct socket *sock, struct bio_vec *bvec,
+			unsigned int nr, unsigned long length) {
+	struct msghdr msg = {
+		.msg_flags		= MSG_SPLICE_PAGES,
+	};
+	int ret;
+
+	iov_iter_bvec(&msg.msg_iter, ITER_SOURCE, bvec, nr, length);
+	while(msg_data_left(&msg)) {
+		ret = sock_sendmsg(sock, &msg);
+		if(ret <= 0)
+			return ret? ret: -EPIPE;
+	}
+	return 0;
+}
+#else
+static int send_pages(struct socket *sock, struct bio_vec *bvec,
+			unsigned int nr, unsigned long length) {
+	unsigned int i;
+	int ret;
+
+	for(i = 0; i < nr; i++) {
+		unsigned int off = bvec[i].bv_offset;
+		unsigned int left = bvec[i].bv_len;
+
+		while(left) {
+			ret = kernel_sendpage(sock, bvec[i].bv_page, off, left,
+						(i + 1 < nr)? MSG_MORE: 0);
+			if(ret <= 0)
+				return ret? ret: -EPIPE;
+			off += ret;
+			left -= ret;
+		}
+	}
+	return 0;
+}
+#endif
+
+/* TCP copies the payload straight from its buffers into the pinned pages */
+static int recv_pages(struct socket *sock, struct bio_vec *bvec,
+			unsigned int nr, unsigned long length) {
+	struct msghdr msg = {};
+	int ret;
+
+	iov_iter_bvec(&msg.msg_iter, READ, bvec, nr, length);
+	while(msg_data_left(&msg)) {
+		ret = sock_recvmsg(sock, &msg, MSG_WAITALL);
+		if(ret <= 0)
+			return ret? ret: -EPIPE;
+	}
+	return 0;
+}
+
+static int xfer_ack(struct socket *sock, bool send) {
+	u32 ack = 0;
+	struct kvec vec = {
+		.iov_base		= &ack,
+		.iov_len		= sizeof(ack),
+	};
+	struct msghdr msg = {};
+	int ret;
+
+	if(send)
+		ret = kernel_sendmsg(sock, &msg, &vec, 1, sizeof(ack));
+	else
+		ret = kernel_recvmsg(sock, &msg, &vec, 1, sizeof(ack), MSG_WAITALL);
+	return (ret == sizeof(ack))? 0: -EPIPE;
+}
+
+/*
+ * Runs a transfer over a kernel TCP connection in place of the RDMA
+ * device: the side whose buffer is the source of the operation (the client
+ * for SEND and WRITE, the server for READ) sends the pinned pages, and the
+ * other side receives into its own. The receiver acknowledges the data,
+ * so both sides return once it has arrived.
+ */
+int tcp_xfer(bool is_server, const struct write_param *param,
+			struct net *net, struct sg_table *sgtbl, unsigned long length) {
+	struct socket *sock, *client_sock;
+	struct tcp_xfer_info local_info = {
+		.length			= length,
+		.opcode			= param->opcode,
+	};
+	struct tcp_xfer_info remote_info;
+	bool is_sender = (is_server == (param->opcode == XFER_OP_READ));
+	unsigned long xfer_len;
+	struct bio_vec *bvec;
+	unsigned int nr;
+	int err = 0;
+
+	err = setup_connection(net, is_server, &param->s_addr,
+				&sock, &client_sock);
+	if(err) {
+		err_info("setup_connection error\n");
+		return err;
+	}
+
+	err = exchange_info(is_server, &local_info, &remote_info,
+				sizeof(local_info), client_sock);
+	if(err) {
+		goto out_close;
+	}
+
+	if(remote_info.opcode != local_info.opcode) {
+		err = -EPROTO;
+		err_info("Peer runs opcode %u, not %u\n",
+				remote_info.opcode, local_info.opcode);
+		goto out_close;
+	}
+
+	xfer_len = is_sender? length: remote_info.length;
+	if(xfer_len > (is_sender? remote_info.length: length)) {
+		err = -EMSGSIZE;
+		err_info("Receive buffer is smaller than %lu bytes\n", xfer_len);
+		goto out_close;
+	}
+
+	bvec = sg_to_bvec(sgtbl, xfer_len, &nr);
+	if(!bvec) {
+		err = -ENOMEM;
+		goto out_close;
+	}
+
+	if(is_sender) {
+		err = send_pages(client_sock, bvec, nr, xfer_len);
+		if(!err)
+			err = xfer_ack(client_sock, false);
+	}
+	else {
+		err = recv_pages(client_sock, bvec, nr, xfer_len);
+		if(!err)
+			err = xfer_ack(client_sock, true);
+	}
+	if(err)
+		err_info("TCP transfer of %lu bytes failed, err: %d\n", xfer_len, err);
+
+	kvfree(bvec);
+out_close:
+	close_connection(is_server, sock, client_sock);
+	return err;
+}
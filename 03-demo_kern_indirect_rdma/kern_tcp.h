@@ -0,0 +1,14 @@
+#ifndef __KERN_TCP_H__
+#define __KERN_TCP_H__
+
+#include <linux/scatterlist.h>
+#include "common.h"
+
+struct net;
+
+extern bool tcp_fallback;
+
+extern int tcp_xfer(bool is_server, const struct write_param *param,
+			struct net *net, struct sg_table *sgtbl, unsigned long length);
+
+#endif
@@ -0,0 +1,215 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM demo_rdma
+
+#if !defined(__KERN_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __KERN_TRACE_H__
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+
+/*
+ * One event per stage of a transfer: pin, sg list, DMA map, post,
+ * completion and unpin, and one for the whole transfer. Events of the same
+ * transfer share its id; the pinning of a registration gets an id of its
+ * own, which later transfers on it do not share. `start` is the ktime in
+ * ns at which the stage began, and `ns` is how long it took, taken only
+ * while the event is enabled.
+ */
+
+TRACE_EVENT(demo_pin,
+	TP_PROTO(u64 id, unsigned long virtaddr, unsigned long length,
+			unsigned long npages, ktime_t start, int err),
+	TP_ARGS(id, virtaddr, length, npages, start, err),
+
+	TP_STRUCT__entry(
+		__field(u64,			id)
+		__field(unsigned long,	virtaddr)
+		__field(unsigned long,	length)
+		__field(unsigned long,	npages)
+		__field(u64,			start)
+		__field(u64,			ns)
+		__field(int,			err)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->virtaddr = virtaddr;
+		__entry->length = length;
+		__entry->npages = npages;
+		__entry->start = ktime_to_ns(start);
+		__entry->ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		__entry->err = err;
+	),
+
+	TP_printk("id=%llu addr=0x%lx len=%lu npages=%lu start=%llu ns=%llu err=%d",
+			__entry->id, __entry->virtaddr, __entry->length,
+			__entry->npages, __entry->start, __entry->ns, __entry->err)
+);
+
+/* An sg list built from pinned pages, and the unpinning of one */
+DECLARE_EVENT_CLASS(demo_sg_class,
+	TP_PROTO(u64 id, unsigned long npages, unsigned int nents,
+			ktime_t start),
+	TP_ARGS(id, npages, nents, start),
+
+	TP_STRUCT__entry(
+		__field(u64,			id)
+		__field(unsigned long,	npages)
+		__field(unsigned int,	nents)
+		__field(u64,			start)
+		__field(u64,			ns)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->npages = npages;
+		__entry->nents = nents;
+		__entry->start = ktime_to_ns(start);
+		__entry->ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	),
+
+	TP_printk("id=%llu npages=%lu nents=%u start=%llu ns=%llu",
+			__entry->id, __entry->npages, __entry->nents,
+			__entry->start, __entry->ns)
+);
+
+DEFINE_EVENT(demo_sg_class, demo_sg,
+	TP_PROTO(u64 id, unsigned long npages, unsigned int nents,
+			ktime_t start),
+	TP_ARGS(id, npages, nents, start)
+);
+
+DEFINE_EVENT(demo_sg_class, demo_unpin,
+	TP_PROTO(u64 id, unsigned long npages, unsigned int nents,
+			ktime_t start),
+	TP_ARGS(id, npages, nents, start)
+);
+
+TRACE_EVENT(demo_map,
+	TP_PROTO(u64 id, unsigned int nents, int dma_nents, bool contig,
+			ktime_t start),
+	TP_ARGS(id, nents, dma_nents, contig, start),
+
+	TP_STRUCT__entry(
+		__field(u64,			id)
+		__field(unsigned int,	nents)
+		__field(int,			dma_nents)
+		__field(bool,			contig)
+		__field(u64,			start)
+		__field(u64,			ns)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->nents = nents;
+		__entry->dma_nents = dma_nents;
+		__entry->contig = contig;
+		__entry->start = ktime_to_ns(start);
+		__entry->ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	),
+
+	TP_printk("id=%llu nents=%u dma_nents=%d contig=%d start=%llu ns=%llu",
+			__entry->id, __entry->nents, __entry->dma_nents,
+			__entry->contig, __entry->start, __entry->ns)
+);
+
+/* A chain of WRs posted on one lane; bytes counts the WRs that got posted */
+TRACE_EVENT(demo_post,
+	TP_PROTO(u64 id, int lane, bool is_recv, int nr, int nr_posted,
+			unsigned long bytes),
+	TP_ARGS(id, lane, is_recv, nr, nr_posted, bytes),
+
+	TP_STRUCT__entry(
+		__field(u64,			id)
+		__field(int,			lane)
+		__field(bool,			is_recv)
+		__field(int,			nr)
+		__field(int,			nr_posted)
+		__field(unsigned long,	bytes)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->lane = lane;
+		__entry->is_recv = is_recv;
+		__entry->nr = nr;
+		__entry->nr_posted = nr_posted;
+		__entry->bytes = bytes;
+	),
+
+	TP_printk("id=%llu lane=%d %s nr=%d posted=%d bytes=%lu",
+			__entry->id, __entry->lane,
+			__entry->is_recv? "recv": "send",
+			__entry->nr, __entry->nr_posted, __entry->bytes)
+);
+
+/*
+ * A completion that retires nr WRs of a lane: a receive, or a signaled
+ * send and the unsignaled ones before it. start is when the signaled send
+ * was posted, 0 for a receive.
+ */
+TRACE_EVENT(demo_complete,
+	TP_PROTO(u64 id, int lane, int nr, int status, ktime_t start),
+	TP_ARGS(id, lane, nr, status, start),
+
+	TP_STRUCT__entry(
+		__field(u64,			id)
+		__field(int,			lane)
+		__field(int,			nr)
+		__field(int,			status)
+		__field(u64,			start)
+		__field(u64,			ns)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->lane = lane;
+		__entry->nr = nr;
+		__entry->status = status;
+		__entry->start = ktime_to_ns(start);
+		__entry->ns = start? ktime_to_ns(ktime_sub(ktime_get(), start)): 0;
+	),
+
+	TP_printk("id=%llu lane=%d nr=%d status=%d start=%llu ns=%llu",
+			__entry->id, __entry->lane, __entry->nr,
+			__entry->status, __entry->start, __entry->ns)
+);
+
+/* A transfer over RDMA, from the DMA mapping to the unmapping */
+TRACE_EVENT(demo_xfer,
+	TP_PROTO(u64 id, bool is_server, int op, unsigned long bytes,
+			ktime_t start, int err),
+	TP_ARGS(id, is_server, op, bytes, start, err),
+
+	TP_STRUCT__entry(
+		__field(u64,			id)
+		__field(bool,			is_server)
+		__field(int,			op)
+		__field(unsigned long,	bytes)
+		__field(u64,			start)
+		__field(u64,			ns)
+		__field(int,			err)
+	),
+
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->is_server = is_server;
+		__entry->op = op;
+		__entry->bytes = bytes;
+		__entry->start = ktime_to_ns(start);
+		__entry->ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+		__entry->err = err;
+	),
+
+	TP_printk("id=%llu server=%d op=%d bytes=%lu start=%llu ns=%llu err=%d",
+			__entry->id, __entry->is_server, __entry->op,
+			__entry->bytes, __entry->start, __entry->ns, __entry->err)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE kern_trace
+#include <trace/define_trace.h>
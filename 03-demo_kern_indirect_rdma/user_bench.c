@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include "user_bench.h"
+#include "user_ring.h"
+#include "common.h"
+
+#define HUGE_PAGE_SIZE				(2UL << 20)
+#define ALIGN_UP(x, a)				(((x) + (a) - 1) & ~((a) - 1))
+
+/* From Linux 6.1 on; older kernels fail it with EINVAL */
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE				25
+#endif
+
+/*
+ * Transfers go through the shared rings on registered buffers, so the
+ * numbers cover the connection handshake, the DMA mapping and the RDMA
+ * operation of every transfer, but not the pinning of the buffers. With
+ * use_pool, the buffers come from the pool of the device instead, which
+ * takes the DMA mapping out of the numbers too.
+ */
+
+static inline __u64 now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	__u64 x = *(const __u64*)a, y = *(const __u64*)b;
+
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const __u64 *sorted, int n, double pct) {
+	int idx = (int)(pct / 100.0 * (n - 1) + 0.5);
+
+	return sorted[idx] / 1000.0;
+}
+
+static unsigned long parse_size(const char *str) {
+	char *end;
+	unsigned long size = strtoul(str, &end, 0);
+
+	switch(*end) {
+	case 'k': case 'K':
+		return size << 10;
+	case 'm': case 'M':
+		return size << 20;
+	case 'g': case 'G':
+		return size << 30;
+	default:
+		return *end? 0: size;
+	}
+}
+
+/* "size" or "min:max", with an optional K, M or G suffix */
+int parse_size_range(const char *str, struct bench_param *bench) {
+	const char *sep = strchr(str, ':');
+
+	bench->min_size = parse_size(str);
+	bench->max_size = sep? parse_size(sep + 1): bench->min_size;
+	if(!bench->min_size || bench->max_size < bench->min_size)
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * The whole buffer set of one size: depth registered buffers, carved out
+ * of mem, or mapped one by one from the device pool into maps.
+ */
+struct bench_bufs {
+	char						*mem;
+	void						**maps;
+	unsigned long				size;
+	__u64						*handles;
+	int							nr_reg;
+};
+
+static void free_bufs(int fd, struct bench_bufs *bufs) {
+	while(bufs->nr_reg--) {
+		if(bufs->maps)
+			munmap(bufs->maps[bufs->nr_reg], bufs->size);
+		xring_deregister(fd, bufs->handles[bufs->nr_reg]);
+	}
+	free(bufs->handles);
+	free(bufs->maps);
+	free(bufs->mem);
+}
+
+static int alloc_pool_bufs(int fd, const struct write_param *param,
+				unsigned long size, int depth, struct bench_bufs *bufs) {
+	int err = 0;
+
+	memset(bufs, 0, sizeof(*bufs));
+	bufs->size = size;
+	bufs->maps = calloc(depth, sizeof(*bufs->maps));
+	bufs->handles = calloc(depth, sizeof(*bufs->handles));
+	if(!bufs->maps || !bufs->handles) {
+		err = -ENOMEM;
+		err_info(err, "Failed to alloc %d pool buffers\n", depth);
+		free_bufs(fd, bufs);
+		return err;
+	}
+
+	for(; bufs->nr_reg < depth; bufs->nr_reg++) {
+		err = xring_pool_alloc(fd, param->dev_name, size,
+					&bufs->handles[bufs->nr_reg], &bufs->maps[bufs->nr_reg]);
+		if(err) {
+			free_bufs(fd, bufs);
+			return err;
+		}
+		memset(bufs->maps[bufs->nr_reg], 0xa5, size);
+	}
+
+	return err;
+}
+
+static int count_sg(int fd, const struct write_param *param,
+				void *mem, unsigned long length, int stage,
+				unsigned int *p_nents) {
+	struct sg_count_param count;
+	int err = 0;
+
+	memset(&count, 0, sizeof(count));
+	memcpy(count.dev_name, param->dev_name, sizeof(count.dev_name));
+	count.virtaddr = (unsigned long)mem;
+	count.length = length;
+	count.access = param->access;
+	count.stage = stage;
+	err = ioctl(fd, IOCTL_COUNT_SG, &count);
+	if(err < 0) {
+		err = -errno;
+		err_info(err, "Failed to count the sg entries of %p\n", mem);
+		return err;
+	}
+
+	*p_nents = count.nents;
+	return err;
+}
+
+/*
+ * Backs the populated buffers with transparent huge pages, so that they
+ * are pinned into far fewer sg entries. The module cannot move pages into
+ * contiguous blocks by itself, since the page migration core is not
+ * exported to modules. A collapse that fails leaves the pages as they are.
+ */
+static int collapse_bufs(int fd, const struct write_param *param,
+				void *mem, unsigned long length) {
+	unsigned int before, after;
+	int err = 0;
+
+	err = count_sg(fd, param, mem, length, SG_COUNT_BEFORE, &before);
+	if(err) {
+		return err;
+	}
+
+	if(madvise(mem, length, MADV_HUGEPAGE) ||
+				madvise(mem, length, MADV_COLLAPSE)) {
+		dbg_info("Cannot collapse the buffers: %s\n", strerror(errno));
+	}
+
+	err = count_sg(fd, param, mem, length, SG_COUNT_AFTER, &after);
+	if(err) {
+		return err;
+	}
+
+	fprintf(stderr, "%lu bytes in %u sg entries before collapsing, %u after\n",
+				length, before, after);
+	return err;
+}
+
+static int alloc_bufs(int fd, const struct write_param *param,
+				unsigned long size, int depth, int contig,
+				struct bench_bufs *bufs) {
+	struct write_param reg = *param;
+	unsigned long align = contig? HUGE_PAGE_SIZE: sysconf(_SC_PAGESIZE);
+	unsigned long length = ALIGN_UP(size * depth, align);
+	int err = 0;
+
+	memset(bufs, 0, sizeof(*bufs));
+	if(posix_memalign((void**)&bufs->mem, align, length))
+		bufs->mem = NULL;
+	bufs->handles = calloc(depth, sizeof(*bufs->handles));
+	if(!bufs->mem || !bufs->handles) {
+		err = -ENOMEM;
+		err_info(err, "Failed to alloc %d buffers of %lu bytes\n", depth, size);
+		free_bufs(fd, bufs);
+		return err;
+	}
+	memset(bufs->mem, 0xa5, length);
+
+	if(contig) {
+		err = collapse_bufs(fd, param, bufs->mem, length);
+		if(err) {
+			free_bufs(fd, bufs);
+			return err;
+		}
+	}
+
+	reg.length = size;
+	for(; bufs->nr_reg < depth; bufs->nr_reg++) {
+		reg.virtaddr = (unsigned long)(bufs->mem + size * bufs->nr_reg);
+		err = xring_register(fd, &reg, &bufs->handles[bufs->nr_reg]);
+		if(err) {
+			free_bufs(fd, bufs);
+			return err;
+		}
+	}
+
+	return err;
+}
+
+static int queue_xfer(struct xring *ring, const struct write_param *param,
+				const struct bench_bufs *bufs, int slot, __u64 *start) {
+	start[slot] = now_ns();
+	return xring_queue(ring, param, bufs->handles[slot], slot);
+}
+
+/*
+ * Keeps depth transfers in flight until iters of them have completed;
+ * a finished slot is refilled right away. lat gets the time from the
+ * submission to the reaping of every transfer.
+ */
+static int run_size(struct xring *ring, const struct write_param *param,
+				const struct bench_bufs *bufs, int depth, int iters,
+				__u64 *start, __u64 *lat) {
+	int queued = 0, done = 0;
+	__u64 user_data;
+	int res, err = 0;
+
+	while(queued < depth && queued < iters) {
+		err = queue_xfer(ring, param, bufs, queued, start);
+		if(err) {
+			return err;
+		}
+		queued++;
+	}
+	err = xring_submit(ring);
+
+	while(!err && done < iters) {
+		int reaped = 0;
+
+		while(xring_reap(ring, &user_data, &res)) {
+			if(res < 0) {
+				err_info(res, "Transfer %d failed\n", done);
+				return res;
+			}
+
+			lat[done++] = now_ns() - start[user_data];
+			if(queued < iters) {
+				err = queue_xfer(ring, param, bufs, (int)user_data, start);
+				if(err) {
+					return err;
+				}
+				queued++;
+			}
+			reaped++;
+		}
+
+		if(reaped)
+			err = xring_submit(ring);
+		else
+			err = xring_wait(ring, 1);
+	}
+
+	return err;
+}
+
+static void report(unsigned long size, int iters, __u64 elapsed, __u64 *lat) {
+	double secs = elapsed / 1e9;
+
+	qsort(lat, iters, sizeof(*lat), cmp_u64);
+	printf(" %-10lu %-10d %-12.2f %-12.4f %-10.2f %-10.2f %-10.2f %-10.2f\n",
+			size, iters, (double)size * iters / secs / 1e6,
+			iters / secs / 1e6,
+			percentile_us(lat, iters, 50), percentile_us(lat, iters, 99),
+			percentile_us(lat, iters, 99.9), lat[iters - 1] / 1000.0);
+}
+
+int run_bench(int fd, const struct write_param *param,
+				const struct bench_param *bench) {
+	struct write_param xfer = *param;
+	struct xring ring;
+	struct bench_bufs bufs;
+	__u64 *start, *lat;
+	__u64 t0;
+	unsigned long size;
+	int err = 0;
+
+	start = calloc(bench->depth, sizeof(*start));
+	lat = calloc(bench->iters, sizeof(*lat));
+	if(!start || !lat) {
+		err = -ENOMEM;
+		err_info(err, "Failed to alloc latency samples\n");
+		goto out_free;
+	}
+
+	err = xring_init(&ring, fd, bench->depth);
+	if(err) {
+		goto out_free;
+	}
+
+	printf(" %-10s %-10s %-12s %-12s %-10s %-10s %-10s %-10s\n",
+			"#bytes", "#iters", "BW[MB/s]", "MsgRate[Mpps]",
+			"p50[us]", "p99[us]", "p99.9[us]", "max[us]");
+	for(size = bench->min_size; size <= bench->max_size; size *= 2) {
+		if(bench->use_pool)
+			err = alloc_pool_bufs(fd, param, size, bench->depth, &bufs);
+		else
+			err = alloc_bufs(fd, param, size, bench->depth, bench->contig,
+						&bufs);
+		if(err) {
+			break;
+		}
+
+		xfer.length = size;
+		t0 = now_ns();
+		err = run_size(&ring, &xfer, &bufs, bench->depth,
+					bench->iters, start, lat);
+		if(!err)
+			report(size, bench->iters, now_ns() - t0, lat);
+		free_bufs(fd, &bufs);
+		if(err) {
+			break;
+		}
+	}
+
+	xring_exit(&ring);
+out_free:
+	free(lat);
+	free(start);
+	return err;
+}
@@ -0,0 +1,26 @@
+#ifndef __USER_BENCH_H__
+#define __USER_BENCH_H__
+
+#include "common.h"
+
+/*
+ * A sweep over transfer sizes, from min_size to max_size in powers of
+ * two, with iters transfers per size and depth of them in flight. The
+ * buffers are pinned user memory, or come from the device pool with
+ * use_pool. With contig, the user memory is collapsed into transparent
+ * huge pages before it is pinned.
+ */
+struct bench_param {
+	unsigned long				min_size;
+	unsigned long				max_size;
+	int							iters;
+	int							depth;
+	int							use_pool;
+	int							contig;
+};
+
+extern int parse_size_range(const char *str, struct bench_param *bench);
+extern int run_bench(int fd, const struct write_param *param,
+			const struct bench_param *bench);
+
+#endif
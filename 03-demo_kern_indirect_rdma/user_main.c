@@ -5,8 +5,14 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <signal.h>
+#include "user_uring.h"
+#include "user_ring.h"
+#include "user_bench.h"
+#include "../common/user_numa.h"
 #include "common.h"
 
 #define MAX(a, b)		((a)>(b)? (a): (b))
@@ -14,17 +20,94 @@
 
 #define MAXSIZE						4096
 
+#define NODE_NONE					(-2)
+#define NODE_OF_DEVICE				(-1)
+
 static void usage(const char *argv0) {
 	fprintf(stderr, "Usage:\n"
-		"%s -d [dev_name] -p [tcp_port] -i [ibv_port] -x [sgid_index] [servername]\n"
+		"%s -d [dev_name] -p [tcp_port] -i [ibv_port] -x [sgid_index] "
+		"[-a r|w|rw] [-c] [-n node|dev] [-m dma|iova|frmr] [-o send|write|read] [-q nr_qps] [-r] [-s depth] [-t] [-u] [-b iters [-l size[:max_size]] [-P]] [-S] [servername]\n"
 		"\n"
 		"If a servername is specified at last, "
 		"this program will run as a client connecting to the specified server. "
-		"Otherwise, it will start as a server\n\n", argv0);
+		"Otherwise, it will start as a server\n\n"
+		"-a declares how the device accesses the buffer: r (read-only), "
+		"w (write-only) or rw (bidirectional). By default the client buffer "
+		"is read-only and the server buffer is write-only, and the other "
+		"way round for -o read\n\n"
+		"-c collapses the benchmark buffers into transparent huge pages "
+		"before they are registered, and prints how many sg entries they "
+		"took before and after\n\n"
+		"-n moves the buffer to the given NUMA node, or to the node "
+		"of the RDMA device with \"dev\", before it is pinned\n\n"
+		"-m selects how the mapped buffer is posted: dma posts one SGE per "
+		"DMA segment, iova posts the buffer as one segment if the IOMMU mapped "
+		"it into one contiguous IOVA range and falls back to frmr otherwise, "
+		"frmr registers the segments through a fast-registration MR\n\n"
+		"-o selects the operation: send (two-sided, the default), write "
+		"(the client writes its buffer into the server buffer) or read "
+		"(the client reads the server buffer into its own)\n\n"
+		"-q stripes the transfer over the given number of QPs, each "
+		"completing on its own completion vector; both sides must use the "
+		"same number\n\n"
+		"-r establishes the connection through rdma_cm instead of "
+		"a kernel TCP socket\n\n"
+		"-s registers the given number of buffers once and keeps that many "
+		"transfers in flight through the shared submission and completion "
+		"rings of the device; both sides must use the same number\n\n"
+		"-t streams the buffer: the kernel pins, maps and transfers it one "
+		"segment at a time and unpins each segment once it is sent, so "
+		"nothing stays pinned afterwards\n\n"
+		"-u submits the transfer and the unpin of the buffer as one linked "
+		"batch through io_uring instead of write()\n\n"
+		"-b runs a benchmark of the given number of transfers per size "
+		"through the rings, with the depth of -s (1 by default), and "
+		"reports bandwidth, message rate and latency percentiles; -l gives "
+		"the sizes, swept in powers of two (64:1M by default, K, M and G "
+		"suffixes allowed); both sides must use the same -b, -l and -s\n\n"
+		"-P takes the benchmark buffers from the huge-page pool of the "
+		"device, which is DMA-mapped once, instead of pinning and mapping "
+		"user memory for them\n\n"
+		"-S starts a sink server in the kernel, which accepts any number "
+		"of clients on the port and receives their send transfers into one "
+		"shared receive queue, until the program is interrupted; clients "
+		"connect with the default -o send and a single QP\n\n",
+		argv0);
+}
+
+static int parse_map_mode(const char *str) {
+	if(!strcmp(str, "dma"))
+		return MAP_MODE_DMA;
+	if(!strcmp(str, "iova"))
+		return MAP_MODE_IOVA;
+	if(!strcmp(str, "frmr"))
+		return MAP_MODE_FRMR;
+	return -1;
+}
+
+static int parse_opcode(const char *str) {
+	if(!strcmp(str, "send"))
+		return XFER_OP_SEND;
+	if(!strcmp(str, "write"))
+		return XFER_OP_WRITE;
+	if(!strcmp(str, "read"))
+		return XFER_OP_READ;
+	return -1;
+}
+
+static int parse_access(const char *str) {
+	if(!strcmp(str, "r"))
+		return ACCESS_READ_ONLY;
+	if(!strcmp(str, "w"))
+		return ACCESS_WRITE_ONLY;
+	if(!strcmp(str, "rw"))
+		return ACCESS_BIDIRECTIONAL;
+	return -1;
 }
 
 static int parse_param(int argc, char *argv[],
-							struct write_param *param) {
+				struct write_param *param, int *p_node, int *p_uring,
+				int *p_depth, struct bench_param *bench, int *p_serve) {
 	int err = 0;
 	int cur_opt;
 	unsigned short tcp_port;
@@ -38,7 +121,15 @@ static int parse_param(int argc, char *argv[],
 	memset(param, 0, sizeof(*param));
 	param->s_addr.sin_family = AF_INET;
 	param->s_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	while((cur_opt = getopt(argc, argv, "d:p:i:x:h")) != -1) {
+	param->access = -1;
+	*p_node = NODE_NONE;
+	*p_uring = 0;
+	*p_depth = 0;
+	*p_serve = 0;
+	memset(bench, 0, sizeof(*bench));
+	bench->min_size = 64;
+	bench->max_size = 1 << 20;
+	while((cur_opt = getopt(argc, argv, "d:p:i:x:a:cn:m:o:q:rs:tub:l:PSh")) != -1) {
 		switch(cur_opt) {
 		case 'd':
 			strncpy(param->dev_name, optarg,
@@ -54,6 +145,89 @@ static int parse_param(int argc, char *argv[],
 		case 'x':
 			param->sgid_index = atoi(optarg);
 			break;
+		case 'a':
+			param->access = parse_access(optarg);
+			if(param->access < 0) {
+				err = -EINVAL;
+				err_info(err, "Invalid access: %s\n", optarg);
+				usage(argv[0]);
+				return err;
+			}
+			break;
+		case 'c':
+			bench->contig = 1;
+			break;
+		case 'n':
+			*p_node = strcmp(optarg, "dev")? atoi(optarg): NODE_OF_DEVICE;
+			break;
+		case 'm':
+			param->map_mode = parse_map_mode(optarg);
+			if(param->map_mode < 0) {
+				err = -EINVAL;
+				err_info(err, "Invalid map mode: %s\n", optarg);
+				usage(argv[0]);
+				return err;
+			}
+			break;
+		case 'o':
+			param->opcode = parse_opcode(optarg);
+			if(param->opcode < 0) {
+				err = -EINVAL;
+				err_info(err, "Invalid operation: %s\n", optarg);
+				usage(argv[0]);
+				return err;
+			}
+			break;
+		case 'q':
+			param->nr_qps = atoi(optarg);
+			if(param->nr_qps <= 0) {
+				err = -EINVAL;
+				err_info(err, "Invalid number of QPs: %s\n", optarg);
+				usage(argv[0]);
+				return err;
+			}
+			break;
+		case 'r':
+			param->flags |= CONN_F_RDMA_CM;
+			break;
+		case 's':
+			*p_depth = atoi(optarg);
+			if(*p_depth <= 0) {
+				err = -EINVAL;
+				err_info(err, "Invalid ring depth: %s\n", optarg);
+				usage(argv[0]);
+				return err;
+			}
+			break;
+		case 't':
+			param->flags |= XFER_F_STREAM;
+			break;
+		case 'u':
+			*p_uring = 1;
+			break;
+		case 'b':
+			bench->iters = atoi(optarg);
+			if(bench->iters <= 0) {
+				err = -EINVAL;
+				err_info(err, "Invalid number of iterations: %s\n", optarg);
+				usage(argv[0]);
+				return err;
+			}
+			break;
+		case 'l':
+			if(parse_size_range(optarg, bench)) {
+				err = -EINVAL;
+				err_info(err, "Invalid sizes: %s\n", optarg);
+				usage(argv[0]);
+				return err;
+			}
+			break;
+		case 'P':
+			bench->use_pool = 1;
+			break;
+		case 'S':
+			*p_serve = 1;
+			break;
 		case 'h':
 			usage(argv[0]);
 			err = EINVAL;
@@ -66,6 +240,14 @@ static int parse_param(int argc, char *argv[],
 		}
 	}
 
+	/* The buffer of a single transfer is one page, pool buffers are huge */
+	if(bench->contig && (!bench->iters || bench->use_pool)) {
+		err = -EINVAL;
+		err_info(err, "-c takes -b without -P\n");
+		usage(argv[0]);
+		return err;
+	}
+
 	if(optind == argc - 1) {
 		err = inet_pton(AF_INET, argv[argc-1],
 							&param->s_addr.sin_addr);
@@ -91,13 +273,236 @@ static inline int is_server(const struct write_param *param) {
 	return (param->s_addr.sin_addr.s_addr == htonl(INADDR_ANY));
 }
 
+static int dev_numa_node(int fd, const struct write_param *param) {
+	struct dev_node_param node_param;
+	int err = 0;
+
+	memset(&node_param, 0, sizeof(node_param));
+	memcpy(node_param.dev_name, param->dev_name, sizeof(node_param.dev_name));
+	err = ioctl(fd, IOCTL_DEV_NODE, &node_param);
+	if(err < 0) {
+		err = -errno;
+		err_info(err, "Failed to get the node of %s\n", param->dev_name);
+		return err;
+	}
+
+	if(node_param.node < 0) {
+		err = -EINVAL;
+		err_info(err, "%s has no NUMA affinity, specify a node\n",
+					param->dev_name);
+		return err;
+	}
+
+	return node_param.node;
+}
+
+/* The pages are moved from here, the module cannot migrate them itself */
+static int move_buf_to_node(int fd, const struct write_param *param,
+				int node) {
+	unsigned long nr_moved;
+	int err = 0;
+
+	if(node == NODE_OF_DEVICE) {
+		node = dev_numa_node(fd, param);
+		if(node < 0) {
+			return node;
+		}
+	}
+
+	err = move_to_node((void *)param->virtaddr, param->length, node,
+				&nr_moved);
+	if(err) {
+		err_info(err, "Failed to move to node %d\n", node);
+		return err;
+	}
+
+	dbg_info("%lu pages on node %d\n", nr_moved, node);
+	return err;
+}
+
+static int transfer_by_uring(int fd, struct write_param *param) {
+	struct uring ring;
+	struct uring_cmd_param cmd = {
+		.param			= (__u64)(unsigned long)param,
+	};
+	/* A streamed transfer leaves nothing to unpin */
+	int nr = (param->flags & XFER_F_STREAM)? 1: 2;
+	__u64 user_data;
+	int res, i;
+	int err = 0;
+
+	err = uring_init(&ring, 4);
+	if(err) {
+		return err;
+	}
+
+	uring_queue_cmd(&ring, fd, URING_CMD_TRANSFER, &cmd,
+				(nr > 1)? IOSQE_IO_LINK: 0, URING_CMD_TRANSFER);
+	if(nr > 1) {
+		uring_queue_cmd(&ring, fd, URING_CMD_UNPIN, &cmd,
+					0, URING_CMD_UNPIN);
+	}
+
+	err = uring_submit_and_wait(&ring, nr);
+	if(err < 0) {
+		goto out;
+	}
+	err = 0;
+
+	for(i = 0; i < nr; i++) {
+		while(!uring_reap(&ring, &user_data, &res));
+		/* An eager send is copied instead of pinned, and leaves nothing to unpin */
+		if(res == -ENOENT && user_data == URING_CMD_UNPIN)
+			continue;
+		if(res < 0) {
+			err_info(res, "uring cmd %llu failed\n", user_data);
+			if(!err)
+				err = res;
+		}
+	}
+
+out:
+	uring_exit(&ring);
+	return err;
+}
+
+/*
+ * Every buffer is a registered region, which carries one transfer at a
+ * time, so depth buffers keep depth transfers in flight. The content of
+ * the first one is copied back into buf.
+ */
+static int transfer_by_ring(int fd, struct write_param *param,
+				char *buf, int depth) {
+	struct xring ring;
+	struct write_param xfer = *param;
+	__u64 *handles;
+	char *bufs;
+	__u64 user_data;
+	int nr_reg, done, res, i;
+	int err = 0;
+
+	bufs = malloc((size_t)depth * MAXSIZE);
+	handles = calloc(depth, sizeof(*handles));
+	if(!bufs || !handles) {
+		err = -ENOMEM;
+		err_info(err, "Failed to alloc %d buffers\n", depth);
+		goto err_alloc;
+	}
+
+	for(nr_reg = 0; nr_reg < depth; nr_reg++) {
+		memcpy(bufs + (size_t)nr_reg * MAXSIZE, buf, MAXSIZE);
+		xfer.virtaddr = (unsigned long)(bufs + (size_t)nr_reg * MAXSIZE);
+		err = xring_register(fd, &xfer, &handles[nr_reg]);
+		if(err) {
+			goto err_reg;
+		}
+	}
+
+	err = xring_init(&ring, fd, depth);
+	if(err) {
+		goto err_reg;
+	}
+
+	for(i = 0; i < depth; i++) {
+		xfer.virtaddr = (unsigned long)(bufs + (size_t)i * MAXSIZE);
+		err = xring_queue(&ring, &xfer, handles[i], i);
+		if(err) {
+			err_info(err, "SQ full at %d\n", i);
+			break;
+		}
+	}
+
+	res = xring_submit(&ring);
+	if(res) {
+		err = res;
+		goto out;
+	}
+
+	for(done = 0; done < i; ) {
+		if(!xring_reap(&ring, &user_data, &res)) {
+			res = xring_wait(&ring, 1);
+			if(res) {
+				err = res;
+				goto out;
+			}
+			continue;
+		}
+
+		if(res < 0) {
+			err_info(res, "Ring transfer %llu failed\n", user_data);
+			if(!err)
+				err = res;
+		}
+		done++;
+	}
+
+	memcpy(buf, bufs, MAXSIZE);
+
+out:
+	xring_exit(&ring);
+err_reg:
+	while(nr_reg--)
+		xring_deregister(fd, handles[nr_reg]);
+err_alloc:
+	free(handles);
+	free(bufs);
+	return err;
+}
+
+/*
+ * The sink server runs in the kernel; this only starts it and stops it
+ * again on SIGINT or SIGTERM.
+ */
+static int run_sink_server(int fd, const struct write_param *param) {
+	struct srv_param srv_param;
+	sigset_t sigs;
+	int sig;
+	int err = 0;
+
+	memset(&srv_param, 0, sizeof(srv_param));
+	memcpy(srv_param.dev_name, param->dev_name, sizeof(srv_param.dev_name));
+	srv_param.s_addr = param->s_addr;
+	srv_param.rdma_port = param->rdma_port;
+	srv_param.sgid_index = param->sgid_index;
+
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+
+	err = ioctl(fd, IOCTL_SRV_START, &srv_param);
+	if(err < 0) {
+		err = -errno;
+		err_info(err, "Failed to start server\n");
+		return err;
+	}
+
+	fprintf(stderr, "Serving on port %u, interrupt to stop\n",
+				ntohs(srv_param.s_addr.sin_port));
+	sigwait(&sigs, &sig);
+
+	err = ioctl(fd, IOCTL_SRV_STOP, &srv_param);
+	if(err < 0) {
+		err = -errno;
+		err_info(err, "Failed to stop server\n");
+	}
+
+	return err;
+}
+
 int main(int argc, char *argv[]) {
 	int err = 0;
 	char buf[MAXSIZE];
 	int fd;
 	struct write_param param;
+	int node;
+	int use_uring;
+	int ring_depth;
+	struct bench_param bench;
+	int serve;
 
-	err = parse_param(argc, argv, &param);
+	err = parse_param(argc, argv, &param, &node, &use_uring,
+				&ring_depth, &bench, &serve);
 	if(err > 0) {
 		return 0;
 	}
@@ -107,6 +512,10 @@ int main(int argc, char *argv[]) {
 
 	param.virtaddr = (unsigned long)buf;
 	param.length = sizeof(buf);
+	if(param.access < 0) {
+		param.access = (is_server(&param) ^ (param.opcode == XFER_OP_READ))?
+					ACCESS_WRITE_ONLY: ACCESS_READ_ONLY;
+	}
 
 	if(is_server(&param)) {
 		strcpy(buf, "I'm server!");
@@ -115,21 +524,64 @@ int main(int argc, char *argv[]) {
 		strcpy(buf, "Hello, I'm client!");
 	}
 
-	fd = open("/dev/" DEV_NAME, O_WRONLY);
+	fd = open("/dev/" DEV_NAME, O_RDWR);
 	if(fd < 0) {
 		err = -errno;
 		err_info(err, "Failed to open /dev/" DEV_NAME "\n");
 		return err;
 	}
 
-	err = write(fd, &param, sizeof(struct write_param));
-	if(err < 0) {
-		err = -errno;
-		err_info(err, "Failed to write param\n");
+	if(serve) {
+		if(!is_server(&param)) {
+			err = -EINVAL;
+			err_info(err, "-S takes no servername\n");
+		}
+		else {
+			err = run_sink_server(fd, &param);
+		}
 		close(fd);
 		return err;
 	}
 
+	if(node != NODE_NONE) {
+		err = move_buf_to_node(fd, &param, node);
+		if(err) {
+			close(fd);
+			return err;
+		}
+	}
+
+	if(bench.iters) {
+		bench.depth = MAX(ring_depth, 1);
+		err = run_bench(fd, &param, &bench);
+		close(fd);
+		return err;
+	}
+
+	if(ring_depth) {
+		err = transfer_by_ring(fd, &param, buf, ring_depth);
+		if(err) {
+			close(fd);
+			return err;
+		}
+	}
+	else if(use_uring) {
+		err = transfer_by_uring(fd, &param);
+		if(err) {
+			close(fd);
+			return err;
+		}
+	}
+	else {
+		err = write(fd, &param, sizeof(struct write_param));
+		if(err < 0) {
+			err = -errno;
+			err_info(err, "Failed to write param\n");
+			close(fd);
+			return err;
+		}
+	}
+
 	PRINT("%s", (char*)buf);
 	close(fd);
 
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include "user_ring.h"
+#include "common.h"
+
+/*
+ * Submissions and completions go through shared memory. A system call is
+ * only made to wake the kernel worker up once it has gone to sleep, or to
+ * block for completions.
+ */
+
+int xring_init(struct xring *ring, int dev_fd, unsigned int entries) {
+	struct ring_setup_param p;
+	int err = 0;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	p.sq_entries = entries;
+	p.cq_entries = entries;
+	err = ioctl(dev_fd, IOCTL_RING_SETUP, &p);
+	if(err < 0) {
+		err = -errno;
+		err_info(err, "Failed to set up rings\n");
+		return err;
+	}
+
+	ring->mem = mmap(NULL, p.ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, dev_fd, 0);
+	if(ring->mem == MAP_FAILED) {
+		err = -errno;
+		err_info(err, "Failed to map rings\n");
+		return err;
+	}
+
+	ring->fd = dev_fd;
+	ring->size = p.ring_size;
+	ring->hdr = ring->mem;
+	ring->sqes = (struct ring_sqe*)((char*)ring->mem + p.sqes_off);
+	ring->cqes = (struct ring_cqe*)((char*)ring->mem + p.cqes_off);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_entries = p.cq_entries;
+	ring->sq_tail = ring->hdr->sq_tail;
+	return err;
+}
+
+/* The rings themselves are freed when the device file is closed */
+void xring_exit(struct xring *ring) {
+	munmap(ring->mem, ring->size);
+}
+
+int xring_register(int dev_fd, const struct write_param *param,
+			__u64 *p_handle) {
+	struct reg_param reg;
+	int err = 0;
+
+	memset(&reg, 0, sizeof(reg));
+	memcpy(reg.dev_name, param->dev_name, sizeof(reg.dev_name));
+	reg.virtaddr = param->virtaddr;
+	reg.length = param->length;
+	reg.access = param->access;
+	reg.flags = param->flags;
+	err = ioctl(dev_fd, IOCTL_REG_REGION, &reg);
+	if(err < 0) {
+		err = -errno;
+		err_info(err, "Failed to register 0x%lx\n", param->virtaddr);
+		return err;
+	}
+
+	*p_handle = reg.handle;
+	return err;
+}
+
+int xring_deregister(int dev_fd, __u64 handle) {
+	int err;
+
+	err = ioctl(dev_fd, IOCTL_DEREG_REGION, &handle);
+	if(err < 0) {
+		err = -errno;
+		err_info(err, "Failed to deregister %llu\n", handle);
+	}
+	return err;
+}
+
+int xring_pool_alloc(int dev_fd, const char *dev_name, size_t length,
+			__u64 *p_handle, void **p_mem) {
+	struct pool_param pool;
+	void *mem;
+	int err = 0;
+
+	memset(&pool, 0, sizeof(pool));
+	strncpy(pool.dev_name, dev_name, sizeof(pool.dev_name) - 1);
+	pool.length = length;
+	err = ioctl(dev_fd, IOCTL_POOL_ALLOC, &pool);
+	if(err < 0) {
+		err = -errno;
+		err_info(err, "Failed to alloc %zu bytes from the pool\n", length);
+		return err;
+	}
+
+	mem = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+				dev_fd, (off_t)pool.mmap_offset);
+	if(mem == MAP_FAILED) {
+		err = -errno;
+		err_info(err, "Failed to mmap pool buffer %llu\n", pool.handle);
+		xring_deregister(dev_fd, pool.handle);
+		return err;
+	}
+
+	*p_handle = pool.handle;
+	*p_mem = mem;
+	return err;
+}
+
+int xring_queue(struct xring *ring, const struct write_param *param,
+			__u64 handle, __u64 user_data) {
+	unsigned int head = __atomic_load_n(&ring->hdr->sq_head, __ATOMIC_ACQUIRE);
+	struct ring_sqe *sqe;
+
+	if(ring->sq_tail - head >= ring->sq_entries)
+		return -EBUSY;
+
+	sqe = &ring->sqes[ring->sq_tail & (ring->sq_entries - 1)];
+	sqe->user_data = user_data;
+	sqe->handle = handle;
+	memcpy(&sqe->param, param, sizeof(*param));
+	ring->sq_tail++;
+	return 0;
+}
+
+static int xring_enter(struct xring *ring, unsigned int flags,
+			unsigned int min_complete) {
+	struct ring_enter_param p = {
+		.flags			= flags,
+		.min_complete	= min_complete,
+	};
+	int err;
+
+	err = ioctl(ring->fd, IOCTL_RING_ENTER, &p);
+	if(err < 0) {
+		err = -errno;
+		err_info(err, "Failed to enter rings\n");
+	}
+	return err;
+}
+
+static int need_wakeup(struct xring *ring) {
+	return __atomic_load_n(&ring->hdr->flags, __ATOMIC_RELAXED) &
+				RING_F_NEED_WAKEUP;
+}
+
+/* Publishes the queued SQEs, and rings the doorbell if the worker sleeps */
+int xring_submit(struct xring *ring) {
+	__atomic_store_n(&ring->hdr->sq_tail, ring->sq_tail, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(need_wakeup(ring))
+		return xring_enter(ring, RING_ENTER_F_WAKEUP, 0);
+	return 0;
+}
+
+/*
+ * Blocks until min_complete CQEs can be reaped. Reaping frees CQ slots
+ * for SQEs the worker had to leave in the SQ, so a sleeping worker is
+ * woken up as well.
+ */
+int xring_wait(struct xring *ring, unsigned int min_complete) {
+	unsigned int flags = RING_ENTER_F_GETEVENTS;
+
+	if(need_wakeup(ring))
+		flags |= RING_ENTER_F_WAKEUP;
+	return xring_enter(ring, flags, min_complete);
+}
+
+int xring_reap(struct xring *ring, __u64 *p_user_data, int *p_res) {
+	unsigned int head = ring->hdr->cq_head;
+	struct ring_cqe *cqe;
+
+	if(head == __atomic_load_n(&ring->hdr->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	cqe = &ring->cqes[head & (ring->cq_entries - 1)];
+	*p_user_data = cqe->user_data;
+	*p_res = cqe->res;
+	__atomic_store_n(&ring->hdr->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
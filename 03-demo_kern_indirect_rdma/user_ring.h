@@ -0,0 +1,37 @@
+#ifndef __USER_RING_H__
+#define __USER_RING_H__
+
+#include "common.h"
+
+/* User side of the shared submission and completion rings of the device */
+struct xring {
+	int							fd;
+	void						*mem;
+	size_t						size;
+	struct ring_hdr				*hdr;
+	struct ring_sqe				*sqes;
+	struct ring_cqe				*cqes;
+	unsigned int				sq_entries;
+	unsigned int				cq_entries;
+	unsigned int				sq_tail;
+};
+
+extern int xring_init(struct xring *ring, int dev_fd, unsigned int entries);
+extern void xring_exit(struct xring *ring);
+
+extern int xring_register(int dev_fd, const struct write_param *param,
+			__u64 *p_handle);
+extern int xring_deregister(int dev_fd, __u64 handle);
+
+/* A buffer of the device pool, registered as *p_handle and mapped at *p_mem */
+extern int xring_pool_alloc(int dev_fd, const char *dev_name, size_t length,
+			__u64 *p_handle, void **p_mem);
+
+/* Queues one transfer; nothing is visible to the kernel until xring_submit */
+extern int xring_queue(struct xring *ring, const struct write_param *param,
+			__u64 handle, __u64 user_data);
+extern int xring_submit(struct xring *ring);
+extern int xring_wait(struct xring *ring, unsigned int min_complete);
+extern int xring_reap(struct xring *ring, __u64 *p_user_data, int *p_res);
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "user_uring.h"
+#include "common.h"
+
+/*
+ * A minimal io_uring front end on top of the raw system calls, enough to
+ * batch IORING_OP_URING_CMD requests to /dev/demo_indirect_rdma.
+ */
+
+static inline int sys_io_uring_setup(unsigned int entries,
+				struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned int to_submit,
+				unsigned int min_complete, unsigned int flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit,
+				min_complete, flags, NULL, 0);
+}
+
+int uring_init(struct uring *ring, unsigned int entries) {
+	struct io_uring_params p;
+	size_t sqes_size;
+	int err = 0;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if(ring->fd < 0) {
+		err = -errno;
+		err_info(err, "io_uring_setup error\n");
+		return err;
+	}
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sq_ptr == MAP_FAILED) {
+		err = -errno;
+		err_info(err, "Failed to map SQ ring\n");
+		goto err_sq;
+	}
+
+	ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	if(ring->cq_ptr == MAP_FAILED) {
+		err = -errno;
+		err_info(err, "Failed to map CQ ring\n");
+		goto err_cq;
+	}
+
+	ring->sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED) {
+		err = -errno;
+		err_info(err, "Failed to map SQEs\n");
+		goto err_sqes;
+	}
+
+	ring->sq_entries = p.sq_entries;
+	ring->sq_head = ring->sq_ptr + p.sq_off.head;
+	ring->sq_tail = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + p.sq_off.array;
+	ring->cq_head = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + p.cq_off.cqes;
+	return err;
+
+err_sqes:
+	munmap(ring->cq_ptr, ring->cq_size);
+err_cq:
+	munmap(ring->sq_ptr, ring->sq_size);
+err_sq:
+	close(ring->fd);
+	return err;
+}
+
+void uring_exit(struct uring *ring) {
+	munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+	munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+int uring_queue_cmd(struct uring *ring, int dev_fd, unsigned int cmd_op,
+			const struct uring_cmd_param *cmd, unsigned int sqe_flags,
+			__u64 user_data) {
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned int tail = *ring->sq_tail;
+	unsigned int idx;
+	struct io_uring_sqe *sqe;
+
+	if(tail - head >= ring->sq_entries)
+		return -EBUSY;
+
+	idx = tail & (*ring->sq_mask);
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = dev_fd;
+	sqe->cmd_op = cmd_op;
+	sqe->flags = sqe_flags;
+	sqe->user_data = user_data;
+	memcpy(sqe->cmd, cmd, sizeof(*cmd));
+
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+	return 0;
+}
+
+int uring_submit_and_wait(struct uring *ring, unsigned int wait_nr) {
+	int err;
+
+	err = sys_io_uring_enter(ring->fd, ring->to_submit, wait_nr,
+				wait_nr? IORING_ENTER_GETEVENTS: 0);
+	if(err < 0) {
+		err = -errno;
+		err_info(err, "io_uring_enter error\n");
+		return err;
+	}
+
+	ring->to_submit -= err;
+	return err;
+}
+
+int uring_reap(struct uring *ring, __u64 *p_user_data, int *p_res) {
+	unsigned int head = *ring->cq_head;
+	struct io_uring_cqe *cqe;
+
+	if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	cqe = &ring->cqes[head & (*ring->cq_mask)];
+	*p_user_data = cqe->user_data;
+	*p_res = cqe->res;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
@@ -0,0 +1,36 @@
+#ifndef __USER_URING_H__
+#define __USER_URING_H__
+
+#include <linux/io_uring.h>
+#include "common.h"
+
+struct uring {
+	int							fd;
+	unsigned int				sq_entries;
+	unsigned int				*sq_head;
+	unsigned int				*sq_tail;
+	unsigned int				*sq_mask;
+	unsigned int				*sq_array;
+	unsigned int				*cq_head;
+	unsigned int				*cq_tail;
+	unsigned int				*cq_mask;
+	struct io_uring_sqe			*sqes;
+	struct io_uring_cqe			*cqes;
+	void						*sq_ptr;
+	void						*cq_ptr;
+	size_t						sq_size;
+	size_t						cq_size;
+	unsigned int				to_submit;
+};
+
+extern int uring_init(struct uring *ring, unsigned int entries);
+extern void uring_exit(struct uring *ring);
+
+/* Queues one command; nothing is submitted until uring_submit_and_wait */
+extern int uring_queue_cmd(struct uring *ring, int dev_fd, unsigned int cmd_op,
+			const struct uring_cmd_param *cmd, unsigned int sqe_flags,
+			__u64 user_data);
+extern int uring_submit_and_wait(struct uring *ring, unsigned int wait_nr);
+extern int uring_reap(struct uring *ring, __u64 *p_user_data, int *p_res);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef __DEMO_COMPAT_H__
+#define __DEMO_COMPAT_H__
+
+#include <linux/version.h>
+#include <linux/mm.h>
+
+/*
+ * What the kernel modules of the demos need from kernels that differ in
+ * it, selected by LINUX_VERSION_CODE. Each demo still builds on its own;
+ * this header is only included by their kernel code.
+ */
+
+/*
+ * Pages are pinned for DMA (FOLL_PIN) with pin_user_pages() from 5.8 on,
+ * where the mmap lock also has its own API; GUP lost its vmas argument in
+ * 6.5. Older kernels take a page reference under mmap_sem.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define pin_pages(start, nr, flags, pages)	pin_user_pages(start, nr, flags, pages)
+#define unpin_page(page)					unpin_user_page(page)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+#define pin_pages(start, nr, flags, pages)	pin_user_pages(start, nr, flags, pages, NULL)
+#define unpin_page(page)					unpin_user_page(page)
+#else
+#define pin_pages(start, nr, flags, pages)	get_user_pages(start, nr, flags, pages, NULL)
+#define unpin_page(page)					put_page(page)
+#define mmap_read_lock(mm)					down_read(&(mm)->mmap_sem)
+#define mmap_read_unlock(mm)				up_read(&(mm)->mmap_sem)
+#endif
+
+/* The flags of a VMA are only changed through helpers from 6.3 on */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+static inline void vm_flags_clear(struct vm_area_struct *vma,
+				unsigned long flags) {
+	vma->vm_flags &= ~flags;
+}
+#endif
+
+/*
+ * io_uring passthrough commands (file_operations.uring_cmd) exist from
+ * 5.19 on, declared in their own header from 6.7 on. The command area of
+ * the SQE is reached through io_uring_sqe_cmd() from 6.4 on.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#include <linux/io_uring/cmd.h>
+#define HAVE_URING_CMD
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#include <linux/io_uring.h>
+#define HAVE_URING_CMD
+#endif
+
+#ifdef HAVE_URING_CMD
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+#define uring_cmd_payload(ioucmd)		io_uring_sqe_cmd((ioucmd)->sqe)
+#else
+#define uring_cmd_payload(ioucmd)		((ioucmd)->cmd)
+#endif
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef __USER_NUMA_H__
+#define __USER_NUMA_H__
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+/*
+ * Moving pages between NUMA nodes, shared by the user applications of the
+ * demos. The page migration core is not exported to modules, so the pages
+ * of a buffer are moved from user space with move_pages(2), before the
+ * buffer is handed to a module to be pinned. The raw system calls are
+ * used, so that libnuma is not needed.
+ */
+
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE					(1 << 1)
+#endif
+
+/* The node of the CPU the caller runs on, or a negative errno */
+static inline int current_numa_node(void) {
+	unsigned int cpu, node;
+
+	if(syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+		return -errno;
+	return (int)node;
+}
+
+/*
+ * Moves the pages of [addr, addr + length) to node, and returns in
+ * *p_nr_moved how many of them are on it afterwards. Every page is written
+ * first, so that a page never written is allocated instead of standing
+ * for the zero page, which is not moved. Pages mapped by other processes
+ * as well stay where they are.
+ */
+static inline int move_to_node(void *addr, size_t length, int node,
+				unsigned long *p_nr_moved) {
+	unsigned long page_size = sysconf(_SC_PAGESIZE);
+	unsigned long base = (unsigned long)addr & ~(page_size - 1);
+	unsigned long end = ((unsigned long)addr + length + page_size - 1) &
+				~(page_size - 1);
+	unsigned long count = (end - base) / page_size;
+	unsigned long i;
+	void **pages;
+	int *nodes, *status;
+	int err = 0;
+
+	*p_nr_moved = 0;
+	pages = calloc(count, sizeof(*pages));
+	nodes = calloc(count, sizeof(*nodes));
+	status = calloc(count, sizeof(*status));
+	if(!pages || !nodes || !status) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for(i = 0; i < count; i++) {
+		volatile char *p = (volatile char *)(base + i * page_size);
+
+		*p = *p;
+		pages[i] = (void *)p;
+		nodes[i] = node;
+	}
+
+	if(syscall(SYS_move_pages, 0, count, pages, nodes, status,
+				MPOL_MF_MOVE) < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	for(i = 0; i < count; i++) {
+		if(status[i] == node)
+			(*p_nr_moved)++;
+	}
+
+out:
+	free(status);
+	free(nodes);
+	free(pages);
+	return err;
+}
+
+#endif